@@ -0,0 +1,799 @@
+/*
+ * mdb-cluster.c
+ *
+ * Partitions a database across several mdb-lookup-server instances with
+ * consistent hashing, and routes queries to them.
+ *
+ * Every node owns a number of points on a hash ring. A record belongs to
+ * the first point at or after the hash of its record number, and is stored
+ * on the R distinct nodes met walking clockwise from there. Adding a node
+ * only takes over the ranges just before its points, so about 1/N of the
+ * records move.
+ *
+ *   mdb-cluster split [-R replicas] [-v points] [-f field:width,...] <database_file> <node>...
+ *     Writes the part of each node, <database_file>.<host>_<port>, and
+ *     <database_file>.<host>_<port>.ids with the record number of each of
+ *     its records in the whole database. -f gives the record layout as
+ *     for the server (see mdb-schema.h).
+ *
+ *   mdb-cluster serve [-R replicas] [-v points] <database_file> <Router Port> <node>...
+ *     Answers queries like a single server over the whole database. Each
+ *     query goes to a set of nodes that together hold every record, chosen
+ *     by how many queries each node already has. Each range of the ring is
+ *     read from the least loaded of its replicas in that set, so every
+ *     record is sent once, with its number in the whole database. A node
+ *     answers in the order of its part, which is the order of the whole
+ *     database, so merging the nodes' lines by record number sends them
+ *     in file order as a single server would. The points of a node that
+ *     fails are read again from their other replicas, from the record
+ *     after the last one it sent. Only key lookups are routed; the
+ *     servers' other commands get an ERROR line.
+ *
+ *   mdb-cluster moves [-R replicas] [-v points] <record_count> <node,...> <node,...>
+ *     Reports how many records would change nodes between two layouts.
+ *
+ * Nodes are named host:port, and split, serve and moves must be given the
+ * same names, replica count and number of points.
+ */
+
+#include "mdb-lookup-client.h"
+#include "mdb-schema.h"
+
+#include <stdio.h>      /* for printf() and fprintf() */
+#include <sys/socket.h> /* for socket(), bind(), and accept() */
+#include <arpa/inet.h>  /* for sockaddr_in */
+#include <stdlib.h>     /* for atoi(), exit() and qsort() */
+#include <string.h>     /* for memset() */
+#include <unistd.h>     /* for close() and getopt() */
+#include <signal.h>     /* for signal() */
+#include <errno.h>      /* for errno and EINTR */
+#include <sys/stat.h>   /* for stat() */
+#include <pthread.h>    /* for pthread_create() */
+#include <stdatomic.h>  /* for the node load counters */
+#include <stdint.h>     /* for uint32_t and uint64_t */
+
+#define MAX_NODES 64
+#define MAX_REPLICAS 8
+#define DEFAULT_REPLICAS 2
+#define DEFAULT_POINTS 64       /* Ring points per node */
+#define MAX_KEY_LENGTH 5        /* Must match the nodes' MAX_KEY_LENGTH */
+#define MAX_PENDING 128         /* Backlog of the listening socket */
+#define OUTPUT_BATCH 65536      /* Bytes of result sent to a client at a time */
+
+struct RingPoint {
+    uint64_t hash;
+    int node;
+};
+
+struct Ring {
+    const char *nodes[MAX_NODES];
+    int nodeCount;
+    int replicas;
+    struct RingPoint *points;
+    int pointCount;
+    int *replicaNodes;          /* replicas nodes for each point, in order */
+};
+
+/* A node as the router sees it */
+struct Node {
+    struct MdbPool *pool;
+    uint32_t *recordNumbers;    /* Number in the whole database of each record */
+    size_t recordCount;
+    atomic_int load;            /* Queries waiting for or running on the node */
+};
+
+static struct Ring ring;
+static struct Node nodes[MAX_NODES];
+static struct MdbSchema schema;     /* Record layout for split */
+
+/* Function to handle errors and terminate the program */
+static void terminate(const char *message)
+{
+    perror(message);
+    exit(1);
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage:  mdb-cluster split [-R replicas] [-v points] [-f field:width,...] <database_file> <node>...\n"
+                    "        mdb-cluster serve [-R replicas] [-v points] <database_file> <Router Port> <node>...\n"
+                    "        mdb-cluster moves [-R replicas] [-v points] <record_count> <node,...> <node,...>\n");
+    exit(1);
+}
+
+static uint64_t fnv1a(const char *bytes, size_t length)
+{
+    uint64_t hash = 14695981039346656037ULL;
+
+    for (size_t i = 0; i < length; i++)
+    {
+        hash ^= (unsigned char)bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/* Spread nearby values over the whole ring (the splitmix64 finalizer).
+ * Record numbers are consecutive, and point labels differ only in their
+ * last characters. */
+static uint64_t mix(uint64_t hash)
+{
+    hash += 0x9e3779b97f4a7c15ULL;
+    hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebULL;
+    return hash ^ (hash >> 31);
+}
+
+static int comparePoints(const void *left, const void *right)
+{
+    const struct RingPoint *a = (const struct RingPoint *)left;
+    const struct RingPoint *b = (const struct RingPoint *)right;
+    return a->hash < b->hash ? -1 : a->hash > b->hash;
+}
+
+/* Place pointsPerNode points for each node and list each point's replicas */
+static void buildRing(struct Ring *layout, char **names, int nodeCount, int replicas, int pointsPerNode)
+{
+    if (nodeCount < 1 || nodeCount > MAX_NODES || pointsPerNode < 1)
+        usage();
+
+    layout->nodeCount = nodeCount;
+    layout->replicas = replicas < 1 ? 1 : replicas > nodeCount ? nodeCount : replicas;
+    if (layout->replicas > MAX_REPLICAS)
+        layout->replicas = MAX_REPLICAS;
+    layout->pointCount = nodeCount * pointsPerNode;
+    layout->points = (struct RingPoint *)malloc(layout->pointCount * sizeof(struct RingPoint));
+    layout->replicaNodes = (int *)malloc(layout->pointCount * layout->replicas * sizeof(int));
+    if (!layout->points || !layout->replicaNodes)
+        terminate("malloc() failed");
+
+    for (int n = 0; n < nodeCount; n++)
+    {
+        layout->nodes[n] = names[n];
+        for (int p = 0; p < pointsPerNode; p++)
+        {
+            char label[300];
+            int labelLength = snprintf(label, sizeof(label), "%s#%d", names[n], p);
+            layout->points[n * pointsPerNode + p].hash = mix(fnv1a(label, labelLength));
+            layout->points[n * pointsPerNode + p].node = n;
+        }
+    }
+    qsort(layout->points, layout->pointCount, sizeof(struct RingPoint), comparePoints);
+
+    /* The first replicas distinct nodes clockwise from each point */
+    for (int p = 0; p < layout->pointCount; p++)
+    {
+        int *replicaNodes = &layout->replicaNodes[p * layout->replicas];
+        int found = 0;
+
+        for (int step = 0; found < layout->replicas; step++)
+        {
+            int node = layout->points[(p + step) % layout->pointCount].node;
+            int seen = 0;
+            for (int r = 0; r < found; r++)
+                seen |= replicaNodes[r] == node;
+            if (!seen)
+                replicaNodes[found++] = node;
+        }
+    }
+}
+
+/* Index of the point that owns a record */
+static int findPoint(const struct Ring *layout, uint64_t record)
+{
+    uint64_t hash = mix(record);
+    int low = 0, high = layout->pointCount;
+
+    while (low < high)
+    {
+        int middle = (low + high) / 2;
+        if (layout->points[middle].hash < hash)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return low == layout->pointCount ? 0 : low;
+}
+
+/* File name of a node's part: host:port becomes host_port */
+static void partFileName(char *buffer, size_t size, const char *database, const char *node, const char *suffix)
+{
+    snprintf(buffer, size, "%s.%s%s", database, node, suffix);
+    char *colon = strrchr(buffer + strlen(database) + 1, ':');
+    if (colon)
+        *colon = '_';
+}
+
+static int splitDatabase(const char *database)
+{
+    FILE *input, *parts[MAX_NODES], *ids[MAX_NODES];
+    size_t counts[MAX_NODES] = { 0 };
+    char record[MDB_SCHEMA_MAX_RECORD];
+    char fileName[1000];
+
+    if ((input = fopen(database, "rb")) == NULL)
+        terminate(database);
+
+    for (int n = 0; n < ring.nodeCount; n++)
+    {
+        partFileName(fileName, sizeof(fileName), database, ring.nodes[n], "");
+        if ((parts[n] = fopen(fileName, "wb")) == NULL)
+            terminate(fileName);
+        partFileName(fileName, sizeof(fileName), database, ring.nodes[n], ".ids");
+        if ((ids[n] = fopen(fileName, "wb")) == NULL)
+            terminate(fileName);
+    }
+
+    for (uint32_t index = 0; fread(record, schema.recordSize, 1, input) == 1; index++)
+    {
+        const int *replicaNodes = &ring.replicaNodes[findPoint(&ring, index) * ring.replicas];
+
+        for (int r = 0; r < ring.replicas; r++)
+        {
+            int n = replicaNodes[r];
+            if (fwrite(record, schema.recordSize, 1, parts[n]) != 1 || fwrite(&index, sizeof(index), 1, ids[n]) != 1)
+                terminate("fwrite() failed");
+            counts[n]++;
+        }
+    }
+    if (ferror(input))
+        terminate("fread() failed");
+    fclose(input);
+
+    for (int n = 0; n < ring.nodeCount; n++)
+    {
+        if (fclose(parts[n]) != 0 || fclose(ids[n]) != 0)
+            terminate("fclose() failed");
+        printf("%-24s %10zu records\n", ring.nodes[n], counts[n]);
+    }
+    return 0;
+}
+
+/* Compare two layouts: a record moves when its replica set changes */
+static int countMoves(unsigned long recordCount, char *oldNodes, char *newNodes, int replicas, int pointsPerNode)
+{
+    struct Ring layouts[2];
+    char *lists[2] = { oldNodes, newNodes };
+    unsigned long moved = 0, copies = 0;
+
+    for (int l = 0; l < 2; l++)
+    {
+        char *names[MAX_NODES];
+        int count = 0;
+
+        for (char *name = strtok(lists[l], ","); name; name = strtok(NULL, ","))
+        {
+            if (count == MAX_NODES)
+                usage();
+            names[count++] = name;
+        }
+        buildRing(&layouts[l], names, count, replicas, pointsPerNode);
+    }
+
+    for (unsigned long index = 0; index < recordCount; index++)
+    {
+        const int *before = &layouts[0].replicaNodes[findPoint(&layouts[0], index) * layouts[0].replicas];
+        const int *after = &layouts[1].replicaNodes[findPoint(&layouts[1], index) * layouts[1].replicas];
+        int changed = 0;
+
+        /* Count the copies the new layout needs that the old one lacks */
+        for (int a = 0; a < layouts[1].replicas; a++)
+        {
+            int kept = 0;
+            for (int b = 0; b < layouts[0].replicas; b++)
+                kept |= strcmp(layouts[1].nodes[after[a]], layouts[0].nodes[before[b]]) == 0;
+            if (!kept)
+            {
+                copies++;
+                changed = 1;
+            }
+        }
+        moved += changed;
+    }
+
+    printf("%lu of %lu records (%.1f%%) move; %lu copies to transfer\n",
+           moved, recordCount, recordCount ? moved * 100.0 / recordCount : 0.0, copies);
+    return 0;
+}
+
+/* Load each node's record numbers and open its connection pool */
+static void openNodes(const char *database)
+{
+    for (int n = 0; n < ring.nodeCount; n++)
+    {
+        char fileName[1000];
+        struct stat fileStatus;
+        FILE *input;
+
+        partFileName(fileName, sizeof(fileName), database, ring.nodes[n], ".ids");
+        if ((input = fopen(fileName, "rb")) == NULL || fstat(fileno(input), &fileStatus) < 0)
+            terminate(fileName);
+
+        nodes[n].recordCount = fileStatus.st_size / sizeof(uint32_t);
+        nodes[n].recordNumbers = (uint32_t *)malloc(fileStatus.st_size + 1);
+        if (!nodes[n].recordNumbers)
+            terminate("malloc() failed");
+        if (fread(nodes[n].recordNumbers, sizeof(uint32_t), nodes[n].recordCount, input) != nodes[n].recordCount)
+            terminate("fread() failed");
+        fclose(input);
+
+        /* A node serves one connection at a time; keep one open to it */
+        char host[300];
+        snprintf(host, sizeof(host), "%s", ring.nodes[n]);
+        char *colon = strrchr(host, ':');
+        if (!colon)
+            usage();
+        *colon = '\0';
+        if ((nodes[n].pool = mdbPoolCreate(host, colon + 1, 1, 0)) == NULL)
+            terminate("mdbPoolCreate() failed");
+    }
+}
+
+/* Lines of one node waiting for the merge: each is a struct QueuedLine
+ * followed by its text */
+struct MergeQueue {
+    char *data;
+    size_t head, length, capacity;
+    int done;                   /* The node's result is complete, or it failed */
+};
+
+struct QueuedLine {
+    uint32_t record;            /* Number in the whole database, from 0 */
+    uint32_t length;
+};
+
+/* The answer to one query, sent to the client in batches */
+struct RoutedQuery {
+    int clientSocket;
+    int failed;
+    int chosen[MAX_NODES];      /* Nodes queried this round, in ascending order */
+    int chosenCount;
+    int *readFrom;              /* The node each ring point is read from this round, or -1 */
+    uint32_t *firstRecord;      /* Records of each point before this one are already queued */
+    uint32_t sent[MAX_NODES];   /* Per chosen node: one past the last record it sent */
+    int queueOf[MAX_NODES];     /* Per chosen node: its queue */
+    struct MergeQueue *queues;  /* This round's and the lines left from earlier rounds */
+    int queueCount;
+    size_t length;
+    char buffer[OUTPUT_BATCH];
+};
+
+/* Send the whole buffer, retrying after interrupted or partial sends */
+static int sendFully(int socket, const char *buffer, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t sent = send(socket, buffer, length, MSG_NOSIGNAL);
+        if (sent < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buffer += sent;
+        length -= sent;
+    }
+    return 0;
+}
+
+static void flushQuery(struct RoutedQuery *query)
+{
+    if (!query->failed && sendFully(query->clientSocket, query->buffer, query->length) < 0)
+        query->failed = 1;
+    query->length = 0;
+}
+
+/*
+ * Choose the nodes for the needed ring points of a query, leaving out the
+ * excluded nodes: greedily take the node that holds the most needed points
+ * not covered yet, weighed against its load, until every one is covered.
+ * Then read each needed point from its least loaded chosen replica; the
+ * others are not read. Returns -1 if some needed point has no node left.
+ */
+static int chooseNodes(struct RoutedQuery *query, const char *needed, const char *excluded)
+{
+    char covered[ring.pointCount];
+    char taken[MAX_NODES] = { 0 };
+    int loads[MAX_NODES];
+    int uncovered = 0;
+
+    for (int p = 0; p < ring.pointCount; p++)
+    {
+        covered[p] = !needed[p];
+        uncovered += needed[p];
+    }
+    for (int n = 0; n < ring.nodeCount; n++)
+        loads[n] = nodes[n].load;
+
+    query->chosenCount = 0;
+    while (uncovered > 0)
+    {
+        int gains[MAX_NODES] = { 0 };
+        int best = -1;
+
+        for (int p = 0; p < ring.pointCount; p++)
+            for (int r = 0; !covered[p] && r < ring.replicas; r++)
+                if (!excluded[ring.replicaNodes[p * ring.replicas + r]])
+                    gains[ring.replicaNodes[p * ring.replicas + r]]++;
+
+        for (int n = 0; n < ring.nodeCount; n++)
+        {
+            /* gain / (1 + load), compared without division */
+            if (!taken[n] && gains[n] > 0 &&
+                (best < 0 || (long)gains[n] * (1 + loads[best]) > (long)gains[best] * (1 + loads[n])))
+                best = n;
+        }
+
+        if (best < 0)
+            return -1;
+        taken[best] = 1;
+        for (int p = 0; p < ring.pointCount; p++)
+        {
+            for (int r = 0; !covered[p] && r < ring.replicas; r++)
+            {
+                if (ring.replicaNodes[p * ring.replicas + r] == best)
+                {
+                    covered[p] = 1;
+                    uncovered--;
+                }
+            }
+        }
+    }
+
+    /* Ascending order, so concurrent queries take node connections in the
+     * same order and cannot deadlock */
+    for (int n = 0; n < ring.nodeCount; n++)
+    {
+        if (taken[n])
+            query->chosen[query->chosenCount++] = n;
+    }
+
+    for (int p = 0; p < ring.pointCount; p++)
+    {
+        int best = -1;
+        for (int r = 0; needed[p] && r < ring.replicas; r++)
+        {
+            int node = ring.replicaNodes[p * ring.replicas + r];
+            if (taken[node] && (best < 0 || loads[node] < loads[best]))
+                best = node;
+        }
+        query->readFrom[p] = best;
+    }
+    return 0;
+}
+
+/* Send queued lines in record order for as long as every node that is
+ * still answering has a line queued, so the smallest head is the next */
+static void mergeQueues(struct RoutedQuery *query)
+{
+    for (;;)
+    {
+        int best = -1;
+        struct QueuedLine bestLine, line;
+
+        for (int i = 0; i < query->queueCount; i++)
+        {
+            struct MergeQueue *queue = &query->queues[i];
+
+            if (queue->head == queue->length)
+            {
+                if (!queue->done)
+                    return;
+                continue;
+            }
+            memcpy(&line, queue->data + queue->head, sizeof(line));
+            if (best < 0 || line.record < bestLine.record)
+            {
+                best = i;
+                bestLine = line;
+            }
+        }
+        if (best < 0)
+            return;
+
+        struct MergeQueue *queue = &query->queues[best];
+        if (query->length + bestLine.length > sizeof(query->buffer))
+            flushQuery(query);
+        memcpy(query->buffer + query->length, queue->data + queue->head + sizeof(bestLine), bestLine.length);
+        query->length += bestLine.length;
+        queue->head += sizeof(bestLine) + bestLine.length;
+        if (queue->head == queue->length)
+            queue->head = queue->length = 0;
+    }
+}
+
+/* Keep a node's line if the node is where its point is read from,
+ * renumber it with the record's number in the whole database, and queue
+ * it for the merge. The rest of the line is kept as the node sent it, so
+ * nodes started with -f keep their own fields. */
+static void routeResult(void *context, int source, const struct MdbResult *result)
+{
+    struct RoutedQuery *query = (struct RoutedQuery *)context;
+    struct MergeQueue *queue = &query->queues[query->queueOf[source]];
+    int node = query->chosen[source];
+
+    if (!result)
+    {
+        queue->done = 1;
+        mergeQueues(query);
+        return;
+    }
+    const char *colon = memchr(result->line, ':', result->lineLength);
+    int number = atoi(result->line);
+    if (!colon || number < 1 || (size_t)number > nodes[node].recordCount)
+        return;
+
+    uint32_t record = nodes[node].recordNumbers[number - 1];
+    int point = findPoint(&ring, record);
+    query->sent[source] = record + 1;
+    if (query->readFrom[point] != node || record < query->firstRecord[point])
+        return;
+
+    struct QueuedLine line = { record, 0 };
+    size_t room = sizeof(line) + result->lineLength + 16;
+    if (queue->capacity - queue->length < room)
+    {
+        queue->capacity = queue->capacity * 2 > queue->length + room ? queue->capacity * 2 : queue->length + room + 4096;
+        if ((queue->data = (char *)realloc(queue->data, queue->capacity)) == NULL)
+            terminate("realloc() failed");
+    }
+    line.length = snprintf(queue->data + queue->length + sizeof(line), room - sizeof(line), "%4d%.*s", (int)(record + 1),
+                           (int)(result->line + result->lineLength - colon), colon);
+    memcpy(queue->data + queue->length, &line, sizeof(line));
+    queue->length += sizeof(line) + line.length;
+    mergeQueues(query);
+}
+
+/* A queue for a node's lines this round: one that is done and empty, or
+ * a new one */
+static int takeQueue(struct RoutedQuery *query)
+{
+    int i;
+
+    for (i = 0; i < query->queueCount; i++)
+    {
+        if (query->queues[i].done && query->queues[i].head == query->queues[i].length)
+            break;
+    }
+    if (i == query->queueCount)
+    {
+        query->queues = (struct MergeQueue *)realloc(query->queues, (i + 1) * sizeof(struct MergeQueue));
+        if (!query->queues)
+            terminate("realloc() failed");
+        memset(&query->queues[i], 0, sizeof(struct MergeQueue));
+        query->queueCount++;
+    }
+    query->queues[i].head = query->queues[i].length = query->queues[i].done = 0;
+    return i;
+}
+
+/*
+ * Answer one key over the nodes. A node that fails is left out, and the
+ * points read from it are asked again of their other replicas, from the
+ * record after the last one it sent. Its queued lines still count, and the
+ * merge waits for the new round, so the lines stay in record order. If a
+ * point has no replica left, the rest of the answer is an ERROR line.
+ */
+static int routeQuery(struct RoutedQuery *query, const char *searchKey)
+{
+    char needed[ring.pointCount];
+    char excluded[MAX_NODES] = { 0 };
+    int retry = 1, status = 0;
+
+    memset(needed, 1, sizeof(needed));
+    memset(query->firstRecord, 0, ring.pointCount * sizeof(uint32_t));
+    for (int i = 0; i < query->queueCount; i++)
+    {
+        query->queues[i].head = query->queues[i].length = 0;
+        query->queues[i].done = 1;
+    }
+    query->length = 0;
+
+    while (retry && (status = chooseNodes(query, needed, excluded)) == 0)
+    {
+        struct MdbPool *pools[MAX_NODES];
+
+        for (int i = 0; i < query->chosenCount; i++)
+        {
+            pools[i] = nodes[query->chosen[i]].pool;
+            nodes[query->chosen[i]].load++;
+            query->sent[i] = 0;
+            query->queueOf[i] = takeQueue(query);
+        }
+        if (mdbFanOut(pools, query->chosenCount, searchKey, routeResult, query) < 0)
+            fprintf(stderr, "a node failed to answer \"%s\"\n", searchKey);
+        for (int i = 0; i < query->chosenCount; i++)
+            nodes[query->chosen[i]].load--;
+
+        /* A node that failed never completed */
+        retry = 0;
+        memset(needed, 0, sizeof(needed));
+        for (int i = 0; i < query->chosenCount; i++)
+        {
+            struct MergeQueue *queue = &query->queues[query->queueOf[i]];
+            int node = query->chosen[i];
+
+            if (queue->done)
+                continue;
+            queue->done = 1;
+            excluded[node] = 1;
+            retry = 1;
+            for (int p = 0; p < ring.pointCount; p++)
+            {
+                if (query->readFrom[p] != node)
+                    continue;
+                needed[p] = 1;
+                if (query->sent[i] > query->firstRecord[p])
+                    query->firstRecord[p] = query->sent[i];
+            }
+        }
+    }
+
+    if (status < 0)
+    {
+        static const char refusal[] = "ERROR no nodes hold every record\n\n";
+        if (!query->failed && sendFully(query->clientSocket, refusal, sizeof(refusal) - 1) < 0)
+            query->failed = 1;
+        return query->failed ? -1 : 0;
+    }
+    mergeQueues(query);
+    query->buffer[query->length++] = '\n';
+    flushQuery(query);
+    return query->failed ? -1 : 0;
+}
+
+/* Serve one client's queries */
+static void *processClientRequest(void *argument)
+{
+    int clientSocket = (int)(long)argument;
+    FILE *clientInput = fdopen(clientSocket, "r");
+    struct RoutedQuery *query = (struct RoutedQuery *)calloc(1, sizeof(struct RoutedQuery));
+    char queryLine[1000];
+    char searchKey[MAX_KEY_LENGTH + 1];
+
+    if (clientInput == NULL || query == NULL || (query->readFrom = (int *)malloc(ring.pointCount * sizeof(int))) == NULL ||
+        (query->firstRecord = (uint32_t *)malloc(ring.pointCount * sizeof(uint32_t))) == NULL)
+    {
+        perror("processClientRequest() failed");
+        close(clientSocket);
+        if (query)
+            free(query->readFrom);
+        free(query);
+        return NULL;
+    }
+    query->clientSocket = clientSocket;
+
+    while (fgets(queryLine, sizeof(queryLine), clientInput) != NULL)
+    {
+        /* Only key lookups are routed; a command cut to a key would get
+         * some other key's result */
+        if (mdbIsCommand(queryLine) || strncmp(queryLine, "COMPRESS ", 9) == 0)
+        {
+            static const char refusal[] = "ERROR unsupported command\n\n";
+            if (sendFully(clientSocket, refusal, sizeof(refusal) - 1) < 0)
+                break;
+            continue;
+        }
+
+        /* The same cut as the nodes make */
+        strncpy(searchKey, queryLine, sizeof(searchKey) - 1);
+        searchKey[sizeof(searchKey) - 1] = '\0';
+        searchKey[strcspn(searchKey, "\r\n")] = '\0';
+
+        if (routeQuery(query, searchKey) < 0)
+            break;
+    }
+
+    for (int i = 0; i < query->queueCount; i++)
+        free(query->queues[i].data);
+    free(query->queues);
+    free(query->firstRecord);
+    free(query->readFrom);
+    free(query);
+    fclose(clientInput);
+    return NULL;
+}
+
+static int openListeningSocket(unsigned short port)
+{
+    struct sockaddr_in routerAddr;
+    int listenSocket, reuse = 1;
+
+    if ((listenSocket = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0)
+        terminate("socket() failed");
+    if (setsockopt(listenSocket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) < 0)
+        terminate("setsockopt() failed");
+
+    memset(&routerAddr, 0, sizeof(routerAddr));
+    routerAddr.sin_family = AF_INET;
+    routerAddr.sin_addr.s_addr = htonl(INADDR_ANY);
+    routerAddr.sin_port = htons(port);
+
+    if (bind(listenSocket, (struct sockaddr *)&routerAddr, sizeof(routerAddr)) < 0)
+        terminate("bind() failed");
+    if (listen(listenSocket, MAX_PENDING) < 0)
+        terminate("listen() failed");
+
+    return listenSocket;
+}
+
+static int serveQueries(const char *database, unsigned short port)
+{
+    openNodes(database);
+    signal(SIGPIPE, SIG_IGN);
+
+    int routerSocket = openListeningSocket(port);
+
+    for (;;)
+    {
+        struct sockaddr_in clientAddr;
+        socklen_t clientLength = sizeof(clientAddr);
+        pthread_t clientThread;
+
+        int clientSocket = accept(routerSocket, (struct sockaddr *)&clientAddr, &clientLength);
+        if (clientSocket < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            terminate("accept() failed");
+        }
+
+        /* Clients are served concurrently; each node serialises its own */
+        if (pthread_create(&clientThread, NULL, processClientRequest, (void *)(long)clientSocket) != 0)
+            terminate("pthread_create() failed");
+        pthread_detach(clientThread);
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int replicas = DEFAULT_REPLICAS;
+    int pointsPerNode = DEFAULT_POINTS;
+    int option;
+
+    if (argc < 2)
+        usage();
+    const char *mode = argv[1];
+
+    /* Options follow the mode */
+    argv++;
+    argc--;
+    mdbSchemaDefault(&schema);
+    while ((option = getopt(argc, argv, "R:v:f:")) != -1)
+    {
+        switch (option)
+        {
+        case 'f':
+            if (mdbSchemaParse(&schema, optarg) < 0)
+                usage();
+            break;
+        case 'R':
+            replicas = atoi(optarg);
+            break;
+        case 'v':
+            pointsPerNode = atoi(optarg);
+            break;
+        default:
+            usage();
+        }
+    }
+    argv += optind;
+    argc -= optind;
+
+    if (strcmp(mode, "split") == 0 && argc >= 2)
+    {
+        buildRing(&ring, argv + 1, argc - 1, replicas, pointsPerNode);
+        return splitDatabase(argv[0]);
+    }
+    if (strcmp(mode, "serve") == 0 && argc >= 3)
+    {
+        buildRing(&ring, argv + 2, argc - 2, replicas, pointsPerNode);
+        return serveQueries(argv[0], atoi(argv[1]));
+    }
+    if (strcmp(mode, "moves") == 0 && argc == 3)
+        return countMoves(strtoul(argv[0], NULL, 10), argv[1], argv[2], replicas, pointsPerNode);
+
+    usage();
+    return 1;
+}
@@ -0,0 +1,183 @@
+/*
+ * mdb-fold.c
+ *
+ * UTF-8 case folding; see mdb-fold.h.
+ */
+
+#include "mdb-fold.h"
+
+#include <stdint.h>     /* for uint32_t */
+#ifdef __SSE2__
+#include <emmintrin.h>  /* for _mm_cmpgt_epi8() */
+#endif
+
+/* Simple case folding of one code point below U+10000 */
+static uint32_t foldCodePoint(uint32_t c)
+{
+    if (c < 0x80)
+        return c >= 'A' && c <= 'Z' ? c + 0x20 : c;
+    if (c < 0x100)
+    {
+        if (c == 0xb5)
+            return 0x3bc;                       /* Micro sign to mu */
+        return c >= 0xc0 && c <= 0xde && c != 0xd7 ? c + 0x20 : c;
+    }
+    if (c < 0x180)
+    {
+        /* Pairs, upper case first: even from U+0100, odd from U+0139 and U+0179 */
+        if (c == 0x130 || c == 0x131 || c == 0x138 || c == 0x149)
+            return c;                           /* No simple folding */
+        if (c == 0x178)
+            return 0xff;
+        if (c == 0x17f)
+            return 's';                         /* Long s */
+        if ((c >= 0x139 && c <= 0x148) || (c >= 0x179 && c <= 0x17e))
+            return c % 2 ? c + 1 : c;
+        return c | 1;
+    }
+    if (c >= 0x370 && c < 0x400)
+    {
+        if (c == 0x386)
+            return 0x3ac;
+        if (c >= 0x388 && c <= 0x38a)
+            return c + 0x25;
+        if (c == 0x38c)
+            return 0x3cc;
+        if (c == 0x38e || c == 0x38f)
+            return c + 0x3f;
+        if ((c >= 0x391 && c <= 0x3a1) || (c >= 0x3a3 && c <= 0x3ab))
+            return c + 0x20;
+        if (c == 0x3c2)
+            return 0x3c3;                       /* Final sigma */
+        if ((c >= 0x370 && c <= 0x373) || c == 0x376 || (c >= 0x3d8 && c <= 0x3ef))
+            return c | 1;
+
+        /* Symbol forms of letters */
+        switch (c)
+        {
+        case 0x3d0: return 0x3b2;
+        case 0x3d1: return 0x3b8;
+        case 0x3d5: return 0x3c6;
+        case 0x3d6: return 0x3c0;
+        case 0x3f0: return 0x3ba;
+        case 0x3f1: return 0x3c1;
+        case 0x3f4: return 0x3b8;
+        case 0x3f5: return 0x3b5;
+        default: return c;
+        }
+    }
+    if (c >= 0x400 && c < 0x530)
+    {
+        if (c < 0x410)
+            return c + 0x50;
+        if (c < 0x430)
+            return c + 0x20;
+        if ((c >= 0x460 && c <= 0x481) || (c >= 0x48a && c <= 0x4bf) || c >= 0x4d0)
+            return c | 1;
+        if (c == 0x4c0)
+            return 0x4cf;
+        if (c >= 0x4c1 && c <= 0x4ce)
+            return c % 2 ? c + 1 : c;
+        return c;
+    }
+    if (c >= 0x531 && c <= 0x556)
+        return c + 0x30;                        /* Armenian */
+    if ((c >= 0x1e00 && c <= 0x1e95) || (c >= 0x1ea0 && c <= 0x1eff))
+        return c | 1;
+    if (c == 0x1e9e)
+        return 0xdf;                            /* Capital sharp s */
+    if (c == 0x2126)
+        return 0x3c9;                           /* Ohm sign to omega */
+    if (c == 0x212a)
+        return 'k';                             /* Kelvin sign */
+    if (c == 0x212b)
+        return 0xe5;                            /* Angstrom sign */
+    if (c >= 0xff21 && c <= 0xff3a)
+        return c + 0x20;                        /* Fullwidth A-Z */
+    return c;
+}
+
+static size_t encode(unsigned char *out, uint32_t c)
+{
+    if (c < 0x80)
+    {
+        out[0] = c;
+        return 1;
+    }
+    if (c < 0x800)
+    {
+        out[0] = 0xc0 | (c >> 6);
+        out[1] = 0x80 | (c & 0x3f);
+        return 2;
+    }
+    out[0] = 0xe0 | (c >> 12);
+    out[1] = 0x80 | ((c >> 6) & 0x3f);
+    out[2] = 0x80 | (c & 0x3f);
+    return 3;
+}
+
+size_t mdbFoldUtf8(char *out, const char *text, size_t length)
+{
+    const unsigned char *in = (const unsigned char *)text;
+    unsigned char *folded = (unsigned char *)out;
+    size_t i = 0, o = 0;
+
+    while (i < length)
+    {
+#ifdef __SSE2__
+        /* 16 ASCII bytes: add 0x20 to those from 'A' to 'Z'. The store may
+         * overlap input already read, never input still to come. */
+        if (i + 16 <= length)
+        {
+            __m128i bytes = _mm_loadu_si128((const __m128i *)(in + i));
+            if (_mm_movemask_epi8(bytes) == 0)
+            {
+                __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(bytes, _mm_set1_epi8('A' - 1)),
+                                              _mm_cmplt_epi8(bytes, _mm_set1_epi8('Z' + 1)));
+                _mm_storeu_si128((__m128i *)(folded + o), _mm_add_epi8(bytes, _mm_and_si128(upper, _mm_set1_epi8(0x20))));
+                i += 16;
+                o += 16;
+                continue;
+            }
+        }
+#endif
+        unsigned char lead = in[i];
+
+        if (lead < 0x80)
+        {
+            folded[o++] = lead >= 'A' && lead <= 'Z' ? lead + 0x20 : lead;
+            i++;
+            continue;
+        }
+
+        /* Two- and three-byte characters, without overlong forms; anything
+         * else, four-byte characters included, is copied a byte at a time */
+        uint32_t c = 0;
+        size_t size = 0;
+        if (lead >= 0xc2 && lead <= 0xdf && i + 1 < length && (in[i + 1] & 0xc0) == 0x80)
+        {
+            c = ((lead & 0x1f) << 6) | (in[i + 1] & 0x3f);
+            size = 2;
+        }
+        else if ((lead & 0xf0) == 0xe0 && i + 2 < length && (in[i + 1] & 0xc0) == 0x80 && (in[i + 2] & 0xc0) == 0x80)
+        {
+            c = ((lead & 0x0f) << 12) | ((in[i + 1] & 0x3f) << 6) | (in[i + 2] & 0x3f);
+            size = c >= 0x800 ? 3 : 0;
+        }
+        if (size == 0)
+        {
+            folded[o++] = in[i++];
+            continue;
+        }
+        i += size;
+        o += encode(folded + o, foldCodePoint(c));
+    }
+    return o;
+}
+
+size_t mdbUtf8Boundary(const char *text, size_t length)
+{
+    while (length > 0 && ((unsigned char)text[length] & 0xc0) == 0x80)
+        length--;
+    return length;
+}
@@ -0,0 +1,30 @@
+/*
+ * mdb-fold.h
+ *
+ * Case folding of UTF-8 text for case-insensitive matching. Folding maps
+ * each letter to one case (Unicode simple case folding) so that two
+ * strings differing only in letter case fold to the same bytes, and a
+ * substring search over folded text is a plain byte compare.
+ *
+ * The mappings cover ASCII, Latin-1, Latin Extended-A and Additional,
+ * Greek, Cyrillic, Armenian, the fullwidth Latin letters and the Kelvin,
+ * Angstrom and Ohm signs. Other characters, and bytes that are not valid
+ * UTF-8, are copied unchanged. No mapping makes a character longer, so
+ * folded text is never longer than the original.
+ */
+
+#ifndef MDB_FOLD_H
+#define MDB_FOLD_H
+
+#include <stddef.h>     /* for size_t */
+
+/* Fold length bytes of text into out, which may be text itself, and
+ * return the folded length. Runs of ASCII are folded 16 bytes at a time
+ * with SSE2. */
+size_t mdbFoldUtf8(char *out, const char *text, size_t length);
+
+/* The largest length up to the given one that does not end inside a
+ * character; text[length] must be readable */
+size_t mdbUtf8Boundary(const char *text, size_t length);
+
+#endif /* MDB_FOLD_H */
@@ -0,0 +1,169 @@
+/*
+ * mdb-lookup-bench.c
+ *
+ * Measures how mdb-lookup-server streams results: for each search key,
+ * the time from sending the query to the first byte of the response, and
+ * the throughput of the whole result up to its terminating blank line.
+ *
+ * Example usage:
+ *   ./mdb-lookup-bench localhost 8080 20 alice a ""
+ *
+ * Each key is queried <repetitions> times over one connection; the report
+ * gives the median and worst time to first byte, and the median total
+ * time with the throughput it corresponds to.
+ */
+
+#include <stdio.h>      /* for printf() and fprintf() */
+#include <stdlib.h>     /* for atoi(), exit() and qsort() */
+#include <string.h>     /* for memset() */
+#include <unistd.h>     /* for close() */
+#include <sys/socket.h> /* for socket(), connect() and recv() */
+#include <netdb.h>      /* for gethostbyname() */
+#include <arpa/inet.h>  /* for sockaddr_in */
+#include <time.h>       /* for clock_gettime() */
+
+#define BUFFER_SIZE 65536
+
+/* Function to handle errors and terminate the program */
+static void terminate(const char *message)
+{
+    perror(message);
+    exit(1);
+}
+
+/* Milliseconds from start to now */
+static double millisSince(const struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e3 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+/* Compare doubles for qsort() */
+static int compareDoubles(const void *left, const void *right)
+{
+    double a = *(const double *)left;
+    double b = *(const double *)right;
+    return a < b ? -1 : a > b;
+}
+
+/* Connect to the lookup server */
+static int connectToServer(const char *hostname, const char *port)
+{
+    struct hostent *hostEntry;
+    struct sockaddr_in serverAddr;
+    int serverSocket;
+
+    if ((hostEntry = gethostbyname(hostname)) == NULL)
+    {
+        fprintf(stderr, "gethostbyname failed for %s\n", hostname);
+        exit(1);
+    }
+
+    if ((serverSocket = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0)
+        terminate("socket() failed");
+
+    memset(&serverAddr, 0, sizeof(serverAddr));
+    serverAddr.sin_family = AF_INET;
+    memcpy(&serverAddr.sin_addr, hostEntry->h_addr, sizeof(serverAddr.sin_addr));
+    serverAddr.sin_port = htons(atoi(port));
+
+    if (connect(serverSocket, (struct sockaddr *)&serverAddr, sizeof(serverAddr)) < 0)
+        terminate("connect() failed");
+
+    return serverSocket;
+}
+
+/* Send one query and read its result up to the terminating blank line.
+ * Returns the number of bytes received. */
+static size_t runQuery(int serverSocket, const char *searchKey, double *firstByteMillis, double *totalMillis, size_t *lines)
+{
+    static char buffer[BUFFER_SIZE];
+    char query[1000];
+    struct timespec startTime;
+    size_t received = 0;
+    char previous = '\n'; /* An empty result is a lone blank line */
+
+    int queryLength = snprintf(query, sizeof(query), "%s\n", searchKey);
+    *lines = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &startTime);
+    if (send(serverSocket, query, queryLength, 0) != queryLength)
+        terminate("send() failed");
+
+    for (;;)
+    {
+        ssize_t bytesRead = recv(serverSocket, buffer, sizeof(buffer), 0);
+        if (bytesRead < 0)
+            terminate("recv() failed");
+        if (bytesRead == 0)
+        {
+            fprintf(stderr, "Server closed connection unexpectedly\n");
+            exit(1);
+        }
+        if (received == 0)
+            *firstByteMillis = millisSince(&startTime);
+        received += bytesRead;
+
+        /* The result ends at the first empty line */
+        for (ssize_t i = 0; i < bytesRead; i++)
+        {
+            if (buffer[i] == '\n')
+            {
+                if (previous == '\n')
+                {
+                    *totalMillis = millisSince(&startTime);
+                    return received;
+                }
+                (*lines)++;
+            }
+            previous = buffer[i];
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 5)
+    {
+        fprintf(stderr, "Usage:  %s <host> <port> <repetitions> <key>...\n", argv[0]);
+        exit(1);
+    }
+
+    int repetitions = atoi(argv[3]);
+    if (repetitions < 1)
+        repetitions = 1;
+
+    double *firstByte = (double *)malloc(repetitions * sizeof(double));
+    double *total = (double *)malloc(repetitions * sizeof(double));
+    if (!firstByte || !total)
+        terminate("malloc() failed");
+
+    int serverSocket = connectToServer(argv[1], argv[2]);
+
+    printf("%-12s %9s %11s %10s %10s %10s %10s %12s\n",
+           "key", "lines", "bytes", "ttfb p50", "ttfb max", "total p50", "MB/s", "lines/s");
+
+    for (int k = 4; k < argc; k++)
+    {
+        size_t bytes = 0, lines = 0;
+
+        for (int r = 0; r < repetitions; r++)
+            bytes = runQuery(serverSocket, argv[k], &firstByte[r], &total[r], &lines);
+
+        qsort(firstByte, repetitions, sizeof(double), compareDoubles);
+        qsort(total, repetitions, sizeof(double), compareDoubles);
+
+        double medianTotal = total[repetitions / 2];
+        printf("%-12s %9zu %11zu %8.3fms %8.3fms %8.3fms %10.1f %12.0f\n",
+               argv[k][0] ? argv[k] : "(all)", lines, bytes,
+               firstByte[repetitions / 2], firstByte[repetitions - 1], medianTotal,
+               bytes / 1e3 / medianTotal, lines * 1e3 / medianTotal);
+    }
+
+    close(serverSocket);
+    free(firstByte);
+    free(total);
+    return 0;
+}
@@ -0,0 +1,894 @@
+/*
+ * mdb-lookup-client.c
+ *
+ * Client library for the mdb-lookup-server line protocol; see
+ * mdb-lookup-client.h for the interface.
+ *
+ * Each connection keeps a buffer of decoded bytes that have not been
+ * parsed yet. Reads append to it (through inflate() when the connection
+ * negotiated compression), and the parser hands out one complete line at
+ * a time, so results can be consumed while the server is still sending.
+ */
+
+#define _GNU_SOURCE     /* for memmem() */
+
+#include "mdb-lookup-client.h"
+
+#include <stdio.h>      /* for snprintf() */
+#include <stdlib.h>     /* for malloc() and free() */
+#include <string.h>     /* for memchr() and memmem() */
+#include <ctype.h>      /* for isdigit() */
+#include <unistd.h>     /* for close() */
+#include <errno.h>      /* for errno */
+#include <fcntl.h>      /* for fcntl() */
+#include <poll.h>       /* for poll() */
+#include <pthread.h>    /* for pthread_mutex_t */
+#include <time.h>       /* for clock_gettime() */
+#include <sys/socket.h> /* for socket(), connect(), send() and recv() */
+#include <netdb.h>      /* for getaddrinfo() */
+#include <netinet/in.h> /* for IPPROTO_TCP */
+#include <netinet/tcp.h> /* for TCP_NODELAY */
+#include <zlib.h>       /* for inflate() */
+
+#define READ_CHUNK 65536        /* Bytes read from the socket at a time */
+#define MAX_QUERY_LENGTH 1000   /* The server reads queries into 1000 bytes */
+
+/* Result of nextLine() when no complete line is buffered yet */
+#define NEED_MORE_DATA (-2)
+
+struct MdbConnection {
+    int socket;
+    int pending;                /* Queries sent whose results are not fully read */
+    int broken;                 /* Closed or failed; not to be reused */
+    int compressed;             /* Server output is a deflate stream */
+    z_stream inflater;
+    char *buffer;               /* Decoded bytes; unparsed ones from start to end */
+    size_t start, end, capacity;
+    struct MdbConnection *nextIdle;
+};
+
+struct MdbPool {
+    char *host;
+    char *port;
+    int maxConnections;
+    int flags;
+    pthread_mutex_t lock;
+    pthread_cond_t released;    /* Signalled when a connection is released */
+    struct MdbConnection *idle; /* Connections ready for reuse */
+    int open;                   /* Idle plus in use */
+};
+
+/* Send the whole buffer without raising SIGPIPE */
+static int sendAll(int socket, const char *data, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t sent = send(socket, data, length, MSG_NOSIGNAL);
+        if (sent < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        data += sent;
+        length -= sent;
+    }
+    return 0;
+}
+
+/* Connect, giving up after timeoutMillis (-1 waits as long as connect()
+ * does). A server with a full backlog otherwise holds connect() for a
+ * long time. */
+static int connectWithin(int serverSocket, const struct sockaddr *address, socklen_t length, int timeoutMillis)
+{
+    if (timeoutMillis < 0)
+        return connect(serverSocket, address, length);
+
+    int flags = fcntl(serverSocket, F_GETFL);
+    fcntl(serverSocket, F_SETFL, flags | O_NONBLOCK);
+
+    int status = connect(serverSocket, address, length);
+    if (status < 0 && errno == EINPROGRESS)
+    {
+        struct pollfd waitSet = { serverSocket, POLLOUT, 0 };
+        int error = 0;
+        socklen_t errorLength = sizeof(error);
+
+        while ((status = poll(&waitSet, 1, timeoutMillis)) < 0 && errno == EINTR)
+            ;
+        if (status == 0)
+            errno = ETIMEDOUT;
+        if (status > 0 && getsockopt(serverSocket, SOL_SOCKET, SO_ERROR, &error, &errorLength) == 0 && error != 0)
+            errno = error;
+        status = status > 0 && error == 0 ? 0 : -1;
+    }
+
+    fcntl(serverSocket, F_SETFL, flags);
+    return status;
+}
+
+/* Open a TCP connection to host:port */
+static int connectTo(const char *host, const char *port, int timeoutMillis)
+{
+    struct addrinfo hints, *addresses, *address;
+    int serverSocket = -1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &addresses) != 0)
+    {
+        errno = EHOSTUNREACH;
+        return -1;
+    }
+
+    for (address = addresses; address; address = address->ai_next)
+    {
+        if ((serverSocket = socket(address->ai_family, address->ai_socktype, address->ai_protocol)) < 0)
+            continue;
+        if (connectWithin(serverSocket, address->ai_addr, address->ai_addrlen, timeoutMillis) == 0)
+            break;
+        close(serverSocket);
+        serverSocket = -1;
+    }
+    freeaddrinfo(addresses);
+
+    /* Queries are small and often pipelined; don't hold them back */
+    if (serverSocket >= 0)
+    {
+        int noDelay = 1;
+        setsockopt(serverSocket, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+    }
+    return serverSocket;
+}
+
+static void closeConnection(struct MdbConnection *connection)
+{
+    if (connection->compressed)
+        inflateEnd(&connection->inflater);
+    close(connection->socket);
+    free(connection->buffer);
+    free(connection);
+}
+
+/* Ask for a compressed result stream; the acknowledgement is plain text */
+static int negotiateCompression(struct MdbConnection *connection)
+{
+    static const char request[] = "COMPRESS deflate\n";
+    char reply[64];
+    size_t length = 0;
+
+    if (sendAll(connection->socket, request, sizeof(request) - 1) < 0)
+        return -1;
+
+    /* Byte by byte, so nothing after the reply's blank line is consumed */
+    while (length < 2 || reply[length - 1] != '\n' || reply[length - 2] != '\n')
+    {
+        if (length == sizeof(reply) - 1 || recv(connection->socket, &reply[length], 1, 0) != 1)
+            return -1;
+        length++;
+    }
+    reply[length] = '\0';
+    if (strncmp(reply, "OK deflate", 10) != 0)
+    {
+        errno = EPROTO;
+        return -1;
+    }
+
+    memset(&connection->inflater, 0, sizeof(connection->inflater));
+    if (inflateInit(&connection->inflater) != Z_OK)
+        return -1;
+    connection->compressed = 1;
+    return 0;
+}
+
+static struct MdbConnection *openConnection(struct MdbPool *pool, int timeoutMillis)
+{
+    struct MdbConnection *connection = (struct MdbConnection *)calloc(1, sizeof(struct MdbConnection));
+    if (!connection)
+        return NULL;
+
+    connection->capacity = READ_CHUNK;
+    connection->buffer = (char *)malloc(connection->capacity);
+    if (!connection->buffer || (connection->socket = connectTo(pool->host, pool->port, timeoutMillis)) < 0)
+    {
+        free(connection->buffer);
+        free(connection);
+        return NULL;
+    }
+
+    if ((pool->flags & MDB_POOL_COMPRESS) && negotiateCompression(connection) < 0)
+    {
+        closeConnection(connection);
+        return NULL;
+    }
+    return connection;
+}
+
+/* Make room for at least need more bytes after end */
+static int reserveBuffer(struct MdbConnection *connection, size_t need)
+{
+    if (connection->start > 0)
+    {
+        memmove(connection->buffer, connection->buffer + connection->start, connection->end - connection->start);
+        connection->end -= connection->start;
+        connection->start = 0;
+    }
+    if (connection->capacity - connection->end < need)
+    {
+        size_t capacity = connection->capacity * 2;
+        while (capacity - connection->end < need)
+            capacity *= 2;
+        char *buffer = (char *)realloc(connection->buffer, capacity);
+        if (!buffer)
+            return -1;
+        connection->buffer = buffer;
+        connection->capacity = capacity;
+    }
+    return 0;
+}
+
+/* Read once from the socket and append the decoded bytes to the buffer.
+ * Returns the number of bytes read, 0 at end of stream, -1 on error. */
+static ssize_t fillBuffer(struct MdbConnection *connection, int flags)
+{
+    char raw[READ_CHUNK];
+    ssize_t bytesRead;
+
+    if (reserveBuffer(connection, READ_CHUNK) < 0)
+        return -1;
+
+    do
+    {
+        if (connection->compressed)
+            bytesRead = recv(connection->socket, raw, sizeof(raw), flags);
+        else
+            bytesRead = recv(connection->socket, connection->buffer + connection->end, READ_CHUNK, flags);
+    } while (bytesRead < 0 && errno == EINTR);
+
+    if (bytesRead <= 0)
+        return bytesRead;
+    if (!connection->compressed)
+    {
+        connection->end += bytesRead;
+        return bytesRead;
+    }
+
+    /* Inflate everything that arrived, growing the buffer as needed */
+    z_stream *inflater = &connection->inflater;
+    inflater->next_in = (Bytef *)raw;
+    inflater->avail_in = bytesRead;
+    do
+    {
+        if (reserveBuffer(connection, READ_CHUNK) < 0)
+            return -1;
+        inflater->next_out = (Bytef *)(connection->buffer + connection->end);
+        inflater->avail_out = connection->capacity - connection->end;
+
+        int status = inflate(inflater, Z_SYNC_FLUSH);
+        connection->end = (char *)inflater->next_out - connection->buffer;
+        if (status != Z_OK && status != Z_BUF_ERROR)
+        {
+            errno = EPROTO;
+            return -1;
+        }
+    } while (inflater->avail_in > 0 || inflater->avail_out == 0);
+
+    return bytesRead;
+}
+
+/* Split "%4d: {name} said {msg}" into its parts; other lines (such as a
+ * PING status line) are delivered with only line set */
+static void parseLine(const char *line, size_t length, struct MdbResult *result)
+{
+    static const char separator[] = "} said {";
+    const char *end = line + length - 1; /* The newline */
+
+    memset(result, 0, sizeof(*result));
+    result->line = line;
+    result->lineLength = length;
+
+    const char *colon = memchr(line, ':', length);
+    if (!colon || colon + 3 > end || colon[1] != ' ' || colon[2] != '{' || end[-1] != '}')
+        return;
+
+    const char *name = colon + 3;
+    const char *said = memmem(name, end - name, separator, sizeof(separator) - 1);
+    if (!said)
+        return;
+
+    result->recordNumber = atoi(line);
+    result->name = name;
+    result->nameLength = said - name;
+    result->msg = said + sizeof(separator) - 1;
+    result->msgLength = (end - 1) - result->msg;
+}
+
+/* Hand out the next buffered line: 1 for a result line, 0 for the blank
+ * line ending a result, NEED_MORE_DATA if no full line is buffered and
+ * block is 0, -1 on error */
+static int nextLine(struct MdbConnection *connection, struct MdbResult *result, int block)
+{
+    for (;;)
+    {
+        char *line = connection->buffer + connection->start;
+        char *newline = memchr(line, '\n', connection->end - connection->start);
+
+        if (newline)
+        {
+            size_t length = newline - line + 1;
+            connection->start += length;
+            if (length == 1)
+            {
+                connection->pending--;
+                return 0;
+            }
+            parseLine(line, length, result);
+            return 1;
+        }
+
+        if (!block)
+            return NEED_MORE_DATA;
+
+        ssize_t bytesRead = fillBuffer(connection, 0);
+        if (bytesRead <= 0)
+        {
+            if (bytesRead == 0)
+                errno = ECONNRESET;
+            connection->broken = 1;
+            return -1;
+        }
+    }
+}
+
+struct MdbPool *mdbPoolCreate(const char *host, const char *port, int maxConnections, int flags)
+{
+    struct MdbPool *pool = (struct MdbPool *)calloc(1, sizeof(struct MdbPool));
+    if (!pool)
+        return NULL;
+
+    pool->host = strdup(host);
+    pool->port = strdup(port);
+    pool->maxConnections = maxConnections > 0 ? maxConnections : 1;
+    pool->flags = flags;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->released, NULL);
+    if (!pool->host || !pool->port)
+    {
+        mdbPoolDestroy(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+void mdbPoolDestroy(struct MdbPool *pool)
+{
+    while (pool->idle)
+    {
+        struct MdbConnection *connection = pool->idle;
+        pool->idle = connection->nextIdle;
+        closeConnection(connection);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->released);
+    free(pool->host);
+    free(pool->port);
+    free(pool);
+}
+
+/* An idle connection the server has since closed reads as end of stream */
+static int isStale(struct MdbConnection *connection)
+{
+    char byte;
+    ssize_t peeked = recv(connection->socket, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+
+    return peeked == 0 || (peeked < 0 && errno != EAGAIN && errno != EWOULDBLOCK);
+}
+
+/* mdbPoolAcquire() with a limit on the time to open a new connection */
+static struct MdbConnection *acquireWithin(struct MdbPool *pool, int timeoutMillis)
+{
+    struct MdbConnection *connection = NULL;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;)
+    {
+        while (pool->idle)
+        {
+            connection = pool->idle;
+            pool->idle = connection->nextIdle;
+            if (!isStale(connection))
+                break;
+            closeConnection(connection);
+            connection = NULL;
+            pool->open--;
+        }
+        if (connection || pool->open < pool->maxConnections)
+            break;
+        pthread_cond_wait(&pool->released, &pool->lock);
+    }
+
+    /* Connect outside the lock; the slot is reserved meanwhile */
+    if (!connection)
+        pool->open++;
+    pthread_mutex_unlock(&pool->lock);
+    if (connection)
+        return connection;
+
+    connection = openConnection(pool, timeoutMillis);
+    if (!connection)
+    {
+        pthread_mutex_lock(&pool->lock);
+        pool->open--;
+        pthread_cond_signal(&pool->released);
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return connection;
+}
+
+struct MdbConnection *mdbPoolAcquire(struct MdbPool *pool)
+{
+    return acquireWithin(pool, -1);
+}
+
+void mdbPoolRelease(struct MdbPool *pool, struct MdbConnection *connection)
+{
+    pthread_mutex_lock(&pool->lock);
+    if (connection->broken || connection->pending != 0)
+    {
+        closeConnection(connection);
+        pool->open--;
+    }
+    else
+    {
+        connection->nextIdle = pool->idle;
+        pool->idle = connection;
+    }
+    pthread_cond_signal(&pool->released);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+int mdbSendQuery(struct MdbConnection *connection, const char *key)
+{
+    char query[MAX_QUERY_LENGTH];
+    int length = snprintf(query, sizeof(query), "%s\n", key);
+
+    if (length >= (int)sizeof(query) || strchr(key, '\n'))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    if (sendAll(connection->socket, query, length) < 0)
+    {
+        connection->broken = 1;
+        return -1;
+    }
+    connection->pending++;
+    return 0;
+}
+
+int mdbReadResult(struct MdbConnection *connection, struct MdbResult *result)
+{
+    return nextLine(connection, result, 1);
+}
+
+int mdbIsCommand(const char *line)
+{
+    static const char *const prefixes[] = { "MGET ", "SORT ", "WATCH " };
+
+    for (size_t i = 0; i < sizeof(prefixes) / sizeof(prefixes[0]); i++)
+        if (strncmp(line, prefixes[i], strlen(prefixes[i])) == 0)
+            return 1;
+    if (line[0] == '=' || line[0] == '^' || line[0] == '~')
+        return 1;
+
+    /* A record range is exactly "#", digits, and optionally "-" and digits */
+    if (line[0] != '#' || !isdigit((unsigned char)line[1]))
+        return 0;
+    const char *end = line + 1 + strspn(line + 1, "0123456789");
+    if (*end == '-' && isdigit((unsigned char)end[1]))
+        end += 1 + strspn(end + 1, "0123456789");
+    return strcmp(end, "\n") == 0 || strcmp(end, "\r\n") == 0 || *end == '\0';
+}
+
+int mdbConnectionSocket(const struct MdbConnection *connection)
+{
+    return connection->socket;
+}
+
+int mdbLookup(struct MdbPool *pool, const char *key, MdbResultCallback callback, void *context)
+{
+    struct MdbConnection *connection = mdbPoolAcquire(pool);
+    struct MdbResult result;
+    int lines = 0;
+    int status;
+
+    if (!connection)
+        return -1;
+    if (mdbSendQuery(connection, key) < 0)
+    {
+        mdbPoolRelease(pool, connection);
+        return -1;
+    }
+
+    while ((status = mdbReadResult(connection, &result)) == 1)
+    {
+        lines++;
+        if (callback)
+            callback(context, 0, &result);
+    }
+    if (status == 0 && callback)
+        callback(context, 0, NULL);
+
+    mdbPoolRelease(pool, connection);
+    return status == 0 ? lines : -1;
+}
+
+/* Deliver every complete line buffered on a connection. With advance set,
+ * each completed result moves on to the next source, as in a pipeline.
+ * Returns the number of results completed. */
+static int drainLines(struct MdbConnection *connection, int *source, int advance, MdbResultCallback callback, void *context, int *lines)
+{
+    struct MdbResult result;
+    int completed = 0;
+    int status;
+
+    while (connection->pending > 0 && (status = nextLine(connection, &result, 0)) != NEED_MORE_DATA)
+    {
+        if (status == 1)
+        {
+            (*lines)++;
+            if (callback)
+                callback(context, *source, &result);
+            continue;
+        }
+        if (callback)
+            callback(context, *source, NULL);
+        completed++;
+        if (advance)
+            (*source)++;
+    }
+    return completed;
+}
+
+int mdbPipeline(struct MdbPool *pool, const char *const *keys, int keyCount, MdbResultCallback callback, void *context)
+{
+    struct MdbConnection *connection;
+    size_t requestLength = 0, sent = 0;
+    int current = 0, lines = 0;
+
+    if (keyCount <= 0)
+        return 0;
+
+    /* All queries back to back, written as the socket accepts them */
+    for (int i = 0; i < keyCount; i++)
+    {
+        if (strchr(keys[i], '\n') || strlen(keys[i]) >= MAX_QUERY_LENGTH - 1)
+        {
+            errno = EINVAL;
+            return -1;
+        }
+        requestLength += strlen(keys[i]) + 1;
+    }
+    char *request = (char *)malloc(requestLength + 1);
+    if (!request)
+        return -1;
+    for (int i = 0, offset = 0; i < keyCount; i++)
+        offset += sprintf(request + offset, "%s\n", keys[i]);
+
+    if ((connection = mdbPoolAcquire(pool)) == NULL)
+    {
+        free(request);
+        return -1;
+    }
+    connection->pending += keyCount;
+
+    /* Write and read at the same time, so neither side can stall the other
+     * on a full socket buffer */
+    while (current < keyCount)
+    {
+        struct pollfd waitSet = { connection->socket, POLLIN, 0 };
+        if (sent < requestLength)
+            waitSet.events |= POLLOUT;
+
+        if (poll(&waitSet, 1, -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            connection->broken = 1;
+            break;
+        }
+
+        if (waitSet.revents & POLLOUT)
+        {
+            ssize_t written = send(connection->socket, request + sent, requestLength - sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+            if (written < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            {
+                connection->broken = 1;
+                break;
+            }
+            if (written > 0)
+                sent += written;
+        }
+
+        if (waitSet.revents & (POLLIN | POLLHUP | POLLERR))
+        {
+            ssize_t bytesRead = fillBuffer(connection, MSG_DONTWAIT);
+            if (bytesRead == 0 || (bytesRead < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+            {
+                connection->broken = 1;
+                break;
+            }
+            drainLines(connection, &current, 1, callback, context, &lines);
+        }
+    }
+
+    free(request);
+    int failed = connection->broken;
+    mdbPoolRelease(pool, connection);
+    return failed ? -1 : lines;
+}
+
+int mdbFanOut(struct MdbPool *const *pools, int poolCount, const char *key, MdbResultCallback callback, void *context)
+{
+    struct MdbConnection **connections = (struct MdbConnection **)calloc(poolCount, sizeof(struct MdbConnection *));
+    struct pollfd *waitSet = (struct pollfd *)calloc(poolCount, sizeof(struct pollfd));
+    int lines = 0, remaining = 0, failed = 0;
+
+    if (!connections || !waitSet)
+    {
+        free(connections);
+        free(waitSet);
+        return -1;
+    }
+
+    /* Send the query to every server before reading any result */
+    for (int i = 0; i < poolCount; i++)
+    {
+        waitSet[i].fd = -1;
+        connections[i] = mdbPoolAcquire(pools[i]);
+        if (!connections[i] || mdbSendQuery(connections[i], key) < 0)
+        {
+            failed = 1;
+            continue;
+        }
+        waitSet[i].fd = connections[i]->socket;
+        waitSet[i].events = POLLIN;
+        remaining++;
+    }
+
+    /* Deliver lines from whichever server has some */
+    while (remaining > 0)
+    {
+        if (poll(waitSet, poolCount, -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            failed = 1;
+            break;
+        }
+
+        for (int i = 0; i < poolCount; i++)
+        {
+            if (waitSet[i].fd < 0 || !(waitSet[i].revents & (POLLIN | POLLHUP | POLLERR)))
+                continue;
+
+            int source = i;
+            ssize_t bytesRead = fillBuffer(connections[i], MSG_DONTWAIT);
+            if (bytesRead == 0 || (bytesRead < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+            {
+                connections[i]->broken = 1;
+                failed = 1;
+            }
+            else if (drainLines(connections[i], &source, 0, callback, context, &lines) == 0)
+            {
+                continue;
+            }
+
+            /* This server's result is complete, or it failed */
+            waitSet[i].fd = -1;
+            remaining--;
+        }
+    }
+
+    for (int i = 0; i < poolCount; i++)
+    {
+        if (!connections[i])
+            continue;
+        if (waitSet[i].fd >= 0)
+            connections[i]->broken = 1; /* Abandoned mid-result */
+        mdbPoolRelease(pools[i], connections[i]);
+    }
+    free(connections);
+    free(waitSet);
+    return failed ? -1 : lines;
+}
+
+#define HEDGE_BURST 10.0    /* Hedges the unused budget can save up */
+
+struct MdbHedge {
+    pthread_mutex_t lock;
+    int delayMillis;
+    double budget;          /* Hedges earned per query */
+    double tokens;          /* Hedges available now */
+    unsigned next;          /* Replica to try first for the next query */
+    unsigned long queries, hedged, hedgeWins;
+};
+
+struct MdbHedge *mdbHedgeCreate(int delayMillis, double budget)
+{
+    struct MdbHedge *hedge = (struct MdbHedge *)calloc(1, sizeof(struct MdbHedge));
+    if (!hedge)
+        return NULL;
+
+    pthread_mutex_init(&hedge->lock, NULL);
+    hedge->delayMillis = delayMillis;
+    hedge->budget = budget;
+    hedge->tokens = 0.0;    /* Hedges are earned by queries, none up front */
+    return hedge;
+}
+
+void mdbHedgeDestroy(struct MdbHedge *hedge)
+{
+    pthread_mutex_destroy(&hedge->lock);
+    free(hedge);
+}
+
+void mdbHedgeStats(struct MdbHedge *hedge, unsigned long *queries, unsigned long *hedged, unsigned long *hedgeWins)
+{
+    pthread_mutex_lock(&hedge->lock);
+    *queries = hedge->queries;
+    *hedged = hedge->hedged;
+    *hedgeWins = hedge->hedgeWins;
+    pthread_mutex_unlock(&hedge->lock);
+}
+
+/* Spend one hedge from the budget, if there is one left */
+static int takeHedge(struct MdbHedge *hedge)
+{
+    int allowed;
+
+    pthread_mutex_lock(&hedge->lock);
+    allowed = hedge->tokens >= 1.0;
+    if (allowed)
+        hedge->tokens -= 1.0;
+    pthread_mutex_unlock(&hedge->lock);
+    return allowed;
+}
+
+/* Milliseconds left of delayMillis since start, at least 0 */
+static int millisLeft(const struct timespec *start, int delayMillis)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    long elapsed = (now.tv_sec - start->tv_sec) * 1000 + (now.tv_nsec - start->tv_nsec) / 1000000;
+    return elapsed < delayMillis ? (int)(delayMillis - elapsed) : 0;
+}
+
+/* Send a query on a connection from the pool; NULL if that fails or a new
+ * connection takes longer than timeoutMillis to open */
+static struct MdbConnection *startQuery(struct MdbPool *pool, const char *key, int timeoutMillis)
+{
+    struct MdbConnection *connection = acquireWithin(pool, timeoutMillis);
+
+    if (connection && mdbSendQuery(connection, key) < 0)
+    {
+        mdbPoolRelease(pool, connection);
+        connection = NULL;
+    }
+    return connection;
+}
+
+int mdbHedgedLookup(struct MdbPool *const *replicas, int replicaCount, struct MdbHedge *hedge, const char *key, MdbResultCallback callback, void *context)
+{
+    struct MdbConnection *connections[2] = { NULL, NULL };
+    struct MdbPool *pools[2];
+    struct pollfd waitSet[2];
+    struct MdbResult result;
+    int lines = 0, status = -1;
+    int winner = -1;
+    int hedgeSent = 0;          /* connections[1] is a hedge, not a failover */
+
+    if (replicaCount < 1)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pthread_mutex_lock(&hedge->lock);
+    unsigned first = hedge->next++ % replicaCount;
+    hedge->queries++;
+    hedge->tokens += hedge->budget;
+    if (hedge->tokens > HEDGE_BURST)
+        hedge->tokens = HEDGE_BURST;
+    pthread_mutex_unlock(&hedge->lock);
+
+    pools[0] = replicas[first];
+    pools[1] = replicas[(first + 1) % replicaCount];
+    int canHedge = replicaCount > 1;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    /* A replica that cannot take the query within the delay is failed
+     * over from; that is not a hedge */
+    if ((connections[0] = startQuery(pools[0], key, canHedge ? hedge->delayMillis : -1)) == NULL)
+    {
+        if (!canHedge || (connections[1] = startQuery(pools[1], key, -1)) == NULL)
+            return -1;
+        canHedge = 0;
+    }
+
+    /* Wait for the first byte from either, hedging once the delay is up;
+     * the time spent connecting above counts against it */
+    while (winner < 0)
+    {
+        int timeout = canHedge ? millisLeft(&start, hedge->delayMillis) : -1;
+        for (int i = 0; i < 2; i++)
+        {
+            waitSet[i].fd = connections[i] ? connections[i]->socket : -1;
+            waitSet[i].events = POLLIN;
+            waitSet[i].revents = 0;
+        }
+
+        int ready = poll(waitSet, 2, timeout);
+        if (ready < 0 && errno != EINTR)
+            break;
+        if (ready == 0)
+        {
+            /* A hedge that cannot connect within the delay is dropped, and
+             * the query keeps waiting for its first replica */
+            if (takeHedge(hedge))
+            {
+                connections[1] = startQuery(pools[1], key, hedge->delayMillis);
+                hedgeSent = connections[1] != NULL;
+                pthread_mutex_lock(&hedge->lock);
+                hedge->hedged += hedgeSent;
+                pthread_mutex_unlock(&hedge->lock);
+            }
+            canHedge = 0;
+            continue;
+        }
+        for (int i = 0; i < 2 && winner < 0 && ready > 0; i++)
+        {
+            if (waitSet[i].revents)
+                winner = i;
+        }
+    }
+
+    /* Stream the winner; if it fails before its first line, the other
+     * connection, if there is one, takes over */
+    while (winner >= 0)
+    {
+        while ((status = mdbReadResult(connections[winner], &result)) == 1)
+        {
+            lines++;
+            if (callback)
+                callback(context, 0, &result);
+        }
+        if (status == 0 || lines > 0 || !connections[1 - winner])
+            break;
+        winner = 1 - winner;
+    }
+
+    if (status == 0)
+    {
+        if (callback)
+            callback(context, 0, NULL);
+        if (winner == 1 && hedgeSent)
+        {
+            pthread_mutex_lock(&hedge->lock);
+            hedge->hedgeWins++;
+            pthread_mutex_unlock(&hedge->lock);
+        }
+    }
+
+    /* The slower connection still has its result coming; releasing it
+     * with the result unread closes it */
+    for (int i = 0; i < 2; i++)
+    {
+        if (connections[i])
+            mdbPoolRelease(pools[i], connections[i]);
+    }
+    return status == 0 ? lines : -1;
+}
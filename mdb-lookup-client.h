@@ -0,0 +1,105 @@
+/*
+ * mdb-lookup-client.h
+ *
+ * Client library for the mdb-lookup-server line protocol: a query is a
+ * search key on one line, and its result is zero or more lines of the form
+ * "%4d: {name} said {msg}" followed by a blank line.
+ *
+ * Connections are kept in per-server pools and reused across queries.
+ * Several queries can be pipelined on one connection, the result stream is
+ * parsed incrementally as it arrives, and a query can be fanned out to
+ * several servers in parallel, or hedged across replicas.
+ */
+
+#ifndef MDB_LOOKUP_CLIENT_H
+#define MDB_LOOKUP_CLIENT_H
+
+#include <stddef.h>     /* for size_t */
+
+/* One parsed result line. The pointers refer to the connection's buffer
+ * and are only valid until the next read from that connection. */
+struct MdbResult {
+    int recordNumber;       /* The "%4d" record number */
+    const char *name;       /* Text between the first "{" and "} said {" */
+    size_t nameLength;
+    const char *msg;        /* Text after "} said {" up to the final "}" */
+    size_t msgLength;
+    const char *line;       /* The raw line, including its newline */
+    size_t lineLength;
+};
+
+/*
+ * Called for every result line. source is the index of the query in a
+ * pipeline or of the server in a fan-out, and 0 for a single lookup.
+ * result is NULL once the result of that source is complete.
+ */
+typedef void (*MdbResultCallback)(void *context, int source, const struct MdbResult *result);
+
+/* Flags for mdbPoolCreate() */
+#define MDB_POOL_COMPRESS 1     /* Negotiate "COMPRESS deflate" on each connection */
+
+struct MdbPool;
+struct MdbConnection;
+struct MdbHedge;
+
+/* Pool of up to maxConnections persistent connections to host:port */
+struct MdbPool *mdbPoolCreate(const char *host, const char *port, int maxConnections, int flags);
+void mdbPoolDestroy(struct MdbPool *pool);
+
+/* Take a connection from the pool, opening one if none is idle; blocks
+ * while maxConnections are in use. Idle connections the server has closed
+ * are discarded. Returns NULL if connecting fails. */
+struct MdbConnection *mdbPoolAcquire(struct MdbPool *pool);
+
+/* Return a connection; it is kept only if no results are left unread */
+void mdbPoolRelease(struct MdbPool *pool, struct MdbConnection *connection);
+
+/* Send one query; any number may be outstanding on a connection */
+int mdbSendQuery(struct MdbConnection *connection, const char *key);
+
+/* Read the next line of the oldest outstanding result: 1 with a result
+ * line, 0 at the blank line that ends the result, -1 on error */
+int mdbReadResult(struct MdbConnection *connection, struct MdbResult *result);
+
+/* Whether a query line is one of the server's commands other than PING
+ * and COMPRESS: "MGET ", "SORT ", "WATCH ", "#n" or "#first-last", or a
+ * line starting with "=", "^" or "~". Anything else is a search key. */
+int mdbIsCommand(const char *line);
+
+/* Socket of a connection, for callers that poll() it themselves */
+int mdbConnectionSocket(const struct MdbConnection *connection);
+
+/* Look up one key on a pooled connection. Returns the number of result
+ * lines, or -1 on error. */
+int mdbLookup(struct MdbPool *pool, const char *key, MdbResultCallback callback, void *context);
+
+/* Send all keys on one connection without waiting for each result, while
+ * reading the results as they come. Returns the total number of result
+ * lines, or -1 on error. */
+int mdbPipeline(struct MdbPool *pool, const char *const *keys, int keyCount, MdbResultCallback callback, void *context);
+
+/* Send one key to every pool's server at once and deliver each server's
+ * lines as they arrive. Returns the total number of result lines, or -1
+ * if any server failed (the others' results are still delivered). */
+int mdbFanOut(struct MdbPool *const *pools, int poolCount, const char *key, MdbResultCallback callback, void *context);
+
+/* Hedging state shared by the queries to one set of replicas. A query is
+ * sent to a second replica when its first one has not started answering
+ * within delayMillis. budget is the fraction of queries that may be hedged,
+ * e.g. 0.05; it starts at none, and unused budget accumulates for up to
+ * 10 hedges. */
+struct MdbHedge *mdbHedgeCreate(int delayMillis, double budget);
+void mdbHedgeDestroy(struct MdbHedge *hedge);
+
+/* Counts of queries, of hedges sent, and of queries a hedge answered. A
+ * query failed over to the next replica is not a hedge, nor is one whose
+ * hedge could not connect. */
+void mdbHedgeStats(struct MdbHedge *hedge, unsigned long *queries, unsigned long *hedged, unsigned long *hedgeWins);
+
+/* Look up one key on one of the replicas, taken in turn, hedging to the
+ * next one if allowed. The result comes from whichever replica starts
+ * answering first; the other connection is closed. Returns the number of
+ * result lines, or -1 on error. */
+int mdbHedgedLookup(struct MdbPool *const *replicas, int replicaCount, struct MdbHedge *hedge, const char *key, MdbResultCallback callback, void *context);
+
+#endif /* MDB_LOOKUP_CLIENT_H */
@@ -0,0 +1,457 @@
+/*
+ * mdb-lookup-proxy.c
+ *
+ * A proxy that sits in front of several mdb-lookup-server instances and
+ * speaks the same protocol to its clients.
+ *
+ * Identical queries that arrive while one is already being answered are
+ * coalesced: the backend runs the query once, and its result stream is
+ * multicast to every client that asked for it. A client that joins late
+ * first gets the part of the result it missed, then follows the rest as it
+ * arrives. Backend connections are pooled and kept open across queries.
+ *
+ * By default every query is sent to all backends and their results are
+ * merged into one (the backends hold different records). Each backend's
+ * lines keep that backend's own record numbers and are passed on as they
+ * arrive, so lines from different backends are interleaved in no
+ * particular order; mdb-cluster routes over one numbering in file order.
+ * With -r the backends are replicas of one database, and each query goes
+ * to one of them in turn.
+ *
+ * Only plain key lookups and PING are served. The servers' other commands
+ * (MGET, SORT, WATCH, #n, =name, ^prefix and ~key) are refused with an
+ * ERROR line, as is COMPRESS, and a failed backend query ends with
+ * "ERROR backend unavailable" instead of the usual blank line.
+ *
+ * Example usage:
+ *   ./mdb-lookup-proxy db1:8080,db2:8080 9000
+ */
+
+#include "mdb-lookup-client.h"
+
+#include <stdio.h>      /* for printf() and fprintf() */
+#include <sys/socket.h> /* for socket(), bind(), and accept() */
+#include <arpa/inet.h>  /* for sockaddr_in */
+#include <stdlib.h>     /* for atoi() and exit() */
+#include <string.h>     /* for memset() */
+#include <unistd.h>     /* for close() */
+#include <signal.h>     /* for signal() */
+#include <errno.h>      /* for errno and EINTR */
+#include <pthread.h>    /* for pthread_create() */
+#include <stdatomic.h>  /* for the status counters */
+
+#define MAX_BACKENDS 64
+#define MAX_KEY_LENGTH 5        /* Must match the backends' MAX_KEY_LENGTH */
+#define MAX_PENDING 128         /* Backlog of the listening socket */
+/* A backend serves one connection at a time, and a pooled connection stays
+ * open, so a second one to the same backend would wait until the first is
+ * closed. Raise -n only for backends that serve connections concurrently. */
+#define DEFAULT_BACKEND_CONNECTIONS 1
+#define CHUNK_SIZE 16384        /* Bytes per piece of a shared result */
+
+/* A piece of a result stream. Pieces are only appended to, and freed with
+ * their flight, so followers can send from them without holding the lock. */
+struct Chunk {
+    struct Chunk *next;
+    size_t length;
+    char data[CHUNK_SIZE];
+};
+
+/* One backend query and the clients following its result */
+struct Flight {
+    char key[MAX_KEY_LENGTH + 1];
+    struct Chunk *first, *last;
+    int complete;               /* The terminating blank line is appended */
+    int references;             /* The fetcher plus every follower */
+    pthread_cond_t progress;    /* Signalled when data is appended */
+    struct Flight *next;        /* Next flight in the in-flight list */
+};
+
+/* Queries being answered; a new query for one of these keys joins it */
+static struct Flight *flights;
+static pthread_mutex_t flightLock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct MdbPool *backends[MAX_BACKENDS];
+static int backendCount;
+static int replicated;          /* -r: any one backend answers a query */
+static atomic_uint nextReplica;
+
+/* Status counters, reported by PING */
+static atomic_int clientsConnected;
+static atomic_int flightsInProgress;
+static atomic_ulong queriesServed;
+static atomic_ulong queriesCoalesced;
+
+/* Function to handle errors and terminate the program */
+static void terminate(const char *message)
+{
+    perror(message);
+    exit(1);
+}
+
+/* Send the whole buffer, retrying after interrupted or partial sends */
+static int sendFully(int socket, const char *buffer, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t sent = send(socket, buffer, length, MSG_NOSIGNAL);
+        if (sent < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buffer += sent;
+        length -= sent;
+    }
+    return 0;
+}
+
+/* Append to a flight's result and wake its followers. Called with
+ * flightLock held. */
+static void appendToFlight(struct Flight *flight, const char *data, size_t length)
+{
+    while (length > 0)
+    {
+        if (!flight->last || flight->last->length == CHUNK_SIZE)
+        {
+            struct Chunk *chunk = (struct Chunk *)malloc(sizeof(struct Chunk));
+            if (!chunk)
+                terminate("malloc() failed");
+            chunk->next = NULL;
+            chunk->length = 0;
+            if (flight->last)
+                flight->last->next = chunk;
+            else
+                flight->first = chunk;
+            flight->last = chunk;
+        }
+
+        size_t room = CHUNK_SIZE - flight->last->length;
+        size_t part = length < room ? length : room;
+        memcpy(flight->last->data + flight->last->length, data, part);
+        flight->last->length += part;
+        data += part;
+        length -= part;
+    }
+    pthread_cond_broadcast(&flight->progress);
+}
+
+/* Drop a reference; the last one frees the flight. Called with
+ * flightLock held. */
+static void releaseFlight(struct Flight *flight)
+{
+    if (--flight->references > 0)
+        return;
+
+    while (flight->first)
+    {
+        struct Chunk *chunk = flight->first;
+        flight->first = chunk->next;
+        free(chunk);
+    }
+    pthread_cond_destroy(&flight->progress);
+    free(flight);
+}
+
+/* Collect backend result lines into the flight */
+static void collectResult(void *context, int source, const struct MdbResult *result)
+{
+    struct Flight *flight = (struct Flight *)context;
+    (void)source;
+
+    if (!result)
+        return;
+    pthread_mutex_lock(&flightLock);
+    appendToFlight(flight, result->line, result->lineLength);
+    pthread_mutex_unlock(&flightLock);
+}
+
+/* Run a flight's query on the backends, then end its result */
+static void *fetchFlight(void *argument)
+{
+    static const char failure[] = "ERROR backend unavailable\n\n";
+    struct Flight *flight = (struct Flight *)argument;
+    int lines;
+
+    if (replicated)
+    {
+        /* Take the replicas in turn; a failed one is skipped only while
+         * nothing has been sent on its behalf */
+        unsigned first = nextReplica++;
+        for (int attempt = 0; ; attempt++)
+        {
+            lines = mdbLookup(backends[(first + attempt) % backendCount], flight->key, collectResult, flight);
+            if (lines >= 0 || attempt + 1 == backendCount || flight->first)
+                break;
+        }
+    }
+    else
+        lines = mdbFanOut(backends, backendCount, flight->key, collectResult, flight);
+
+    if (lines < 0)
+        fprintf(stderr, "backend query for \"%s\" failed\n", flight->key);
+
+    /* The flight stops taking new followers once its result is complete */
+    pthread_mutex_lock(&flightLock);
+    for (struct Flight **link = &flights; *link; link = &(*link)->next)
+    {
+        if (*link == flight)
+        {
+            *link = flight->next;
+            break;
+        }
+    }
+    /* A failed query ends with an error line, so no follower takes what
+     * arrived for a whole result */
+    if (lines < 0)
+        appendToFlight(flight, failure, sizeof(failure) - 1);
+    else
+        appendToFlight(flight, "\n", 1);
+    flight->complete = 1;
+    releaseFlight(flight);
+    pthread_mutex_unlock(&flightLock);
+
+    flightsInProgress--;
+    return NULL;
+}
+
+/* Join the flight answering key, starting one if there is none. The
+ * returned flight holds a reference for the caller. */
+static struct Flight *joinFlight(const char *key)
+{
+    struct Flight *flight;
+    pthread_t fetcher;
+
+    pthread_mutex_lock(&flightLock);
+    for (flight = flights; flight; flight = flight->next)
+    {
+        if (strcmp(flight->key, key) == 0)
+        {
+            flight->references++;
+            pthread_mutex_unlock(&flightLock);
+            queriesCoalesced++;
+            return flight;
+        }
+    }
+
+    flight = (struct Flight *)calloc(1, sizeof(struct Flight));
+    if (!flight)
+        terminate("calloc() failed");
+    strcpy(flight->key, key);
+    pthread_cond_init(&flight->progress, NULL);
+    flight->references = 2;
+    flight->next = flights;
+    flights = flight;
+    pthread_mutex_unlock(&flightLock);
+
+    flightsInProgress++;
+    if (pthread_create(&fetcher, NULL, fetchFlight, flight) != 0)
+        terminate("pthread_create() failed");
+    pthread_detach(fetcher);
+    return flight;
+}
+
+/* Send a flight's result to a client from the beginning, waiting for more
+ * until it is complete. Returns -1 if the client went away. */
+static int followFlight(struct Flight *flight, int clientSocket)
+{
+    struct Chunk *chunk = NULL;
+    size_t offset = 0;
+    int status = 0;
+
+    pthread_mutex_lock(&flightLock);
+    for (;;)
+    {
+        if (!chunk)
+            chunk = flight->first;
+        else if (offset == chunk->length && chunk->next)
+        {
+            chunk = chunk->next;
+            offset = 0;
+        }
+
+        size_t available = chunk ? chunk->length - offset : 0;
+        if (available == 0)
+        {
+            if (flight->complete)
+                break;
+            pthread_cond_wait(&flight->progress, &flightLock);
+            continue;
+        }
+
+        /* The bytes up to length never change, so send them unlocked */
+        pthread_mutex_unlock(&flightLock);
+        status = sendFully(clientSocket, chunk->data + offset, available);
+        pthread_mutex_lock(&flightLock);
+        if (status < 0)
+            break;
+        offset += available;
+    }
+    releaseFlight(flight);
+    pthread_mutex_unlock(&flightLock);
+    return status;
+}
+
+/* Serve one client's queries */
+static void *processClientRequest(void *argument)
+{
+    int clientSocket = (int)(long)argument;
+    FILE *clientInput = fdopen(clientSocket, "r");
+    char queryLine[1000];
+    char searchKey[MAX_KEY_LENGTH + 1];
+
+    if (clientInput == NULL)
+    {
+        perror("fdopen() failed");
+        close(clientSocket);
+        return NULL;
+    }
+    clientsConnected++;
+
+    while (fgets(queryLine, sizeof(queryLine), clientInput) != NULL)
+    {
+        /* PING reports the proxy's own status */
+        if (strcmp(queryLine, "PING\n") == 0 || strcmp(queryLine, "PING\r\n") == 0)
+        {
+            char status[256];
+            int statusLength = snprintf(status, sizeof(status),
+                                        "READY backends=%d clients=%d flights=%d served=%lu coalesced=%lu\n\n",
+                                        backendCount, (int)clientsConnected, (int)flightsInProgress,
+                                        (unsigned long)queriesServed, (unsigned long)queriesCoalesced);
+            if (sendFully(clientSocket, status, statusLength) < 0)
+                break;
+            continue;
+        }
+
+        /* The backends' result streams are passed through as they are */
+        if (strncmp(queryLine, "COMPRESS ", 9) == 0)
+        {
+            static const char refusal[] = "ERROR unsupported compression\n\n";
+            if (sendFully(clientSocket, refusal, sizeof(refusal) - 1) < 0)
+                break;
+            continue;
+        }
+
+        /* Only plain lookups are coalesced and merged; a command cut to a
+         * key would get some other key's result */
+        if (mdbIsCommand(queryLine))
+        {
+            static const char refusal[] = "ERROR unsupported command\n\n";
+            if (sendFully(clientSocket, refusal, sizeof(refusal) - 1) < 0)
+                break;
+            continue;
+        }
+
+        /* Cut the key the way the backends do, so queries that they answer
+         * identically also coalesce */
+        strncpy(searchKey, queryLine, sizeof(searchKey) - 1);
+        searchKey[sizeof(searchKey) - 1] = '\0';
+        searchKey[strcspn(searchKey, "\r\n")] = '\0';
+
+        struct Flight *flight = joinFlight(searchKey);
+        int status = followFlight(flight, clientSocket);
+        queriesServed++;
+        if (status < 0)
+            break;
+    }
+
+    clientsConnected--;
+    fclose(clientInput);
+    return NULL;
+}
+
+static int openListeningSocket(unsigned short port)
+{
+    struct sockaddr_in proxyAddr;
+    int listenSocket, reuse = 1;
+
+    if ((listenSocket = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0)
+        terminate("socket() failed");
+    if (setsockopt(listenSocket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) < 0)
+        terminate("setsockopt() failed");
+
+    memset(&proxyAddr, 0, sizeof(proxyAddr));
+    proxyAddr.sin_family = AF_INET;
+    proxyAddr.sin_addr.s_addr = htonl(INADDR_ANY);
+    proxyAddr.sin_port = htons(port);
+
+    if (bind(listenSocket, (struct sockaddr *)&proxyAddr, sizeof(proxyAddr)) < 0)
+        terminate("bind() failed");
+    if (listen(listenSocket, MAX_PENDING) < 0)
+        terminate("listen() failed");
+
+    return listenSocket;
+}
+
+static void usage(const char *program)
+{
+    fprintf(stderr, "Usage:  %s [-r] [-z] [-n backend_connections] <host:port>[,<host:port>...] <Proxy Port>\n", program);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    int connections = DEFAULT_BACKEND_CONNECTIONS;
+    int flags = 0;
+    int option;
+
+    while ((option = getopt(argc, argv, "rzn:")) != -1)
+    {
+        switch (option)
+        {
+        case 'r':
+            replicated = 1;
+            break;
+        case 'z':
+            flags |= MDB_POOL_COMPRESS;
+            break;
+        case 'n':
+            connections = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (argc - optind != 2)
+        usage(argv[0]);
+
+    /* host:port[,host:port...] */
+    for (char *backend = strtok(argv[optind], ","); backend; backend = strtok(NULL, ","))
+    {
+        char *colon = strrchr(backend, ':');
+        if (!colon || backendCount == MAX_BACKENDS)
+            usage(argv[0]);
+        *colon = '\0';
+        if ((backends[backendCount++] = mdbPoolCreate(backend, colon + 1, connections, flags)) == NULL)
+            terminate("mdbPoolCreate() failed");
+    }
+
+    /* A client that hangs up mid-result must not kill the proxy */
+    signal(SIGPIPE, SIG_IGN);
+
+    int proxySocket = openListeningSocket(atoi(argv[optind + 1]));
+
+    for (;;)
+    {
+        struct sockaddr_in clientAddr;
+        socklen_t clientLength = sizeof(clientAddr);
+        pthread_t clientThread;
+
+        int clientSocket = accept(proxySocket, (struct sockaddr *)&clientAddr, &clientLength);
+        if (clientSocket < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            terminate("accept() failed");
+        }
+
+        printf("Connection started from: %s\n", inet_ntoa(clientAddr.sin_addr));
+        fflush(stdout);
+
+        /* Clients are served concurrently, so their queries can coalesce */
+        if (pthread_create(&clientThread, NULL, processClientRequest, (void *)(long)clientSocket) != 0)
+            terminate("pthread_create() failed");
+        pthread_detach(clientThread);
+    }
+}
@@ -10,8 +10,13 @@
  * for clarity, reorganization, and readability. The logic remains the same.
  */
 
+#define _GNU_SOURCE     /* for memmem() */
+
 #include "mdb.h"
-#include "mylist.h"
+#include "mdb-fold.h"
+#include "mdb-match.h"
+#include "mdb-mph.h"
+#include "mdb-schema.h"
 
 #include <stdio.h>      /* for printf() and fprintf() */
 #include <sys/socket.h> /* for socket(), bind(), and accept() */
@@ -19,10 +24,278 @@
 #include <stdlib.h>     /* for atoi() and exit() */
 #include <string.h>     /* for memset() */
 #include <unistd.h>     /* for close() */
-#include <signal.h>     /* for signal() */
+#include <signal.h>     /* for signal() and sigaction() */
+#include <errno.h>      /* for errno, EINTR and ERANGE */
+#include <ctype.h>      /* for isdigit() */
+#include <fcntl.h>      /* for fcntl() */
+#include <sys/stat.h>   /* for stat() */
+#include <sys/un.h>     /* for sockaddr_un */
+#include <poll.h>       /* for poll() */
+#include <sys/mman.h>   /* for mmap() and madvise() */
+#include <pthread.h>    /* for pthread_create() */
+#include <stdatomic.h>  /* for atomic_int */
+#include <stdint.h>     /* for uint64_t */
+#include <stddef.h>     /* for offsetof() */
+#include <time.h>       /* for clock_gettime() */
+#include <zlib.h>       /* for deflate() */
+#include <malloc.h>     /* for mallinfo2() */
+#include <sys/resource.h> /* for getrusage() */
+#include <sys/inotify.h> /* for inotify_init1() */
+#include <sys/sendfile.h> /* for sendfile() */
+#include <sys/time.h>   /* for struct timeval */
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>  /* for __rdtsc() */
+#endif
 
 #define MAX_CONNECTIONS 5   /* Maximum outstanding connection requests */
 #define MAX_KEY_LENGTH 5    /* Max key length for search queries */
+#define DEFAULT_DRAIN_SECONDS 30 /* Default shutdown drain deadline */
+#define MAX_HANDOFF_SOCKETS 2    /* Lookup and admin listening sockets */
+#define ADMIN_READ_TIMEOUT 1     /* Seconds an admin client has to send its request */
+#define LOAD_RANGE_RECORDS (1 << 18) /* Records per parallel load and checksum range */
+#define COMPRESSED_BLOCK_RECORDS 256 /* Records per block of the compressed store */
+#define BLOCKS_PER_RANGE (LOAD_RANGE_RECORDS / COMPRESSED_BLOCK_RECORDS)
+#define NGRAM_LENGTH 3           /* Bytes per n-gram of the n-gram index */
+#define NGRAM_BUCKET_BITS 20     /* log2 of the n-gram index's hash buckets */
+#define ART_MAX_PREFIX 8         /* Compressed-path bytes kept in an ART node */
+#define ART_NODE_ALIGN 64        /* ART nodes start on a cache line */
+#define MGET_MAX_KEYS 4096       /* Keys taken from one MGET line */
+#define SORT_PREFIX_BYTES 8      /* Bytes of the sort field radix-sorted as one integer */
+#define SORT_PARALLEL_MIN 65536  /* Fewer matches are sorted by the serving thread alone */
+#define MGET_MAX_LINE (1 << 20)  /* Longest MGET line; a longer one gets an error */
+#define MGET_PROBE_MIN_KEYS 8    /* From this many keys, probe substrings instead of memmem() per key */
+#define MGET_MAX_BUFFERED (64 << 20) /* Result bytes one MGET may hold before it fails */
+#define WATCH_MAX_SUBSCRIPTIONS 1024 /* WATCH connections served at once */
+#define WATCH_SLICE_RECORDS 1024 /* Appended records read and pushed at a time */
+#define WATCH_SEND_TIMEOUT 5     /* Seconds a push may block before its subscriber is dropped */
+
+/* Output batching: the first batch of a result is sent after this many
+ * bytes, each later one may be twice as large up to the maximum, and no
+ * line waits longer than the delay. The timer is checked at least every
+ * OUTPUT_TICK_RECORDS records while a search finds nothing. */
+#define OUTPUT_FIRST_BATCH 256
+#define OUTPUT_MAX_BATCH 65536
+#define OUTPUT_MAX_DELAY_MS 5
+#define OUTPUT_TICK_RECORDS 4096
+
+/* Planner cost per record scanned, per sorted-prefix position (gather and
+ * sort), and per n-gram candidate (random fetch and verify) */
+#define SCAN_COST 1
+#define PREFIX_COST 4
+#define NGRAM_COST 4
+
+/* Profiling: a result line's formatting is timed for one line in this many,
+ * which keeps the clock reads off most of the per-record path */
+#define FORMAT_SAMPLE_INTERVAL 16
+
+/* Longest result line: the number, every field in braces, and " said " */
+#define MAX_RESULT_LINE (MDB_SCHEMA_MAX_RECORD + MDB_SCHEMA_MAX_FIELDS * 3 + 32)
+
+/* Set by SIGTERM/SIGINT: stop accepting and drain in-flight queries */
+static volatile sig_atomic_t shutdownRequested = 0;
+
+/* Seconds allowed for draining before the server exits regardless */
+static unsigned int drainSeconds = DEFAULT_DRAIN_SECONDS;
+
+/* Record layout (-f), struct MdbRec unless given; fixed for the process */
+static struct MdbSchema schema;
+static int mdbRecLayout;         /* The schema has the field offsets and widths of struct MdbRec */
+
+/* Database records, loaded once at startup and reloaded when the file changes */
+static char *records;            /* Contiguous array of all records, schema.recordSize bytes each */
+static size_t recordCount;       /* Number of records in the array */
+static size_t mappedLength;      /* Nonzero if records is an mmap of the file */
+
+/* Field lengths of each record, computed at load time so the scan can skip
+ * records too short for the key without looking for the terminating NUL.
+ * Record i's are schema.fieldCount bytes from fieldLengths[i * schema.fieldCount]. */
+static unsigned char *fieldLengths; /* NULL when compressed */
+
+/* Case-folded copy of the records (-I) for "~key": same layout, each
+ * field folded with mdbFoldUtf8() and zero padded. Folding never makes a
+ * field longer, so fieldLengths bound the folded fields too. */
+static char *foldedRecords;
+
+/* Sorted-prefix index (-i prefix): one entry per byte position of each
+ * field, holding the next MAX_KEY_LENGTH bytes (zero padded). Keys are
+ * never longer, so the entries starting with a key are exactly the
+ * positions where it occurs, and they sit in one sorted range. */
+struct PrefixEntry {
+    char prefix[MAX_KEY_LENGTH];
+    uint32_t record;
+};
+static struct {
+    struct PrefixEntry *entries;
+    size_t count;
+} prefixIndex;
+static int buildPrefixIndex = 0;
+
+/* N-gram index (-i ngram): for each hash bucket of NGRAM_LENGTH-byte
+ * substrings, the records containing one, in file order. Buckets are shared
+ * between n-grams, so candidates are verified against the record. */
+static struct {
+    uint32_t *offsets;   /* Postings of bucket b: offsets[b] to offsets[b + 1] */
+    uint32_t *postings;
+} ngramIndex;
+static int buildNgramIndex = 0;
+
+/* Adaptive radix tree over names (-i art), for "=name" and "^prefix"
+ * queries. Each name with its terminating NUL is one key, so no key is a
+ * prefix of another; its leaf lists the records with that name in file
+ * order. Inner nodes grow from 4 to 16, 48 and 256 children as needed,
+ * hold up to ART_MAX_PREFIX bytes of their compressed path, and are
+ * allocated in whole cache lines. Leaves are tagged pointers. */
+enum ArtNodeType { ART_NODE4, ART_NODE16, ART_NODE48, ART_NODE256 };
+
+struct ArtNode {
+    uint8_t type;
+    uint16_t count;             /* Children */
+    uint32_t prefixLength;      /* Bytes of compressed path, even beyond prefix[] */
+    unsigned char prefix[ART_MAX_PREFIX];
+};
+struct ArtNode4 {
+    struct ArtNode header;
+    unsigned char keys[4];      /* Sorted */
+    void *children[4];
+};
+struct ArtNode16 {
+    struct ArtNode header;
+    unsigned char keys[16];     /* Sorted, compared 16 at a time */
+    void *children[16];
+};
+struct ArtNode48 {
+    struct ArtNode header;
+    unsigned char slots[256];   /* 1 + index into children, 0 = none */
+    void *children[48];
+};
+struct ArtNode256 {
+    struct ArtNode header;
+    void *children[256];
+};
+struct ArtLeaf {
+    uint32_t *records;
+    uint32_t count, capacity;
+    uint32_t keyLength;
+    unsigned char key[];
+};
+
+static struct {
+    void *root;
+    size_t nodes, leaves, bytes;
+} artIndex;
+static int buildArtIndex = 0;
+
+/* Minimal perfect hash side file (-e), built by mdb-mph-build, for "=name" */
+static struct MdbMph exactIndex;
+static char *exactIndexFile = NULL;
+
+/* Access paths the query planner chooses between */
+enum Strategy { PLAN_SCAN, PLAN_PREFIX, PLAN_NGRAM };
+
+/* The planner's choice for one query and the estimates behind it */
+struct QueryPlan {
+    enum Strategy strategy;
+    size_t scanCost;
+    size_t prefixCost;
+    size_t prefixFirst, prefixLast;  /* Sorted-prefix range of the key */
+    size_t ngramCost;
+    size_t ngramCandidates;          /* Length of the shortest posting list */
+    uint32_t ngramBucket;
+};
+
+/* Queries taking at least this long are logged; -1 disables the log */
+static double slowQueryMillis = -1;
+
+/* Longest a result line may wait in the output buffer (-b) */
+static double outputMaxDelay = OUTPUT_MAX_DELAY_MS;
+
+/* Stages of serving a query that the profile attributes time to. Read is
+ * the time in fgets(), so it includes waiting for the client. Scan is
+ * what remains of a lookup after format, compress and send. */
+enum Stage { STAGE_READ, STAGE_PARSE, STAGE_SCAN, STAGE_FORMAT, STAGE_COMPRESS, STAGE_SEND, STAGE_COUNT };
+static const char *const stageNames[STAGE_COUNT] = { "read", "parse", "scan", "format", "compress", "send" };
+
+/* Always-on profile, in profileClock() ticks; dumped on SIGUSR1 to stderr
+ * and on GET /profile from the admin port */
+static atomic_ulong stageTicks[STAGE_COUNT];
+static atomic_ulong profiledQueries;
+static double ticksPerMicrosecond = 1e3; /* Calibrated at startup for the TSC */
+
+/* Result lines of one query on their way to the client */
+struct ResultStream {
+    int socket;
+    z_stream *compressor;       /* Deflate stream of the connection, or NULL */
+    size_t length;              /* Bytes buffered */
+    size_t batchLimit;          /* Send once this many bytes are buffered */
+    struct timespec oldest;     /* When the first buffered byte was added */
+    int failed;                 /* A send failed; drop the rest */
+    unsigned long formatted;    /* Lines formatted, for sampling their cost */
+    uint64_t ticks[STAGE_COUNT]; /* Profile of this query so far */
+    char buffer[OUTPUT_MAX_BATCH];
+};
+
+/* Compressed store (-z): records packed into blocks with the field padding
+ * dropped, one length byte before each field. Each load range is one
+ * CompressedRange. records is NULL while the store is compressed. */
+struct CompressedRange {
+    unsigned char *data;        /* Packed records of the range */
+    size_t length;              /* Bytes used in data */
+    uint32_t *blockOffsets;     /* Start of each block in data, plus the end */
+    size_t blockCount;
+};
+static struct CompressedRange *compressedRanges;
+static size_t compressedRangeCount;
+static size_t compressedBytes;   /* Total packed bytes, for the load log */
+/* Result lines of every record as a full scan would send them, for keys
+ * that match everything. Rendered into a memfd on the first such query
+ * after a load, then sent with sendfile(), or from the mapping when the
+ * connection is compressed. */
+static struct {
+    int fd;                     /* -1 until rendered */
+    char *text;                 /* Mapping of fd; NULL when empty */
+    size_t length;
+    unsigned long generation;   /* databaseGeneration it was rendered from */
+} dumpRender = { -1, NULL, 0, 0 };
+
+static off_t loadedSize = -1;    /* Size of the file when it was loaded */
+static time_t loadedMtime;       /* Modification time of the file when it was loaded */
+static ino_t loadedInode;        /* Inode of the file when it was loaded */
+
+/* Warm-up settings */
+static int mapDatabase = 0;             /* -m: mmap the file instead of reading it */
+static int compressStore = 0;           /* -z: keep the records compressed in memory */
+static int foldCase = 0;                /* -I: keep a case-folded copy for "~key" */
+static int prefaultDatabase = 0;        /* -p: populate the mapping up front */
+static char *warmupQueryFile = NULL;    /* -w: sample queries replayed at startup */
+
+/* Load settings */
+static int loadThreads = 0;             /* -t: loader threads, 0 = one per CPU */
+static char *checksumFile = NULL;       /* -c: per-range checksums to verify */
+static const char *watchedFile;         /* The database file, watched for WATCH */
+
+/* Server status, read by the admin thread while the main thread serves clients */
+static atomic_int serverReady;            /* Cleared while loading or warming up */
+static atomic_ulong databaseGeneration;   /* Incremented by every successful load */
+static atomic_ulong loadedRecords;        /* recordCount as of the last load */
+static atomic_int clientsConnected;       /* Lookup connections being served */
+static atomic_int queriesInFlight;        /* Lookups currently scanning or sending */
+static atomic_ulong queriesServed;        /* Lookups completed since startup */
+
+/* Bytes of the record store and its indexes, published by the main thread
+ * whenever it builds or frees them, so the profile never reads the
+ * structures themselves while they may be swapped */
+static struct {
+    atomic_size_t records;
+    atomic_int mapped;
+    atomic_size_t fieldLengths;
+    atomic_size_t folded;
+    atomic_size_t dump;
+    atomic_size_t compressed;
+    atomic_size_t prefixIndex;
+    atomic_size_t ngramIndex;
+    atomic_size_t artIndex;
+    atomic_size_t mph;
+} memoryUsage;
 
 /* Function to handle errors and terminate the program */
 static void terminate(const char *message)
@@ -31,164 +304,3829 @@ static void terminate(const char *message)
     exit(1); 
 }
 
+/* Signal handler for SIGTERM/SIGINT - begin a graceful shutdown */
+static void requestShutdown(int signo)
+{
+    (void)signo;
+    if (!shutdownRequested)
+    {
+        shutdownRequested = 1;
+        alarm(drainSeconds); /* Arm the drain deadline */
+    }
+}
+
+/* Signal handler for SIGALRM - the drain deadline has passed */
+static void drainDeadlineExpired(int signo)
+{
+    static const char message[] = "Drain deadline expired, exiting\n";
+
+    (void)signo;
+    write(STDERR_FILENO, message, sizeof(message) - 1);
+    _exit(1);
+}
+
+/* Cheap timestamp for the profile: the TSC where there is one (a few
+ * nanoseconds to read), otherwise the monotonic clock in nanoseconds */
+static inline uint64_t profileClock(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+#endif
+}
+
+/* Measure how fast profileClock() ticks against the monotonic clock */
+static void calibrateProfileClock(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    struct timespec start, end, pause = { 0, 20000000 };
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    uint64_t startTicks = profileClock();
+    nanosleep(&pause, NULL);
+    uint64_t endTicks = profileClock();
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double micros = (end.tv_sec - start.tv_sec) * 1e6 + (end.tv_nsec - start.tv_nsec) / 1e3;
+    ticksPerMicrosecond = (endTicks - startTicks) / micros;
+#endif
+}
+
+/* Install a handler without SA_RESTART so blocking calls return EINTR */
+static void installHandler(int signo, void (*handler)(int))
+{
+    struct sigaction action;
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handler;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(signo, &action, NULL) < 0)
+        terminate("sigaction() failed");
+}
+
+/* Send the whole buffer, resuming after partial writes and EINTR */
+static int sendFully(int socket, const char *buffer, size_t length)
+{
+    /* A negative socket discards the output (warm-up replay) */
+    if (socket < 0)
+        return 0;
+
+    while (length > 0)
+    {
+        ssize_t sent = send(socket, buffer, length, 0);
+        if (sent < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buffer += sent;
+        length -= sent;
+    }
+    return 0;
+}
+
+/* Pass the listening sockets to a new server process over a Unix socket */
+static int sendListeningSockets(int channel, const int *sockets, int count)
+{
+    char marker = 'L';
+    struct iovec payload = { &marker, 1 };
+    union {
+        struct cmsghdr header;
+        char space[CMSG_SPACE(MAX_HANDOFF_SOCKETS * sizeof(int))];
+    } control;
+    struct msghdr message;
+
+    memset(&control, 0, sizeof(control));
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &payload;
+    message.msg_iovlen = 1;
+    message.msg_control = control.space;
+    message.msg_controllen = CMSG_SPACE(count * sizeof(int));
+
+    struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(count * sizeof(int));
+    memcpy(CMSG_DATA(header), sockets, count * sizeof(int));
+
+    return sendmsg(channel, &message, 0) == 1 ? 0 : -1;
+}
+
+/* Connect to a running server's handoff socket; returns -1 if there is none */
+static int connectHandoffChannel(const char *handoffPath)
+{
+    struct sockaddr_un handoffAddr;
+    int channel;
+
+    if ((channel = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+        terminate("socket() failed");
+
+    memset(&handoffAddr, 0, sizeof(handoffAddr));
+    handoffAddr.sun_family = AF_UNIX;
+    strncpy(handoffAddr.sun_path, handoffPath, sizeof(handoffAddr.sun_path) - 1);
+
+    /* No server listening on the handoff path: start from scratch */
+    if (connect(channel, (struct sockaddr *)&handoffAddr, sizeof(handoffAddr)) < 0)
+    {
+        close(channel);
+        return -1;
+    }
+    return channel;
+}
+
+/* Tell the running server we are loaded and receive its listening sockets */
+static int inheritListeningSockets(int channel, int *sockets, int maxCount)
+{
+    char marker = 'R';
+    int count = 0;
+
+    if (sendFully(channel, &marker, 1) < 0)
+        terminate("send() failed on handoff channel");
+
+    struct iovec payload = { &marker, 1 };
+    union {
+        struct cmsghdr header;
+        char space[CMSG_SPACE(MAX_HANDOFF_SOCKETS * sizeof(int))];
+    } control;
+    struct msghdr message;
+
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &payload;
+    message.msg_iovlen = 1;
+    message.msg_control = control.space;
+    message.msg_controllen = sizeof(control.space);
+
+    /* Blocks until the old server is between clients */
+    if (recvmsg(channel, &message, 0) != 1)
+        terminate("recvmsg() failed");
+
+    struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+    if (header && header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_RIGHTS)
+    {
+        count = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        if (count > maxCount)
+            count = maxCount;
+        memcpy(sockets, CMSG_DATA(header), count * sizeof(int));
+    }
+    if (count < 1)
+    {
+        fprintf(stderr, "Previous server did not send a listening socket\n");
+        exit(1);
+    }
+
+    close(channel);
+    return count;
+}
+
+/* Listen on the handoff path for a future server version */
+static int openHandoffSocket(const char *handoffPath)
+{
+    struct sockaddr_un handoffAddr;
+    int handoffSocket;
+
+    if ((handoffSocket = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+        terminate("socket() failed");
+
+    memset(&handoffAddr, 0, sizeof(handoffAddr));
+    handoffAddr.sun_family = AF_UNIX;
+    strncpy(handoffAddr.sun_path, handoffPath, sizeof(handoffAddr.sun_path) - 1);
+
+    /* Replace a stale path, or the one the previous server was using */
+    unlink(handoffPath);
+    if (bind(handoffSocket, (struct sockaddr *)&handoffAddr, sizeof(handoffAddr)) < 0)
+        terminate("bind() failed on handoff socket");
+    if (listen(handoffSocket, 1) < 0)
+        terminate("listen() failed on handoff socket");
+
+    return handoffSocket;
+}
+
+static int loadDatabase(const char *databaseFile);
+static void refreshDatabase(const char *databaseFile);
+static void warmUpDatabase(void);
+static void buildIndexes(void);
+static void publishMemoryUsage(void);
+static void artInsertRecords(size_t first);
+static int lookupKey(int clientSocket, z_stream *compressor, const char *searchKey);
+static int openListeningSocket(unsigned short port, int reusePort);
+static void startAdminThread(int adminSocket);
+static void startProfileThread(void);
+static int sendResponse(int clientSocket, z_stream *compressor, const char *response);
+
 /* Function to handle client requests */
-void processClientRequest(int clientSocket, char *databaseFile);
+void processClientRequest(int clientSocket);
 
 /* Main function - server entry point */
 int main(int argc, char *argv[])
 {
     int serverSocket;           /* Socket descriptor for server */
     int clientSocket;           /* Socket descriptor for client */
-    struct sockaddr_in serverAddr; /* Server address */
     struct sockaddr_in clientAddr; /* Client address */
     unsigned short serverPort;     /* Server port */
     unsigned int clientAddrLength; /* Length of client address structure */
+    int reusePort = 0;             /* Set SO_REUSEPORT on the listening socket */
+    unsigned short adminPort = 0;  /* Health-check port, 0 = none */
+    int adminSocket = -1;          /* Socket descriptor for health checks */
+    char *handoffPath = NULL;      /* Unix socket for listening-socket handoff */
+    int handoffSocket = -1;        /* Listens for a newer server version */
+    int handoffChannel = -1;       /* Connection from a newer server version */
+    int handedOff = 0;             /* Listening socket passed to a newer server */
+    int option;
 
     /* Ignore SIGPIPE to prevent termination when writing to a disconnected socket */
     if (signal(SIGPIPE, SIG_IGN) == SIG_ERR) 
         terminate("signal() failed");
 
+    /* SIGTERM/SIGINT start a graceful shutdown; SIGALRM enforces its deadline */
+    installHandler(SIGTERM, requestShutdown);
+    installHandler(SIGINT, requestShutdown);
+    installHandler(SIGALRM, drainDeadlineExpired);
+
+    /* SIGUSR1 dumps the profile; only the profile thread takes it */
+    calibrateProfileClock();
+    startProfileThread();
+
+    /* Parse options: -d <drain seconds>, -r (SO_REUSEPORT), -u <handoff path>,
+     * -m (mmap), -p (prefault), -t <prefault threads>, -w <warm-up queries>,
+     * -a <admin port>, -c <checksum file>, -z (compressed store),
+     * -i <indexes>, -S <slow query milliseconds>, -b <batch delay milliseconds>,
+     * -f <record schema>, -I (case-insensitive "~key") */
+    mdbSchemaDefault(&schema);
+    while ((option = getopt(argc, argv, "d:ru:mpt:w:a:c:zi:e:S:b:f:I")) != -1)
+    {
+        switch (option)
+        {
+        case 'f':
+            if (mdbSchemaParse(&schema, optarg) < 0)
+            {
+                fprintf(stderr, "Invalid record schema: %s\n", optarg);
+                argc = 0;
+            }
+            break;
+        case 'd':
+            drainSeconds = atoi(optarg);
+            break;
+        case 'r':
+            reusePort = 1;
+            break;
+        case 'u':
+            handoffPath = optarg;
+            break;
+        case 'm':
+            mapDatabase = 1;
+            break;
+        case 'p':
+            prefaultDatabase = 1;
+            break;
+        case 't':
+            loadThreads = atoi(optarg);
+            break;
+        case 'c':
+            checksumFile = optarg;
+            break;
+        case 'z':
+            compressStore = 1;
+            break;
+        case 'I':
+            foldCase = 1;
+            break;
+        case 'i':
+            buildPrefixIndex = strstr(optarg, "prefix") != NULL;
+            buildNgramIndex = strstr(optarg, "ngram") != NULL;
+            buildArtIndex = strstr(optarg, "art") != NULL;
+            if (!buildPrefixIndex && !buildNgramIndex && !buildArtIndex)
+                argc = 0;
+            break;
+        case 'e':
+            exactIndexFile = optarg;
+            break;
+        case 'S':
+            slowQueryMillis = atof(optarg);
+            break;
+        case 'b':
+            outputMaxDelay = atof(optarg);
+            break;
+        case 'w':
+            warmupQueryFile = optarg;
+            break;
+        case 'a':
+            adminPort = atoi(optarg);
+            break;
+        default:
+            argc = 0; /* Force the usage message below */
+            break;
+        }
+    }
+
     /* Ensure proper usage: database file and server port must be specified */
-    if (argc != 3)  
+    if (argc - optind != 2 || (mapDatabase && compressStore) || (foldCase && compressStore))  
     {
-        fprintf(stderr, "Usage:  %s <database_file> <Server Port>\n", argv[0]);
+        fprintf(stderr, "Usage:  %s [-d drain_seconds] [-r] [-u handoff_socket] [-p] [-t threads] [-w warmup_queries] [-a admin_port] [-c checksum_file] [-m | -z] [-I] [-i prefix,ngram,art] [-e mph_file] [-S slow_ms] [-b batch_delay_ms] [-f field:width,...] <database_file> <Server Port>\n", argv[0]);
         exit(1);
     }
 
-    char *databaseFile = argv[1]; /* Database filename from arguments */
-    serverPort = atoi(argv[2]);   /* Server port from arguments */
+    struct MdbSchema builtin;
+    mdbSchemaDefault(&builtin);
+    mdbRecLayout = schema.fieldCount == 2 && schema.recordSize == builtin.recordSize && schema.fields[1].offset == builtin.fields[1].offset;
 
-    /* Create socket for incoming connections */
-    if ((serverSocket = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0)
-        terminate("socket() failed");
+    char schemaSpec[MDB_SCHEMA_MAX_FIELDS * (MDB_SCHEMA_MAX_NAME + 8)];
+    mdbSchemaDescribe(&schema, schemaSpec, sizeof(schemaSpec));
+    fprintf(stderr, "Record schema: %s (%zu bytes)\n", schemaSpec, schema.recordSize);
 
-    /* Prepare server address structure */
-    memset(&serverAddr, 0, sizeof(serverAddr));   // Zero out structure
-    serverAddr.sin_family = AF_INET;                // Internet address family
-    serverAddr.sin_addr.s_addr = htonl(INADDR_ANY); // Any incoming interface
-    serverAddr.sin_port = htons(serverPort);       // Local port
+    char *databaseFile = argv[optind];     /* Database filename from arguments */
+    serverPort = atoi(argv[optind + 1]);   /* Server port from arguments */
+    watchedFile = databaseFile;
 
-    /* Bind to the local address */
-    if (bind(serverSocket, (struct sockaddr *)&serverAddr, sizeof(serverAddr)) < 0)
-        terminate("bind() failed");
+    /* Find out whether a running server will hand over its sockets */
+    int upgradeChannel = handoffPath ? connectHandoffChannel(handoffPath) : -1;
 
-    /* Mark the socket to listen for incoming connections */
-    if (listen(serverSocket, MAX_CONNECTIONS) < 0)
-        terminate("listen() failed");
+    /* Starting from scratch: report NOTREADY to health checks while loading */
+    if (upgradeChannel < 0 && adminPort)
+    {
+        adminSocket = openListeningSocket(adminPort, reusePort);
+        startAdminThread(adminSocket);
+    }
+
+    /* Load and warm up the database before taking any traffic */
+    if (loadDatabase(databaseFile) < 0)
+        exit(1);
+    warmUpDatabase();
+
+    /* Take over the listening sockets of the running server, if there is one */
+    if (upgradeChannel >= 0)
+    {
+        int inherited[MAX_HANDOFF_SOCKETS];
+        int inheritedCount = inheritListeningSockets(upgradeChannel, inherited, MAX_HANDOFF_SOCKETS);
+        struct sockaddr_in boundAddr;
+        socklen_t boundAddrLength = sizeof(boundAddr);
+
+        serverSocket = inherited[0];
+        getsockname(serverSocket, (struct sockaddr *)&boundAddr, &boundAddrLength);
+        fprintf(stderr, "Inherited listening socket on port %d from previous server\n", ntohs(boundAddr.sin_port));
+
+        /* The old server's admin socket, if it had one, keeps its port too */
+        if (inheritedCount > 1)
+        {
+            if (adminPort)
+                adminSocket = inherited[1];
+            else
+                close(inherited[1]);
+        }
+        else if (adminPort)
+        {
+            adminSocket = openListeningSocket(adminPort, reusePort);
+        }
+        if (adminSocket >= 0)
+            startAdminThread(adminSocket);
+    }
+    else
+    {
+        serverSocket = openListeningSocket(serverPort, reusePort);
+    }
 
-    for (;;) /* Infinite loop to handle incoming connections */
+    /* Be ready to hand the listening socket to the next server version */
+    if (handoffPath)
+        handoffSocket = openHandoffSocket(handoffPath);
+
+    while (!shutdownRequested) /* Loop until SIGTERM/SIGINT or handoff */
     {
+        struct pollfd waitSet[3] = {
+            { serverSocket, POLLIN, 0 },
+            { handoffSocket, POLLIN, 0 },  /* Ignored by poll() when -1 */
+            { handoffChannel, POLLIN, 0 },
+        };
+
+        if (poll(waitSet, 3, -1) < 0)
+        {
+            if (errno == EINTR)
+                continue; /* Interrupted by a signal; re-check shutdownRequested */
+            terminate("poll() failed");
+        }
+
+        /* A new server version is starting; it loads its database first */
+        if ((waitSet[1].revents & POLLIN) && handoffChannel < 0)
+            handoffChannel = accept(handoffSocket, NULL, NULL);
+
+        /* The new server is loaded and asks for the listening sockets */
+        if (waitSet[2].revents & (POLLIN | POLLHUP))
+        {
+            char marker;
+            int sockets[MAX_HANDOFF_SOCKETS] = { serverSocket, adminSocket };
+
+            if (recv(handoffChannel, &marker, 1, 0) == 1)
+            {
+                if (sendListeningSockets(handoffChannel, sockets, adminSocket >= 0 ? 2 : 1) == 0)
+                    handedOff = 1;
+                else
+                    perror("sendmsg() failed");
+            }
+            else
+            {
+                fprintf(stderr, "New server went away before taking over\n");
+            }
+            close(handoffChannel);
+            handoffChannel = -1;
+            if (handedOff)
+                break;
+        }
+
+        if (!(waitSet[0].revents & POLLIN))
+            continue;
+
         clientAddrLength = sizeof(clientAddr); /* Initialize client address size */
 
         /* Wait for a client to connect */
         if ((clientSocket = accept(serverSocket, (struct sockaddr *)&clientAddr, &clientAddrLength)) < 0)
+        {
+            if (errno == EINTR)
+                continue; /* Interrupted by a signal; re-check shutdownRequested */
             terminate("accept() failed");
+        }
 
         /* Client is now connected */
         fprintf(stderr, "\nConnection established with: %s\n", inet_ntoa(clientAddr.sin_addr));
 
+        /* Pick up records appended or rewritten since the last client */
+        refreshDatabase(databaseFile);
+
         /* Process client request */
-        processClientRequest(clientSocket, databaseFile);
+        processClientRequest(clientSocket);
 
         /* Log when the client connection terminates */
         fprintf(stderr, "Connection terminated from: %s\n", inet_ntoa(clientAddr.sin_addr));
     }
 
-    /* NOT REACHED */
+    if (handoffSocket >= 0)
+    {
+        close(handoffSocket);
+        if (!handedOff)
+            unlink(handoffPath); /* After a handoff the path belongs to the new server */
+    }
+
+    /* The new server accepts from the same socket, including its backlog */
+    if (handedOff)
+    {
+        close(serverSocket);
+        fprintf(stderr, "\nListening socket handed off to the new server, exiting\n");
+        return 0;
+    }
+
+    fprintf(stderr, "\nShutting down, draining for up to %u seconds\n", drainSeconds);
+
+    /* Serve connections already queued in the backlog, then stop accepting */
+    if (fcntl(serverSocket, F_SETFL, O_NONBLOCK) < 0)
+        terminate("fcntl() failed");
+    for (;;)
+    {
+        clientAddrLength = sizeof(clientAddr);
+        if ((clientSocket = accept(serverSocket, (struct sockaddr *)&clientAddr, &clientAddrLength)) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            break; /* EAGAIN: the backlog is empty */
+        }
+
+        /* Accepted sockets inherit O_NONBLOCK on some systems; undo it */
+        fcntl(clientSocket, F_SETFL, 0);
+
+        fprintf(stderr, "Draining connection from: %s\n", inet_ntoa(clientAddr.sin_addr));
+        processClientRequest(clientSocket);
+    }
+    close(serverSocket);
+
+    fprintf(stderr, "Shutdown complete\n");
+    return 0;
 }
 
-/* Function to handle client communication and database lookups */
-void processClientRequest(int clientSocket, char *databaseFile)
+/* Drop the rendered dump; the next match-all query renders it again */
+static void releaseDump(void)
 {
-    /* Open the specified database file for reading */
-    FILE *filePointer = fopen(databaseFile, "rb"); // Open in binary mode
-    if (filePointer == NULL) 
-        terminate("Failed to open database file");
+    if (dumpRender.text)
+        munmap(dumpRender.text, dumpRender.length);
+    if (dumpRender.fd >= 0)
+        close(dumpRender.fd);
+    dumpRender.fd = -1;
+    dumpRender.text = NULL;
+    dumpRender.length = 0;
+    memoryUsage.dump = 0;
+}
 
-    /* Initialize a linked list to store database records */
-    struct List recordList;
-    initList(&recordList);
+/* Release the records of the previous load */
+static void unloadDatabase(void)
+{
+    if (mappedLength)
+        munmap(records, mappedLength);
+    else
+        free(records);
+    for (size_t i = 0; i < compressedRangeCount; i++)
+    {
+        free(compressedRanges[i].data);
+        free(compressedRanges[i].blockOffsets);
+    }
+    free(compressedRanges);
+    free(fieldLengths);
+    free(foldedRecords);
+    records = NULL;
+    fieldLengths = NULL;
+    foldedRecords = NULL;
+    recordCount = 0;
+    mappedLength = 0;
+    compressedRanges = NULL;
+    compressedRangeCount = 0;
+    compressedBytes = 0;
+    releaseDump();
+}
 
-    struct MdbRec record; 
-    struct Node *node = NULL;
+/* Shared state of the threads loading one database file */
+struct LoadJob {
+    int fileDescriptor;
+    char *records;                  /* Destination array, or the mapping */
+    size_t recordCount;
+    int readFile;                   /* pread() into records, else records is mmapped */
+    size_t rangeCount;              /* Ranges of LOAD_RANGE_RECORDS records */
+    atomic_size_t nextRange;        /* Next range to claim */
+    uint64_t *checksums;            /* FNV-1a of each range's file bytes */
+    atomic_size_t repairedRecords;  /* Records with an unterminated field */
+    atomic_int failed;
+    struct CompressedRange *compressedRanges; /* Non-NULL to build a compressed store */
+    unsigned char *fieldLengths;              /* Filled in for an uncompressed store */
+    char *foldedRecords;                      /* Filled in with -I */
+};
 
-    /* Read all records from the database file into memory */
-    while (fread(&record, sizeof(record), 1, filePointer) == 1) 
+/* FNV-1a over a byte range, continuing from hash */
+static uint64_t fnv1a(uint64_t hash, const void *data, size_t length)
+{
+    const unsigned char *bytes = (const unsigned char *)data;
+
+    for (size_t i = 0; i < length; i++)
     {
-        /* Dynamically allocate memory for a new record and copy the data */
-        struct MdbRec *recordCopy = (struct MdbRec *)malloc(sizeof(record));
-        if (!recordCopy)
-            terminate("Memory allocation failed");
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/* Field f of a record */
+static inline const char *recordField(const char *record, int f)
+{
+    return record + schema.fields[f].offset;
+}
 
-        memcpy(recordCopy, &record, sizeof(record));
+/* Cut every unterminated field of a record short by its last byte.
+ * Returns nonzero if one was. */
+static int terminateFields(char *record)
+{
+    int repaired = 0;
+
+    for (int f = 0; f < schema.fieldCount; f++)
+    {
+        char *field = record + schema.fields[f].offset;
 
-        /* Add the record to the linked list */
-        node = addAfter(&recordList, node, recordCopy);
-        if (node == NULL) 
-            terminate("Failed to add record to list");
+        if (!memchr(field, '\0', schema.fields[f].width))
+        {
+            field[schema.fields[f].width - 1] = '\0';
+            repaired = 1;
+        }
     }
+    return repaired;
+}
 
-    /* Check for any fread() error */
-    if (ferror(filePointer)) 
-        terminate("Error reading database file");
+/* Store the length of each field of a terminated record */
+static void measureFields(const char *record, unsigned char *lengths)
+{
+    for (int f = 0; f < schema.fieldCount; f++)
+        lengths[f] = strlen(recordField(record, f));
+}
 
-    /* Wrap the client socket with a FILE* for easier reading */
-    FILE *clientInput = fdopen(clientSocket, "r");
-    if (clientInput == NULL) 
-        terminate("Failed to associate file stream with socket");
+/* Write the case-folded copy of a terminated record */
+static void foldFields(const char *record, const unsigned char *lengths, char *folded)
+{
+    memset(folded, 0, schema.recordSize);
+    for (int f = 0; f < schema.fieldCount; f++)
+        mdbFoldUtf8(folded + schema.fields[f].offset, recordField(record, f), lengths[f]);
+}
 
-    char queryLine[1000];
-    char searchKey[MAX_KEY_LENGTH + 1];
+/* pread() one range of records; the file position is shared by the threads */
+static int readRange(int fileDescriptor, size_t first, size_t count, char *destination)
+{
+    size_t length = count * schema.recordSize;
+    size_t loaded = 0;
+    off_t offset = (off_t)first * schema.recordSize;
 
-    char resultBuffer[1000];
-    int resultLength;
-    int sendResult;
+    while (loaded < length)
+    {
+        ssize_t bytesRead = pread(fileDescriptor, (char *)destination + loaded, length - loaded, offset + loaded);
+        if (bytesRead <= 0)
+        {
+            if (bytesRead < 0 && errno == EINTR)
+                continue;
+            if (bytesRead < 0)
+                perror("Error reading database file");
+            else
+                fprintf(stderr, "Database file shrank while loading\n");
+            return -1;
+        }
+        loaded += bytesRead;
+    }
+    return 0;
+}
 
-    /* Process the client's queries */
-    while (fgets(queryLine, sizeof(queryLine), clientInput) != NULL) 
+/* Pack a range of records into blocks, dropping the padding after each field */
+static void compressRange(struct CompressedRange *range, const char *rangeRecords, size_t count)
+{
+    /* Worst case: every field full, plus its length byte */
+    unsigned char *data = (unsigned char *)malloc(count * (schema.recordSize + schema.fieldCount));
+    range->blockCount = (count + COMPRESSED_BLOCK_RECORDS - 1) / COMPRESSED_BLOCK_RECORDS;
+    range->blockOffsets = (uint32_t *)malloc((range->blockCount + 1) * sizeof(uint32_t));
+    if (!data || !range->blockOffsets)
+        terminate("Memory allocation failed");
+
+    size_t length = 0;
+    for (size_t i = 0; i < count; i++)
     {
-        /* Extract the search key and remove any newline character */
-        strncpy(searchKey, queryLine, sizeof(searchKey) - 1);
-        searchKey[sizeof(searchKey) - 1] = '\0';
-        size_t lastChar = strlen(searchKey) - 1;
-        if (searchKey[lastChar] == '\n')
-            searchKey[lastChar] = '\0';
+        if (i % COMPRESSED_BLOCK_RECORDS == 0)
+            range->blockOffsets[i / COMPRESSED_BLOCK_RECORDS] = length;
 
-        /* Traverse the list and search for matching records */
-        struct Node *currentNode = recordList.head;
-        int recordCount = 1;
-        while (currentNode) 
+        for (int f = 0; f < schema.fieldCount; f++)
         {
-            struct MdbRec *currentRecord = (struct MdbRec *)currentNode->data;
-            if (strstr(currentRecord->name, searchKey) || strstr(currentRecord->msg, searchKey)) 
-            {
-                /* Format the result and send it to the client */
-                resultLength = sprintf(resultBuffer, "%4d: {%s} said {%s}\n", recordCount, currentRecord->name, currentRecord->msg);
-                if ((sendResult = send(clientSocket, resultBuffer, resultLength, 0)) != resultLength) 
-                {
-                    perror("send() failed");
-                    break;
-                }
-            }
-            currentNode = currentNode->next;
-            recordCount++;
+            const char *field = recordField(rangeRecords + i * schema.recordSize, f);
+            size_t fieldLength = strlen(field);
+
+            data[length++] = fieldLength;
+            memcpy(data + length, field, fieldLength);
+            length += fieldLength;
         }
+    }
+    range->blockOffsets[range->blockCount] = length;
+
+    range->data = (unsigned char *)realloc(data, length ? length : 1);
+    range->length = length;
+}
+
+/* Claim ranges until none are left: read, checksum and validate each */
+static void *loadRanges(void *argument)
+{
+    struct LoadJob *job = (struct LoadJob *)argument;
+    char *scratch = NULL;
+    size_t range;
 
-        /* Send a blank line to indicate the end of search results */
-        resultLength = sprintf(resultBuffer, "\n");
-        if ((sendResult = send(clientSocket, resultBuffer, resultLength, 0)) != resultLength) 
-            perror("send() failed");
+    /* A compressed store is built range by range from a scratch copy */
+    if (job->compressedRanges)
+    {
+        scratch = (char *)malloc(LOAD_RANGE_RECORDS * schema.recordSize);
+        if (!scratch)
+            terminate("Memory allocation failed");
     }
 
-    /* Check if fgets() failed while reading from the client */
-    if (ferror(clientInput)) 
-        perror("fgets() failed");
+    while ((range = job->nextRange++) < job->rangeCount && !job->failed)
+    {
+        size_t first = range * LOAD_RANGE_RECORDS;
+        size_t count = job->recordCount - first < LOAD_RANGE_RECORDS ? job->recordCount - first : LOAD_RANGE_RECORDS;
+        char *rangeRecords = scratch ? scratch : job->records + first * schema.recordSize;
+
+        if (job->readFile && readRange(job->fileDescriptor, first, count, rangeRecords) < 0)
+        {
+            job->failed = 1;
+            break;
+        }
+
+        /* Checksum the bytes as they are in the file, before any repair */
+        job->checksums[range] = fnv1a(0xcbf29ce484222325ULL, rangeRecords, count * schema.recordSize);
+
+        /* Every field must be NUL-terminated, or the scan would run past it */
+        for (size_t i = 0; i < count; i++)
+        {
+            if (terminateFields(rangeRecords + i * schema.recordSize))
+                job->repairedRecords++;
+        }
+
+        if (scratch)
+        {
+            compressRange(&job->compressedRanges[range], rangeRecords, count);
+            continue;
+        }
+
+        for (size_t i = 0; i < count; i++)
+        {
+            unsigned char *lengths = job->fieldLengths + (first + i) * schema.fieldCount;
+
+            measureFields(rangeRecords + i * schema.recordSize, lengths);
+            if (job->foldedRecords)
+                foldFields(rangeRecords + i * schema.recordSize, lengths, job->foldedRecords + (first + i) * schema.recordSize);
+        }
+    }
+
+    free(scratch);
+    return NULL;
+}
+
+/* Compare range checksums against the checksum file, or create it.
+ * Each line of the file is "<record count> <checksum>" for one range; the
+ * last, partial range is only checked while its record count matches. */
+static int verifyChecksums(const struct LoadJob *job)
+{
+    FILE *checksumStream = fopen(checksumFile, "r");
+    size_t range;
+
+    if (checksumStream == NULL)
+    {
+        if (errno != ENOENT || (checksumStream = fopen(checksumFile, "w")) == NULL)
+        {
+            perror("Failed to open checksum file");
+            return -1;
+        }
+        for (range = 0; range < job->rangeCount; range++)
+        {
+            size_t count = job->recordCount - range * LOAD_RANGE_RECORDS;
+            fprintf(checksumStream, "%zu %016llx\n", count < LOAD_RANGE_RECORDS ? count : LOAD_RANGE_RECORDS,
+                    (unsigned long long)job->checksums[range]);
+        }
+        fclose(checksumStream);
+        fprintf(stderr, "Wrote %zu range checksums to %s\n", job->rangeCount, checksumFile);
+        return 0;
+    }
+
+    size_t expectedCount;
+    unsigned long long expected;
+    int result = 0;
+
+    for (range = 0; range < job->rangeCount && fscanf(checksumStream, "%zu %llx", &expectedCount, &expected) == 2; range++)
+    {
+        size_t count = job->recordCount - range * LOAD_RANGE_RECORDS;
+        if (count > LOAD_RANGE_RECORDS)
+            count = LOAD_RANGE_RECORDS;
+        if (count != expectedCount)
+            continue; /* The file was appended to since the checksums were written */
+        if (job->checksums[range] != expected)
+        {
+            fprintf(stderr, "Checksum mismatch in records %zu-%zu\n", range * LOAD_RANGE_RECORDS + 1, range * LOAD_RANGE_RECORDS + count);
+            result = -1;
+        }
+    }
+    fclose(checksumStream);
+    return result;
+}
+
+/* Load all records of the database file into one contiguous array.
+ * The file is split into record-aligned ranges that threads read (or, when
+ * mapped, fault in), checksum and validate in parallel. */
+static int loadDatabase(const char *databaseFile)
+{
+    /* Open the specified database file for reading */
+    int fileDescriptor = open(databaseFile, O_RDONLY);
+    if (fileDescriptor < 0) 
+    {
+        perror("Failed to open database file");
+        return -1;
+    }
+
+    /* Remember which version of the file is loaded */
+    struct stat fileStat;
+    if (fstat(fileDescriptor, &fileStat) < 0)
+        terminate("fstat() failed");
+
+    /* A trailing partial record is ignored */
+    size_t newCount = fileStat.st_size / schema.recordSize;
+    size_t newLength = newCount * schema.recordSize;
+    char *newRecords;
+
+    if (newCount == 0)
+    {
+        newRecords = NULL;
+    }
+    else if (mapDatabase)
+    {
+        /* Private and writable so that repairs stay in this process.
+         * MAP_POPULATE reads the whole file in with the mapping. */
+        newRecords = mmap(NULL, newLength, PROT_READ | PROT_WRITE, MAP_PRIVATE | (prefaultDatabase ? MAP_POPULATE : 0), fileDescriptor, 0);
+        if (newRecords == MAP_FAILED)
+        {
+            perror("mmap() failed");
+            close(fileDescriptor);
+            return -1;
+        }
+
+        /* Let readahead run ahead of the loader threads */
+        if (prefaultDatabase && madvise(newRecords, newLength, MADV_WILLNEED) < 0)
+            perror("madvise() failed");
+    }
+    else if (compressStore)
+    {
+        newRecords = NULL; /* The loader threads build compressed ranges instead */
+    }
+    else
+    {
+        newRecords = (char *)malloc(newLength);
+        if (!newRecords)
+            terminate("Memory allocation failed");
+    }
+
+    struct LoadJob job;
+    memset(&job, 0, sizeof(job));
+    job.fileDescriptor = fileDescriptor;
+    job.records = newRecords;
+    job.recordCount = newCount;
+    job.readFile = !mapDatabase; /* Compressed stores are always read */
+    job.rangeCount = (newCount + LOAD_RANGE_RECORDS - 1) / LOAD_RANGE_RECORDS;
+    job.checksums = (uint64_t *)calloc(job.rangeCount + 1, sizeof(uint64_t));
+    if (compressStore)
+        job.compressedRanges = (struct CompressedRange *)calloc(job.rangeCount + 1, sizeof(struct CompressedRange));
+    else
+        job.fieldLengths = (unsigned char *)malloc((newCount + 1) * schema.fieldCount);
+    if (foldCase)
+        job.foldedRecords = (char *)malloc((newCount + 1) * schema.recordSize);
+    if (!job.checksums || (compressStore ? !job.compressedRanges : !job.fieldLengths) || (foldCase && !job.foldedRecords))
+        terminate("Memory allocation failed");
+
+    /* One thread per CPU by default, but never more than there are ranges */
+    int threadCount = loadThreads > 0 ? loadThreads : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if ((size_t)threadCount > job.rangeCount)
+        threadCount = job.rangeCount;
+    if (threadCount < 1)
+        threadCount = 1;
+
+    pthread_t *threads = (pthread_t *)malloc(threadCount * sizeof(pthread_t));
+    if (!threads)
+        terminate("Memory allocation failed");
+
+    /* This thread loads ranges too; helpers that fail to start are skipped */
+    int started = 0;
+    for (int i = 1; i < threadCount; i++)
+        if (pthread_create(&threads[started], NULL, loadRanges, &job) == 0)
+            started++;
+    loadRanges(&job);
+    for (int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+    close(fileDescriptor);
+
+    if (!job.failed && checksumFile && verifyChecksums(&job) < 0)
+        job.failed = 1;
+    free(job.checksums);
+
+    if (job.failed)
+    {
+        if (mapDatabase && newRecords)
+            munmap(newRecords, newLength);
+        else
+            free(newRecords);
+        for (size_t i = 0; job.compressedRanges && i < job.rangeCount; i++)
+        {
+            free(job.compressedRanges[i].data);
+            free(job.compressedRanges[i].blockOffsets);
+        }
+        free(job.compressedRanges);
+        free(job.fieldLengths);
+        free(job.foldedRecords);
+        return -1;
+    }
+    if (job.repairedRecords)
+        fprintf(stderr, "Terminated unterminated fields in %zu records\n", (size_t)job.repairedRecords);
+
+    /* Replace the previously loaded records, if any */
+    unloadDatabase();
+    records = newRecords;
+    recordCount = newCount;
+    mappedLength = mapDatabase ? newLength : 0;
+    fieldLengths = job.fieldLengths;
+    foldedRecords = job.foldedRecords;
+    if (job.compressedRanges)
+    {
+        compressedRanges = job.compressedRanges;
+        compressedRangeCount = job.rangeCount;
+        for (size_t i = 0; i < compressedRangeCount; i++)
+            compressedBytes += compressedRanges[i].length + (compressedRanges[i].blockCount + 1) * sizeof(uint32_t);
+        fprintf(stderr, "Compressed %zu bytes of records into %zu bytes\n", newLength, compressedBytes);
+    }
+    loadedRecords = newCount;
+    databaseGeneration++;
+    loadedSize = fileStat.st_size;
+    loadedMtime = fileStat.st_mtime;
+    loadedInode = fileStat.st_ino;
+
+    buildIndexes();
+    publishMemoryUsage();
+    return 0;
+}
+
+/* Add the records appended to the file since it was loaded to the array,
+ * and their names to the ART, leaving the loaded records in place. Only a
+ * plain in-memory array without the substring indexes or checksums is
+ * extended. Anything else, or a file whose last loaded record changed,
+ * needs a full reload (-1). */
+static int appendRecords(const char *databaseFile)
+{
+    struct stat fileStat;
+    char lastRecord[MDB_SCHEMA_MAX_RECORD];
+    int fileDescriptor;
+
+    if (mapDatabase || compressStore || checksumFile || prefixIndex.entries || ngramIndex.offsets || recordCount == 0)
+        return -1;
+    if ((fileDescriptor = open(databaseFile, O_RDONLY)) < 0)
+        return -1;
+    if (fstat(fileDescriptor, &fileStat) < 0 || fileStat.st_ino != loadedInode ||
+        readRange(fileDescriptor, recordCount - 1, 1, lastRecord) < 0 ||
+        memcmp(lastRecord, records + (recordCount - 1) * schema.recordSize, schema.recordSize) != 0)
+    {
+        close(fileDescriptor);
+        return -1;
+    }
+
+    size_t first = recordCount;
+    size_t newCount = fileStat.st_size / schema.recordSize;
+    if (newCount > first)
+    {
+        char *newRecords = (char *)realloc(records, newCount * schema.recordSize);
+        unsigned char *newLengths = (unsigned char *)realloc(fieldLengths, (newCount + 1) * schema.fieldCount);
+        char *newFolded = foldedRecords ? (char *)realloc(foldedRecords, (newCount + 1) * schema.recordSize) : NULL;
+        if (!newRecords || !newLengths || (foldedRecords && !newFolded))
+            terminate("Memory allocation failed");
+        records = newRecords;
+        fieldLengths = newLengths;
+        if (foldedRecords)
+            foldedRecords = newFolded;
+
+        if (readRange(fileDescriptor, first, newCount - first, records + first * schema.recordSize) < 0)
+        {
+            close(fileDescriptor);
+            return -1;
+        }
+        for (size_t i = first; i < newCount; i++)
+        {
+            terminateFields(records + i * schema.recordSize);
+            measureFields(records + i * schema.recordSize, fieldLengths + i * schema.fieldCount);
+            if (foldedRecords)
+                foldFields(records + i * schema.recordSize, fieldLengths + i * schema.fieldCount, foldedRecords + i * schema.recordSize);
+        }
+        recordCount = newCount;
+        loadedRecords = newCount;
+        databaseGeneration++;
+        if (buildArtIndex)
+            artInsertRecords(first);
+        publishMemoryUsage();
+        fprintf(stderr, "Database file grew, added %zu records\n", newCount - first);
+    }
+    close(fileDescriptor);
+
+    loadedSize = fileStat.st_size;
+    loadedMtime = fileStat.st_mtime;
+    return 0;
+}
+
+/* Reload the database if the file changed since it was last loaded */
+static void refreshDatabase(const char *databaseFile)
+{
+    struct stat fileStat;
+
+    if (stat(databaseFile, &fileStat) < 0)
+    {
+        perror("stat() failed");
+        return;
+    }
+    if (fileStat.st_size == loadedSize && fileStat.st_mtime == loadedMtime)
+        return;
+
+    /* Records appended to the loaded file are added in place */
+    if (fileStat.st_ino == loadedInode && fileStat.st_size > loadedSize && appendRecords(databaseFile) == 0)
+        return;
+
+    fprintf(stderr, "Database file changed, reloading\n");
+    serverReady = 0;
+    if (loadDatabase(databaseFile) < 0)
+        fprintf(stderr, "Reload failed, keeping the previous records\n");
+    warmUpDatabase();
+}
+
+/* Run each key of the sample query file through the lookup path */
+static void replayQueries(const char *queryFile)
+{
+    FILE *queries = fopen(queryFile, "r");
+    if (queries == NULL)
+    {
+        perror("Failed to open warm-up query file");
+        return;
+    }
+
+    char queryLine[1000];
+    char searchKey[MAX_KEY_LENGTH + 1];
+    int replayed = 0;
+
+    while (fgets(queryLine, sizeof(queryLine), queries) != NULL)
+    {
+        /* Same key extraction as processClientRequest() */
+        strncpy(searchKey, queryLine, sizeof(searchKey) - 1);
+        searchKey[sizeof(searchKey) - 1] = '\0';
+        searchKey[strcspn(searchKey, "\n")] = '\0';
+
+        lookupKey(-1, NULL, searchKey);
+        replayed++;
+    }
+    fclose(queries);
+
+    fprintf(stderr, "Replayed %d warm-up queries\n", replayed);
+}
+
+/* Warm the freshly loaded records up, then mark the server ready */
+static void warmUpDatabase(void)
+{
+    serverReady = 0;
+
+    if (warmupQueryFile)
+        replayQueries(warmupQueryFile);
+
+    serverReady = 1;
+    fprintf(stderr, "Database ready: %zu records\n", recordCount);
+}
+
+/* Packed bytes of one block of the compressed store */
+static const unsigned char *packedBlock(size_t block, size_t *length)
+{
+    const struct CompressedRange *range = &compressedRanges[block / BLOCKS_PER_RANGE];
+    size_t blockInRange = block % BLOCKS_PER_RANGE;
+
+    *length = range->blockOffsets[blockInRange + 1] - range->blockOffsets[blockInRange];
+    return range->data + range->blockOffsets[blockInRange];
+}
+
+/* Unpack one block of the compressed store into this thread's block buffer.
+ * The last block decoded is kept, so fetching neighbouring records is cheap. */
+static const char *decodeBlock(size_t block, const unsigned char **lengths)
+{
+    static __thread char *decodedRecords;   /* Allocated on first use, for the schema's record size */
+    static __thread unsigned char decodedLengths[COMPRESSED_BLOCK_RECORDS * MDB_SCHEMA_MAX_FIELDS];
+    static __thread size_t decodedBlock;
+    static __thread unsigned long decodedGeneration; /* 0: nothing decoded yet */
+
+    *lengths = decodedLengths;
+    if (decodedGeneration == databaseGeneration && decodedBlock == block)
+        return decodedRecords;
+
+    size_t length;
+    const unsigned char *packed = packedBlock(block, &length);
+    const unsigned char *end = packed + length;
+
+    if (!decodedRecords && (decodedRecords = (char *)malloc(COMPRESSED_BLOCK_RECORDS * schema.recordSize)) == NULL)
+        terminate("Memory allocation failed");
+    memset(decodedRecords, 0, COMPRESSED_BLOCK_RECORDS * schema.recordSize);
+    for (size_t i = 0; packed < end; i++)
+    {
+        for (int f = 0; f < schema.fieldCount; f++)
+        {
+            decodedLengths[i * schema.fieldCount + f] = packed[0];
+            memcpy(decodedRecords + i * schema.recordSize + schema.fields[f].offset, packed + 1, packed[0]);
+            packed += 1 + packed[0];
+        }
+    }
+
+    decodedBlock = block;
+    decodedGeneration = databaseGeneration;
+    return decodedRecords;
+}
+
+/* Record index of the store, unpacking its block if the store is compressed */
+static const char *fetchRecord(size_t index, const unsigned char **lengths)
+{
+    if (compressedRanges)
+    {
+        const char *block = decodeBlock(index / COMPRESSED_BLOCK_RECORDS, lengths);
+        *lengths += index % COMPRESSED_BLOCK_RECORDS * schema.fieldCount;
+        return block + index % COMPRESSED_BLOCK_RECORDS * schema.recordSize;
+    }
+    *lengths = &fieldLengths[index * schema.fieldCount];
+    return records + index * schema.recordSize;
+}
+
+/* The field offsets, copied to a caller's local array so that calls in the
+ * match kernels do not force the layout to be reloaded for every record */
+static inline void copyFieldOffsets(size_t *offsets)
+{
+    for (int f = 0; f < schema.fieldCount; f++)
+        offsets[f] = schema.fields[f].offset;
+}
+
+/* Does any field contain the key? Fields shorter than the key cannot;
+ * the others are searched only up to their known length, with the kernel
+ * for the key's length (see mdb-match.h). */
+static inline __attribute__((always_inline)) int recordMatches(const char *record, const unsigned char *lengths, int fieldCount,
+                                                               const size_t *offsets, MdbMatcher match, const char *searchKey, size_t keyLength)
+{
+    for (int f = 0; f < fieldCount; f++)
+        if (lengths[f] >= keyLength && match(record + offsets[f], lengths[f], searchKey, keyLength))
+            return 1;
+    return 0;
+}
+
+static inline __attribute__((always_inline)) size_t findMatchesWith(MdbMatcher match, int fieldCount, size_t recordSize, const size_t *offsets,
+                                                                    const char *block, const unsigned char *lengths, size_t count,
+                                                                    const char *searchKey, size_t keyLength, uint32_t *hits)
+{
+    size_t hitCount = 0;
+
+    for (size_t i = 0; i < count; i++)
+        if (recordMatches(block + i * recordSize, lengths + i * fieldCount, fieldCount, offsets, match, searchKey, keyLength))
+            hits[hitCount++] = i;
+    return hitCount;
+}
+
+/* The layout of struct MdbRec gets its own copy of the loop, with the
+ * field count, offsets and record size as constants; any other layout is
+ * read from the schema once per block */
+static inline __attribute__((always_inline)) size_t findMatchesIn(MdbMatcher match, const char *block, const unsigned char *lengths,
+                                                                  size_t count, const char *searchKey, size_t keyLength, uint32_t *hits)
+{
+    static const size_t mdbRecOffsets[2] = { offsetof(struct MdbRec, name), offsetof(struct MdbRec, msg) };
+    size_t offsets[MDB_SCHEMA_MAX_FIELDS];
+
+    if (mdbRecLayout)
+        return findMatchesWith(match, 2, sizeof(struct MdbRec), mdbRecOffsets, block, lengths, count, searchKey, keyLength, hits);
+    copyFieldOffsets(offsets);
+    return findMatchesWith(match, schema.fieldCount, schema.recordSize, offsets, block, lengths, count, searchKey, keyLength, hits);
+}
+
+/* Positions within a block of the records containing the key. Each case
+ * is its own copy of the loop with its kernel inlined, so the kernel is
+ * picked once per block instead of called through a pointer per field. */
+static size_t findMatches(const char *block, const unsigned char *lengths, size_t count,
+                          const char *searchKey, size_t keyLength, uint32_t *hits)
+{
+    switch (keyLength)
+    {
+    case 0:
+        return findMatchesIn(mdbMatchEmpty, block, lengths, count, searchKey, keyLength, hits);
+    case 1:
+        return findMatchesIn(mdbMatch1, block, lengths, count, searchKey, keyLength, hits);
+    case 2:
+        return findMatchesIn(mdbMatch2, block, lengths, count, searchKey, keyLength, hits);
+    case 3:
+        return findMatchesIn(mdbMatch3, block, lengths, count, searchKey, keyLength, hits);
+    case 4:
+        return findMatchesIn(mdbMatch4, block, lengths, count, searchKey, keyLength, hits);
+    default:
+        return findMatchesIn(mdbMatchLong, block, lengths, count, searchKey, keyLength, hits);
+    }
+}
+
+/* Milliseconds from start to now */
+static double millisSince(const struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e3 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+/* Start the result stream of one query; compressor is NULL unless the
+ * client negotiated compression */
+static void openResultStream(struct ResultStream *stream, int clientSocket, z_stream *compressor)
+{
+    stream->socket = clientSocket;
+    stream->compressor = compressor;
+    stream->length = 0;
+    stream->batchLimit = OUTPUT_FIRST_BATCH;
+    stream->failed = 0;
+    stream->formatted = 0;
+    memset(stream->ticks, 0, sizeof(stream->ticks));
+}
+
+/* Run the buffered bytes through the connection's deflate stream and send
+ * what it produces. A sync flush makes everything so far decodable. */
+static int sendCompressed(struct ResultStream *stream, int sync)
+{
+    char compressed[OUTPUT_MAX_BATCH];
+    z_stream *compressor = stream->compressor;
+
+    compressor->next_in = (Bytef *)stream->buffer;
+    compressor->avail_in = stream->length;
+    do
+    {
+        compressor->next_out = (Bytef *)compressed;
+        compressor->avail_out = sizeof(compressed);
+        uint64_t start = profileClock();
+        deflate(compressor, sync ? Z_SYNC_FLUSH : Z_NO_FLUSH);
+        uint64_t compressedAt = profileClock();
+        stream->ticks[STAGE_COMPRESS] += compressedAt - start;
+
+        size_t produced = sizeof(compressed) - compressor->avail_out;
+        if (produced && sendFully(stream->socket, compressed, produced) < 0)
+            return -1;
+        stream->ticks[STAGE_SEND] += profileClock() - compressedAt;
+    } while (compressor->avail_out == 0);
+
+    return 0;
+}
+
+/* Send the buffered bytes as they are */
+static int sendBatch(struct ResultStream *stream)
+{
+    uint64_t start = profileClock();
+    int result = sendFully(stream->socket, stream->buffer, stream->length);
+
+    stream->ticks[STAGE_SEND] += profileClock() - start;
+    return result;
+}
+
+/* Send the buffered lines as one batch. With compression, sync makes the
+ * batch decodable right away instead of when deflate next emits output. */
+static int flushResultStream(struct ResultStream *stream, int sync)
+{
+    if (stream->failed)
+        return -1;
+    if (stream->length && (stream->compressor ? sendCompressed(stream, sync) : sendBatch(stream)) < 0)
+    {
+        perror("send() failed");
+        stream->failed = 1;
+        return -1;
+    }
+    stream->length = 0;
+    return 0;
+}
+
+/* Flush if the oldest buffered line has waited outputMaxDelay; called
+ * between lines and periodically while a search finds nothing */
+static int tickResultStream(struct ResultStream *stream)
+{
+    if (stream->length && millisSince(&stream->oldest) >= outputMaxDelay)
+        return flushResultStream(stream, 1);
+    return stream->failed ? -1 : 0;
+}
+
+/* Buffer bytes for the client, sending a batch once it is full. Each batch
+ * may be twice the size of the one before, so the first bytes leave early
+ * and large results still go out in large sends. */
+static int writeResultStream(struct ResultStream *stream, const char *data, size_t length)
+{
+    if (stream->length + length > sizeof(stream->buffer) && flushResultStream(stream, 0) < 0)
+        return -1;
+    if (stream->failed)
+        return -1;
+
+    if (stream->length == 0)
+        clock_gettime(CLOCK_MONOTONIC, &stream->oldest);
+    memcpy(stream->buffer + stream->length, data, length);
+    stream->length += length;
+
+    if (stream->length >= stream->batchLimit)
+    {
+        /* Only the first batch is worth a sync flush for its latency */
+        int firstBatch = stream->batchLimit == OUTPUT_FIRST_BATCH;
+
+        if (stream->batchLimit < sizeof(stream->buffer))
+            stream->batchLimit *= 2;
+        return flushResultStream(stream, firstBatch);
+    }
+    return tickResultStream(stream);
+}
+
+/* End a result with its blank line and send what is buffered. After a
+ * failed send the connection, and any deflate stream on it, is broken,
+ * so nothing more is written to it. */
+static int finishResults(struct ResultStream *stream)
+{
+    if (stream->failed)
+        return -1;
+    return writeResultStream(stream, "\n", 1) < 0 || flushResultStream(stream, 1) < 0 ? -1 : 0;
+}
+
+/* Format the result line of a record into buffer, which holds
+ * MAX_RESULT_LINE bytes: "{name} said {msg}" for two fields, with any
+ * further fields following in braces */
+static int formatRecord(char *buffer, size_t index, const char *record)
+{
+    if (schema.fieldCount == 2)
+        return sprintf(buffer, "%4d: {%s} said {%s}\n", (int)(index + 1), recordField(record, 0), recordField(record, 1));
+
+    int length = sprintf(buffer, "%4d: {%s}", (int)(index + 1), recordField(record, 0));
+    for (int f = 1; f < schema.fieldCount; f++)
+        length += sprintf(buffer + length, f == 1 ? " said {%s}" : " {%s}", recordField(record, f));
+    buffer[length++] = '\n';
+    buffer[length] = '\0';
+    return length;
+}
+
+/* Format one result line and queue it for the client */
+static int sendRecord(struct ResultStream *stream, size_t index, const char *record)
+{
+    char resultBuffer[MAX_RESULT_LINE];
+    int resultLength;
+
+    /* Timing every line would cost as much as formatting a short one */
+    if (stream->formatted++ % FORMAT_SAMPLE_INTERVAL == 0)
+    {
+        uint64_t start = profileClock();
+        resultLength = formatRecord(resultBuffer, index, record);
+        stream->ticks[STAGE_FORMAT] += (profileClock() - start) * FORMAT_SAMPLE_INTERVAL;
+    }
+    else
+        resultLength = formatRecord(resultBuffer, index, record);
+    return writeResultStream(stream, resultBuffer, resultLength);
+}
+
+/* Write the whole buffer to a file, resuming after partial writes */
+static int writeFully(int fileDescriptor, const char *buffer, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t written = write(fileDescriptor, buffer, length);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buffer += written;
+        length -= written;
+    }
+    return 0;
+}
+
+/* Render the result line of every loaded record into dumpRender, unless
+ * it already holds this generation's. Returns -1 if it cannot be built,
+ * and the caller scans instead. */
+static int renderDump(struct ResultStream *stream)
+{
+    if (dumpRender.fd >= 0 && dumpRender.generation == databaseGeneration)
+        return 0;
+    releaseDump();
+
+    int fileDescriptor = memfd_create("mdb-dump", MFD_CLOEXEC);
+    if (fileDescriptor < 0)
+    {
+        perror("memfd_create() failed");
+        return -1;
+    }
+
+    char buffer[OUTPUT_MAX_BATCH];
+    size_t buffered = 0, length = 0;
+    const unsigned char *lengths;
+    uint64_t start = profileClock();
+
+    for (size_t i = 0; i < recordCount; i++)
+    {
+        buffered += formatRecord(buffer + buffered, i, fetchRecord(i, &lengths));
+        if (buffered > sizeof(buffer) - MAX_RESULT_LINE || i + 1 == recordCount)
+        {
+            if (writeFully(fileDescriptor, buffer, buffered) < 0)
+            {
+                perror("Failed to render the dump");
+                close(fileDescriptor);
+                return -1;
+            }
+            length += buffered;
+            buffered = 0;
+        }
+    }
+
+    char *text = NULL;
+    if (length && (text = mmap(NULL, length, PROT_READ, MAP_SHARED, fileDescriptor, 0)) == MAP_FAILED)
+    {
+        perror("mmap() failed");
+        close(fileDescriptor);
+        return -1;
+    }
+    stream->ticks[STAGE_FORMAT] += profileClock() - start;
+
+    dumpRender.fd = fileDescriptor;
+    dumpRender.text = text;
+    dumpRender.length = length;
+    dumpRender.generation = databaseGeneration;
+    memoryUsage.dump = length;
+    fprintf(stderr, "Rendered %zu records for full dumps (%zu bytes)\n", recordCount, length);
+    return 0;
+}
+
+/* Send the rendered dump: straight from the memfd to the socket, or
+ * through the stream when it has to be compressed */
+static int sendDump(struct ResultStream *stream)
+{
+    if (stream->socket < 0)
+        return 0;
+    if (stream->compressor)
+    {
+        for (size_t offset = 0; offset < dumpRender.length; offset += sizeof(stream->buffer))
+        {
+            size_t chunk = dumpRender.length - offset < sizeof(stream->buffer) ? dumpRender.length - offset : sizeof(stream->buffer);
+            if (writeResultStream(stream, dumpRender.text + offset, chunk) < 0)
+                return -1;
+        }
+        return 0;
+    }
+
+    uint64_t start = profileClock();
+    off_t offset = 0;
+    while ((size_t)offset < dumpRender.length)
+    {
+        ssize_t sent = sendfile(stream->socket, dumpRender.fd, &offset, dumpRender.length - offset);
+        if (sent <= 0)
+        {
+            if (sent < 0 && errno == EINTR)
+                continue;
+            perror("sendfile() failed");
+            stream->failed = 1;
+            break;
+        }
+    }
+    stream->ticks[STAGE_SEND] += profileClock() - start;
+    return stream->failed ? -1 : 0;
+}
+
+/* Compare sorted-prefix entries by prefix, then by record */
+static int comparePrefixEntries(const void *left, const void *right)
+{
+    const struct PrefixEntry *a = (const struct PrefixEntry *)left;
+    const struct PrefixEntry *b = (const struct PrefixEntry *)right;
+    int order = memcmp(a->prefix, b->prefix, MAX_KEY_LENGTH);
+
+    if (order)
+        return order;
+    return a->record < b->record ? -1 : a->record > b->record;
+}
+
+/* Add an entry for every position of a field to the sorted-prefix index */
+static size_t addPrefixEntries(struct PrefixEntry *entries, const char *field, size_t fieldLength, uint32_t record)
+{
+    for (size_t start = 0; start < fieldLength; start++)
+    {
+        size_t length = fieldLength - start < MAX_KEY_LENGTH ? fieldLength - start : MAX_KEY_LENGTH;
+
+        memset(entries[start].prefix, 0, MAX_KEY_LENGTH);
+        memcpy(entries[start].prefix, field + start, length);
+        entries[start].record = record;
+    }
+    return fieldLength;
+}
+
+/* Bucket of the n-gram starting at bytes */
+static uint32_t ngramBucket(const char *bytes)
+{
+    const unsigned char *b = (const unsigned char *)bytes;
+    return ((b[0] * 0x9e3779b1U) ^ (b[1] * 0x85ebca6bU) ^ (b[2] * 0xc2b2ae35U)) >> (32 - NGRAM_BUCKET_BITS);
+}
+
+/* Count (pass 0) or fill in (pass 1) the postings of one field. lastRecord
+ * makes each record appear at most once per bucket. */
+static void addNgramPostings(const char *field, size_t fieldLength, uint32_t record, uint32_t *lastRecord, int pass, uint32_t *fill)
+{
+    for (size_t start = 0; start + NGRAM_LENGTH <= fieldLength; start++)
+    {
+        uint32_t bucket = ngramBucket(field + start);
+
+        if (lastRecord[bucket] == record + 1)
+            continue;
+        lastRecord[bucket] = record + 1;
+        if (pass == 0)
+            ngramIndex.offsets[bucket + 1]++;
+        else
+            ngramIndex.postings[fill[bucket]++] = record;
+    }
+}
+
+/* Leaves are told apart from inner nodes by the low pointer bit */
+static int artIsLeaf(const void *node)
+{
+    return ((uintptr_t)node & 1) != 0;
+}
+
+static struct ArtLeaf *artLeaf(const void *node)
+{
+    return (struct ArtLeaf *)((uintptr_t)node & ~(uintptr_t)1);
+}
+
+/* Bytes of a node of the type, in whole cache lines */
+static size_t artNodeSize(enum ArtNodeType type)
+{
+    static const size_t sizes[] = { sizeof(struct ArtNode4), sizeof(struct ArtNode16), sizeof(struct ArtNode48), sizeof(struct ArtNode256) };
+    return (sizes[type] + ART_NODE_ALIGN - 1) / ART_NODE_ALIGN * ART_NODE_ALIGN;
+}
+
+static struct ArtNode *artNewNode(enum ArtNodeType type)
+{
+    struct ArtNode *node = (struct ArtNode *)aligned_alloc(ART_NODE_ALIGN, artNodeSize(type));
+
+    if (!node)
+        terminate("Memory allocation failed");
+    memset(node, 0, artNodeSize(type));
+    node->type = type;
+    artIndex.nodes++;
+    artIndex.bytes += artNodeSize(type);
+    return node;
+}
+
+/* Free a node outgrown by a larger one */
+static void artFreeNode(struct ArtNode *node)
+{
+    artIndex.nodes--;
+    artIndex.bytes -= artNodeSize(node->type);
+    free(node);
+}
+
+static void artAddLeafRecord(struct ArtLeaf *leaf, uint32_t record)
+{
+    if (leaf->count == leaf->capacity)
+    {
+        uint32_t capacity = leaf->capacity ? leaf->capacity * 2 : 1;
+        if ((leaf->records = (uint32_t *)realloc(leaf->records, capacity * sizeof(uint32_t))) == NULL)
+            terminate("Memory allocation failed");
+        artIndex.bytes += (capacity - leaf->capacity) * sizeof(uint32_t);
+        leaf->capacity = capacity;
+    }
+    leaf->records[leaf->count++] = record;
+}
+
+static void *artNewLeaf(const unsigned char *key, size_t keyLength, uint32_t record)
+{
+    struct ArtLeaf *leaf = (struct ArtLeaf *)calloc(1, sizeof(struct ArtLeaf) + keyLength);
+
+    if (!leaf)
+        terminate("Memory allocation failed");
+    memcpy(leaf->key, key, keyLength);
+    leaf->keyLength = keyLength;
+    artAddLeafRecord(leaf, record);
+    artIndex.leaves++;
+    artIndex.bytes += sizeof(struct ArtLeaf) + keyLength;
+    return (void *)((uintptr_t)leaf | 1);
+}
+
+/* Slot of the child for byte c, or NULL */
+static void **artFindChild(struct ArtNode *node, unsigned char c)
+{
+    switch (node->type)
+    {
+    case ART_NODE4:
+    {
+        struct ArtNode4 *node4 = (struct ArtNode4 *)node;
+        for (int i = 0; i < node->count; i++)
+            if (node4->keys[i] == c)
+                return &node4->children[i];
+        return NULL;
+    }
+    case ART_NODE16:
+    {
+        struct ArtNode16 *node16 = (struct ArtNode16 *)node;
+#ifdef __SSE2__
+        __m128i equal = _mm_cmpeq_epi8(_mm_set1_epi8((char)c), _mm_loadu_si128((const __m128i *)node16->keys));
+        unsigned mask = _mm_movemask_epi8(equal) & ((1u << node->count) - 1);
+        return mask ? &node16->children[__builtin_ctz(mask)] : NULL;
+#else
+        for (int i = 0; i < node->count; i++)
+            if (node16->keys[i] == c)
+                return &node16->children[i];
+        return NULL;
+#endif
+    }
+    case ART_NODE48:
+    {
+        struct ArtNode48 *node48 = (struct ArtNode48 *)node;
+        return node48->slots[c] ? &node48->children[node48->slots[c] - 1] : NULL;
+    }
+    default:
+    {
+        struct ArtNode256 *node256 = (struct ArtNode256 *)node;
+        return node256->children[c] ? &node256->children[c] : NULL;
+    }
+    }
+}
+
+/* Leaf with the smallest key below node, to recover path bytes that did
+ * not fit in a node's prefix */
+static struct ArtLeaf *artMinimumLeaf(const void *node)
+{
+    while (!artIsLeaf(node))
+    {
+        const struct ArtNode *inner = (const struct ArtNode *)node;
+
+        switch (inner->type)
+        {
+        case ART_NODE4:
+            node = ((const struct ArtNode4 *)inner)->children[0];
+            break;
+        case ART_NODE16:
+            node = ((const struct ArtNode16 *)inner)->children[0];
+            break;
+        case ART_NODE48:
+        {
+            const struct ArtNode48 *node48 = (const struct ArtNode48 *)inner;
+            int c = 0;
+            while (!node48->slots[c])
+                c++;
+            node = node48->children[node48->slots[c] - 1];
+            break;
+        }
+        default:
+        {
+            const struct ArtNode256 *node256 = (const struct ArtNode256 *)inner;
+            int c = 0;
+            while (!node256->children[c])
+                c++;
+            node = node256->children[c];
+            break;
+        }
+        }
+    }
+    return artLeaf(node);
+}
+
+/* How many bytes of the node's compressed path match the key from depth */
+static size_t artPrefixMatch(const struct ArtNode *node, const unsigned char *key, size_t keyLength, size_t depth)
+{
+    size_t limit = node->prefixLength < keyLength - depth ? node->prefixLength : keyLength - depth;
+    size_t matched = 0;
+
+    while (matched < limit && matched < ART_MAX_PREFIX && node->prefix[matched] == key[depth + matched])
+        matched++;
+    if (matched == ART_MAX_PREFIX && matched < limit)
+    {
+        const struct ArtLeaf *leaf = artMinimumLeaf(node);
+        while (matched < limit && leaf->key[depth + matched] == key[depth + matched])
+            matched++;
+    }
+    return matched;
+}
+
+/* Add a child for byte c, growing the node into the next size if full */
+static void artAddChild(struct ArtNode *node, void **slot, unsigned char c, void *child)
+{
+    switch (node->type)
+    {
+    case ART_NODE4:
+    case ART_NODE16:
+    {
+        int capacity = node->type == ART_NODE4 ? 4 : 16;
+        unsigned char *keys = node->type == ART_NODE4 ? ((struct ArtNode4 *)node)->keys : ((struct ArtNode16 *)node)->keys;
+        void **children = node->type == ART_NODE4 ? ((struct ArtNode4 *)node)->children : ((struct ArtNode16 *)node)->children;
+
+        if (node->count < capacity)
+        {
+            int position = 0;
+            while (position < node->count && keys[position] < c)
+                position++;
+            memmove(keys + position + 1, keys + position, node->count - position);
+            memmove(children + position + 1, children + position, (node->count - position) * sizeof(void *));
+            keys[position] = c;
+            children[position] = child;
+            node->count++;
+            return;
+        }
+
+        enum ArtNodeType grownType = node->type == ART_NODE4 ? ART_NODE16 : ART_NODE48;
+        struct ArtNode *grown = artNewNode(grownType);
+        memcpy(grown, node, sizeof(struct ArtNode));
+        grown->type = grownType;
+        if (grown->type == ART_NODE16)
+        {
+            memcpy(((struct ArtNode16 *)grown)->keys, keys, capacity);
+            memcpy(((struct ArtNode16 *)grown)->children, children, capacity * sizeof(void *));
+        }
+        else
+        {
+            for (int i = 0; i < capacity; i++)
+            {
+                ((struct ArtNode48 *)grown)->slots[keys[i]] = i + 1;
+                ((struct ArtNode48 *)grown)->children[i] = children[i];
+            }
+        }
+        artFreeNode(node);
+        *slot = grown;
+        artAddChild(grown, slot, c, child);
+        return;
+    }
+    case ART_NODE48:
+    {
+        struct ArtNode48 *node48 = (struct ArtNode48 *)node;
+
+        if (node->count < 48)
+        {
+            node48->children[node->count] = child;
+            node48->slots[c] = ++node->count;
+            return;
+        }
+
+        struct ArtNode256 *grown = (struct ArtNode256 *)artNewNode(ART_NODE256);
+        memcpy(&grown->header, node, sizeof(struct ArtNode));
+        grown->header.type = ART_NODE256;
+        for (int i = 0; i < 256; i++)
+            if (node48->slots[i])
+                grown->children[i] = node48->children[node48->slots[i] - 1];
+        artFreeNode(node);
+        *slot = grown;
+        artAddChild(&grown->header, slot, c, child);
+        return;
+    }
+    default:
+        ((struct ArtNode256 *)node)->children[c] = child;
+        node->count++;
+        return;
+    }
+}
+
+/* Insert record under key in the subtree at *slot, whose first depth bytes
+ * are already matched */
+static void artInsert(void **slot, const unsigned char *key, size_t keyLength, size_t depth, uint32_t record)
+{
+    for (;;)
+    {
+        void *node = *slot;
+
+        if (!node)
+        {
+            *slot = artNewLeaf(key, keyLength, record);
+            return;
+        }
+
+        /* A leaf with another key becomes a node over both */
+        if (artIsLeaf(node))
+        {
+            struct ArtLeaf *leaf = artLeaf(node);
+            if (leaf->keyLength == keyLength && memcmp(leaf->key, key, keyLength) == 0)
+            {
+                artAddLeafRecord(leaf, record);
+                return;
+            }
+
+            size_t common = 0;
+            while (leaf->key[depth + common] == key[depth + common])
+                common++;
+
+            struct ArtNode *split = artNewNode(ART_NODE4);
+            split->prefixLength = common;
+            memcpy(split->prefix, key + depth, common < ART_MAX_PREFIX ? common : ART_MAX_PREFIX);
+            *slot = split;
+            artAddChild(split, slot, leaf->key[depth + common], node);
+            artAddChild(split, slot, key[depth + common], artNewLeaf(key, keyLength, record));
+            return;
+        }
+
+        /* A key leaving the compressed path splits it */
+        struct ArtNode *inner = (struct ArtNode *)node;
+        if (inner->prefixLength)
+        {
+            size_t matched = artPrefixMatch(inner, key, keyLength, depth);
+            if (matched < inner->prefixLength)
+            {
+                struct ArtNode *split = artNewNode(ART_NODE4);
+                unsigned char innerByte;
+
+                split->prefixLength = matched;
+                memcpy(split->prefix, inner->prefix, matched < ART_MAX_PREFIX ? matched : ART_MAX_PREFIX);
+                if (inner->prefixLength <= ART_MAX_PREFIX)
+                {
+                    innerByte = inner->prefix[matched];
+                    inner->prefixLength -= matched + 1;
+                    memmove(inner->prefix, inner->prefix + matched + 1, inner->prefixLength);
+                }
+                else
+                {
+                    const struct ArtLeaf *leaf = artMinimumLeaf(inner);
+                    innerByte = leaf->key[depth + matched];
+                    inner->prefixLength -= matched + 1;
+                    memcpy(inner->prefix, leaf->key + depth + matched + 1,
+                           inner->prefixLength < ART_MAX_PREFIX ? inner->prefixLength : ART_MAX_PREFIX);
+                }
+                *slot = split;
+                artAddChild(split, slot, innerByte, inner);
+                artAddChild(split, slot, key[depth + matched], artNewLeaf(key, keyLength, record));
+                return;
+            }
+            depth += inner->prefixLength;
+        }
+
+        void **child = artFindChild(inner, key[depth]);
+        if (!child)
+        {
+            artAddChild(inner, slot, key[depth], artNewLeaf(key, keyLength, record));
+            return;
+        }
+        slot = child;
+        depth++;
+    }
+}
+
+/* Records whose name is exactly name, or NULL */
+static const struct ArtLeaf *artFind(const char *name, size_t nameLength)
+{
+    const unsigned char *key = (const unsigned char *)name;
+    size_t keyLength = nameLength + 1;   /* With the NUL */
+    size_t depth = 0;
+    void *node = artIndex.root;
+
+    while (node && !artIsLeaf(node))
+    {
+        struct ArtNode *inner = (struct ArtNode *)node;
+
+        if (inner->prefixLength)
+        {
+            if (artPrefixMatch(inner, key, keyLength, depth) < inner->prefixLength)
+                return NULL;
+            depth += inner->prefixLength;
+        }
+        if (depth >= keyLength)
+            return NULL;
+        void **child = artFindChild(inner, key[depth++]);
+        node = child ? *child : NULL;
+    }
+    if (node && artLeaf(node)->keyLength == keyLength && memcmp(artLeaf(node)->key, key, keyLength) == 0)
+        return artLeaf(node);
+    return NULL;
+}
+
+/* Append the records of every leaf below node */
+static void artCollect(const void *node, uint32_t **matches, size_t *count, size_t *capacity)
+{
+    if (artIsLeaf(node))
+    {
+        const struct ArtLeaf *leaf = artLeaf(node);
+
+        if (*count + leaf->count > *capacity)
+        {
+            *capacity = (*count + leaf->count) * 2;
+            if ((*matches = (uint32_t *)realloc(*matches, *capacity * sizeof(uint32_t))) == NULL)
+                terminate("Memory allocation failed");
+        }
+        memcpy(*matches + *count, leaf->records, leaf->count * sizeof(uint32_t));
+        *count += leaf->count;
+        return;
+    }
+
+    const struct ArtNode *inner = (const struct ArtNode *)node;
+    switch (inner->type)
+    {
+    case ART_NODE4:
+        for (int i = 0; i < inner->count; i++)
+            artCollect(((const struct ArtNode4 *)inner)->children[i], matches, count, capacity);
+        break;
+    case ART_NODE16:
+        for (int i = 0; i < inner->count; i++)
+            artCollect(((const struct ArtNode16 *)inner)->children[i], matches, count, capacity);
+        break;
+    case ART_NODE48:
+        for (int i = 0; i < inner->count; i++)
+            artCollect(((const struct ArtNode48 *)inner)->children[i], matches, count, capacity);
+        break;
+    default:
+        for (int c = 0; c < 256; c++)
+            if (((const struct ArtNode256 *)inner)->children[c])
+                artCollect(((const struct ArtNode256 *)inner)->children[c], matches, count, capacity);
+        break;
+    }
+}
+
+/* Records whose name starts with prefix, in no particular order. Returns
+ * the count; *matches is allocated for the caller to free. */
+static size_t artFindPrefix(const char *prefix, size_t prefixLength, uint32_t **matches)
+{
+    const unsigned char *key = (const unsigned char *)prefix;
+    size_t depth = 0, count = 0, capacity = 0;
+    void *node = artIndex.root;
+
+    *matches = NULL;
+    while (node)
+    {
+        if (artIsLeaf(node))
+        {
+            const struct ArtLeaf *leaf = artLeaf(node);
+            if (leaf->keyLength > prefixLength && memcmp(leaf->key, key, prefixLength) == 0)
+                artCollect(node, matches, &count, &capacity);
+            break;
+        }
+
+        /* Once the prefix runs out, everything below matches */
+        struct ArtNode *inner = (struct ArtNode *)node;
+        if (inner->prefixLength)
+        {
+            size_t limit = prefixLength - depth < inner->prefixLength ? prefixLength - depth : inner->prefixLength;
+            if (artPrefixMatch(inner, key, prefixLength, depth) < limit)
+                break;
+            depth += inner->prefixLength;
+        }
+        if (depth >= prefixLength)
+        {
+            artCollect(node, matches, &count, &capacity);
+            break;
+        }
+        void **child = artFindChild(inner, key[depth++]);
+        node = child ? *child : NULL;
+    }
+    return count;
+}
+
+/* Insert the names of records first onwards into the tree */
+static void artInsertRecords(size_t first)
+{
+    const unsigned char *lengths;
+
+    for (size_t i = first; i < recordCount; i++)
+    {
+        const char *record = fetchRecord(i, &lengths);
+        artInsert(&artIndex.root, (const unsigned char *)recordField(record, 0), lengths[0] + 1, 0, i);
+    }
+}
+
+static void artFree(void *node)
+{
+    if (!node)
+        return;
+    if (artIsLeaf(node))
+    {
+        free(artLeaf(node)->records);
+        free(artLeaf(node));
+        return;
+    }
+
+    struct ArtNode *inner = (struct ArtNode *)node;
+    switch (inner->type)
+    {
+    case ART_NODE4:
+        for (int i = 0; i < inner->count; i++)
+            artFree(((struct ArtNode4 *)inner)->children[i]);
+        break;
+    case ART_NODE16:
+        for (int i = 0; i < inner->count; i++)
+            artFree(((struct ArtNode16 *)inner)->children[i]);
+        break;
+    case ART_NODE48:
+        for (int i = 0; i < inner->count; i++)
+            artFree(((struct ArtNode48 *)inner)->children[i]);
+        break;
+    default:
+        for (int c = 0; c < 256; c++)
+            artFree(((struct ArtNode256 *)inner)->children[c]);
+        break;
+    }
+    free(inner);
+}
+
+/* Release the indexes of the previous load */
+static void freeIndexes(void)
+{
+    free(prefixIndex.entries);
+    free(ngramIndex.offsets);
+    free(ngramIndex.postings);
+    artFree(artIndex.root);
+    mdbMphClose(&exactIndex);
+    memset(&prefixIndex, 0, sizeof(prefixIndex));
+    memset(&ngramIndex, 0, sizeof(ngramIndex));
+    memset(&artIndex, 0, sizeof(artIndex));
+}
+
+/* Was the mapped side file built from the loaded database, or from an
+ * earlier version of it that records were only appended to? Its size and
+ * modification time must allow that, and its first and last records must
+ * still be the same bytes. */
+static int exactIndexMatches(void)
+{
+    const struct MdbMphHeader *header = exactIndex.header;
+    uint64_t checksum;
+
+    if (header->recordCount > recordCount || (uint64_t)loadedSize < header->databaseSize ||
+        ((uint64_t)loadedSize == header->databaseSize && loadedMtime != header->databaseMtime))
+        return 0;
+
+    int fileDescriptor = open(watchedFile, O_RDONLY);
+    if (fileDescriptor < 0)
+        return 0;
+    int result = mdbMphSampleChecksum(fileDescriptor, schema.recordSize, header->recordCount, &checksum) == 0 &&
+                 checksum == header->sampleChecksum;
+    close(fileDescriptor);
+    return result;
+}
+
+/* Build the indexes selected with -i over the freshly loaded records */
+static void buildIndexes(void)
+{
+    const unsigned char *lengths;
+    const char *record;
+
+    freeIndexes();
+
+    if (buildPrefixIndex)
+    {
+        /* One entry per byte position of each field */
+        size_t entryCount = 0;
+        for (size_t i = 0; i < recordCount; i++)
+        {
+            fetchRecord(i, &lengths);
+            for (int f = 0; f < schema.fieldCount; f++)
+                entryCount += lengths[f];
+        }
+
+        prefixIndex.entries = (struct PrefixEntry *)malloc((entryCount + 1) * sizeof(struct PrefixEntry));
+        if (!prefixIndex.entries)
+            terminate("Memory allocation failed");
+
+        for (size_t i = 0; i < recordCount; i++)
+        {
+            record = fetchRecord(i, &lengths);
+            for (int f = 0; f < schema.fieldCount; f++)
+                prefixIndex.count += addPrefixEntries(prefixIndex.entries + prefixIndex.count, recordField(record, f), lengths[f], i);
+        }
+        qsort(prefixIndex.entries, prefixIndex.count, sizeof(struct PrefixEntry), comparePrefixEntries);
+        fprintf(stderr, "Sorted-prefix index: %zu entries\n", prefixIndex.count);
+    }
+
+    if (buildNgramIndex)
+    {
+        size_t bucketCount = (size_t)1 << NGRAM_BUCKET_BITS;
+        uint32_t *lastRecord = (uint32_t *)calloc(bucketCount, sizeof(uint32_t));
+        uint32_t *fill = (uint32_t *)malloc(bucketCount * sizeof(uint32_t));
+        ngramIndex.offsets = (uint32_t *)calloc(bucketCount + 1, sizeof(uint32_t));
+        if (!lastRecord || !fill || !ngramIndex.offsets)
+            terminate("Memory allocation failed");
+
+        /* Two passes: count the postings of each bucket, then fill them in */
+        for (int pass = 0; pass < 2; pass++)
+        {
+            memset(lastRecord, 0, bucketCount * sizeof(uint32_t));
+            for (size_t i = 0; i < recordCount; i++)
+            {
+                record = fetchRecord(i, &lengths);
+                for (int f = 0; f < schema.fieldCount; f++)
+                    addNgramPostings(recordField(record, f), lengths[f], i, lastRecord, pass, fill);
+            }
+
+            if (pass == 0)
+            {
+                for (size_t bucket = 0; bucket < bucketCount; bucket++)
+                    ngramIndex.offsets[bucket + 1] += ngramIndex.offsets[bucket];
+                memcpy(fill, ngramIndex.offsets, bucketCount * sizeof(uint32_t));
+                ngramIndex.postings = (uint32_t *)malloc((ngramIndex.offsets[bucketCount] + 1) * sizeof(uint32_t));
+                if (!ngramIndex.postings)
+                    terminate("Memory allocation failed");
+            }
+        }
+        free(lastRecord);
+        free(fill);
+        fprintf(stderr, "N-gram index: %u postings\n", ngramIndex.offsets[bucketCount]);
+    }
+
+    if (buildArtIndex)
+    {
+        artInsertRecords(0);
+        fprintf(stderr, "ART index: %zu names, %zu nodes, %zu bytes\n", artIndex.leaves, artIndex.nodes, artIndex.bytes);
+    }
+
+    /* The side file may have been rebuilt along with the database */
+    if (exactIndexFile)
+    {
+        if (mdbMphOpen(&exactIndex, exactIndexFile) < 0)
+            perror("Failed to map the exact-name side file");
+        else if (!exactIndexMatches())
+        {
+            fprintf(stderr, "Exact-name side file was built from another version of the database, not using it\n");
+            mdbMphClose(&exactIndex);
+        }
+        else
+            fprintf(stderr, "Exact-name side file: %lu names over %lu records\n",
+                    (unsigned long)exactIndex.header->keyCount, (unsigned long)exactIndex.header->recordCount);
+    }
+}
+
+/* Publish the sizes of the freshly loaded or extended store and indexes
+ * for formatProfile() */
+static void publishMemoryUsage(void)
+{
+    memoryUsage.records = records ? recordCount * schema.recordSize : 0;
+    memoryUsage.mapped = mappedLength != 0;
+    memoryUsage.fieldLengths = fieldLengths ? recordCount * schema.fieldCount : 0;
+    memoryUsage.folded = foldedRecords ? recordCount * schema.recordSize : 0;
+    memoryUsage.compressed = compressedRanges ? compressedBytes : 0;
+    memoryUsage.prefixIndex = prefixIndex.count * sizeof(struct PrefixEntry);
+    memoryUsage.ngramIndex = ngramIndex.offsets ? (((size_t)1 << NGRAM_BUCKET_BITS) + 1 + ngramIndex.offsets[(size_t)1 << NGRAM_BUCKET_BITS]) * sizeof(uint32_t) : 0;
+    memoryUsage.artIndex = artIndex.bytes;
+    memoryUsage.mph = exactIndex.mappedLength;
+}
+
+/* Entries of the sorted-prefix index whose prefix starts with the key */
+static void findPrefixRange(const char *searchKey, size_t keyLength, size_t *first, size_t *last)
+{
+    size_t low = 0, high = prefixIndex.count;
+
+    /* Lower bound: first entry not less than the key */
+    while (low < high)
+    {
+        size_t middle = low + (high - low) / 2;
+        if (memcmp(prefixIndex.entries[middle].prefix, searchKey, keyLength) < 0)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    *first = low;
+
+    /* Upper bound: first entry greater than the key */
+    high = prefixIndex.count;
+    while (low < high)
+    {
+        size_t middle = low + (high - low) / 2;
+        if (memcmp(prefixIndex.entries[middle].prefix, searchKey, keyLength) <= 0)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    *last = low;
+}
+
+/* Choose the cheapest access path for the key from its length and the
+ * selectivity the indexes report for it */
+static void planQuery(const char *searchKey, size_t keyLength, struct QueryPlan *plan)
+{
+    memset(plan, 0, sizeof(*plan));
+    plan->strategy = PLAN_SCAN;
+    plan->scanCost = recordCount * SCAN_COST;
+
+    /* Exact number of matching positions: two binary searches */
+    if (prefixIndex.entries && keyLength > 0)
+    {
+        findPrefixRange(searchKey, keyLength, &plan->prefixFirst, &plan->prefixLast);
+        plan->prefixCost = (plan->prefixLast - plan->prefixFirst) * PREFIX_COST;
+        if (plan->prefixCost < plan->scanCost)
+            plan->strategy = PLAN_PREFIX;
+    }
+
+    /* Candidates: the shortest posting list among the key's n-grams */
+    if (ngramIndex.offsets && keyLength >= NGRAM_LENGTH)
+    {
+        plan->ngramCandidates = SIZE_MAX;
+        for (size_t start = 0; start + NGRAM_LENGTH <= keyLength; start++)
+        {
+            uint32_t bucket = ngramBucket(searchKey + start);
+            size_t candidates = ngramIndex.offsets[bucket + 1] - ngramIndex.offsets[bucket];
+            if (candidates < plan->ngramCandidates)
+            {
+                plan->ngramCandidates = candidates;
+                plan->ngramBucket = bucket;
+            }
+        }
+        plan->ngramCost = plan->ngramCandidates * NGRAM_COST;
+        if (plan->ngramCost < (plan->strategy == PLAN_PREFIX ? plan->prefixCost : plan->scanCost))
+            plan->strategy = PLAN_NGRAM;
+    }
+}
+
+/* Describe the plan and the alternatives it was chosen over */
+static void explainPlan(const struct QueryPlan *plan, size_t keyLength, char *buffer, size_t size)
+{
+    static const char *strategyNames[] = { "scan", "prefix", "ngram" };
+    int length = snprintf(buffer, size, "plan=%s cost: scan=%zu", strategyNames[plan->strategy], plan->scanCost);
+
+    if (!prefixIndex.entries)
+        length += snprintf(buffer + length, size - length, " prefix=none");
+    else if (keyLength == 0)
+        length += snprintf(buffer + length, size - length, " prefix=n/a(empty key)");
+    else
+        length += snprintf(buffer + length, size - length, " prefix=%zu(%zu positions)",
+                           plan->prefixCost, plan->prefixLast - plan->prefixFirst);
+
+    if (!ngramIndex.offsets)
+        snprintf(buffer + length, size - length, " ngram=none");
+    else if (keyLength < NGRAM_LENGTH)
+        snprintf(buffer + length, size - length, " ngram=n/a(key shorter than %d)", NGRAM_LENGTH);
+    else
+        snprintf(buffer + length, size - length, " ngram=%zu(%zu candidates)", plan->ngramCost, plan->ngramCandidates);
+}
+
+/* Scan every record in file order. With folded set, the key is matched
+ * against the case-folded copy and the original records are sent. */
+static int scanRecords(struct ResultStream *stream, const char *searchKey, size_t keyLength, int folded)
+{
+    /* A compressed store is scanned block by block, an array in stretches
+     * between checks of the output delay timer */
+    size_t blockSize = compressedRanges ? COMPRESSED_BLOCK_RECORDS : OUTPUT_TICK_RECORDS;
+    uint32_t hits[OUTPUT_TICK_RECORDS > COMPRESSED_BLOCK_RECORDS ? OUTPUT_TICK_RECORDS : COMPRESSED_BLOCK_RECORDS];
+
+    /* An empty key matches every record: send the rendered dump */
+    if (keyLength == 0 && renderDump(stream) == 0)
+        return sendDump(stream);
+
+    for (size_t first = 0; first < recordCount; first += blockSize)
+    {
+        if (tickResultStream(stream) < 0)
+            return -1;
+
+        size_t count = recordCount - first < blockSize ? recordCount - first : blockSize;
+        const char *block = records + first * schema.recordSize;
+        const unsigned char *lengths = fieldLengths ? fieldLengths + first * schema.fieldCount : NULL;
+
+        if (compressedRanges)
+        {
+            size_t packedLength;
+            const unsigned char *packed = packedBlock(first / COMPRESSED_BLOCK_RECORDS, &packedLength);
+
+            /* Field bytes stay contiguous when packed, so a block without the
+             * key anywhere in it has no matching record and stays packed */
+            if (keyLength && !memmem(packed, packedLength, searchKey, keyLength))
+                continue;
+            block = decodeBlock(first / COMPRESSED_BLOCK_RECORDS, &lengths);
+        }
+
+        size_t hitCount = findMatches(folded ? foldedRecords + first * schema.recordSize : block, lengths, count, searchKey, keyLength, hits);
+        for (size_t i = 0; i < hitCount; i++)
+            if (sendRecord(stream, first + hits[i], block + hits[i] * schema.recordSize) < 0)
+                return -1;
+    }
+    return 0;
+}
+
+/* Compare record numbers for qsort() */
+static int compareRecordNumbers(const void *left, const void *right)
+{
+    uint32_t a = *(const uint32_t *)left;
+    uint32_t b = *(const uint32_t *)right;
+    return a < b ? -1 : a > b;
+}
+
+/* Send the records of a sorted-prefix range, in file order and once each */
+static int sendPrefixMatches(struct ResultStream *stream, const struct QueryPlan *plan)
+{
+    size_t count = plan->prefixLast - plan->prefixFirst;
+    uint32_t *matches = (uint32_t *)malloc((count + 1) * sizeof(uint32_t));
+    const unsigned char *lengths;
+    int result = 0;
+
+    if (!matches)
+        terminate("Memory allocation failed");
+    for (size_t i = 0; i < count; i++)
+        matches[i] = prefixIndex.entries[plan->prefixFirst + i].record;
+    qsort(matches, count, sizeof(uint32_t), compareRecordNumbers);
+
+    for (size_t i = 0; i < count && result == 0; i++)
+        if (i == 0 || matches[i] != matches[i - 1])
+            result = sendRecord(stream, matches[i], fetchRecord(matches[i], &lengths));
+
+    free(matches);
+    return result;
+}
+
+/* Verify and send the candidates of the key's rarest n-gram */
+static int sendNgramMatches(struct ResultStream *stream, const struct QueryPlan *plan, const char *searchKey, size_t keyLength)
+{
+    const unsigned char *lengths;
+    MdbMatcher match = mdbSelectMatcher(keyLength);
+    size_t fieldOffsets[MDB_SCHEMA_MAX_FIELDS];
+
+    copyFieldOffsets(fieldOffsets);
+
+    /* Posting lists are in file order and hold each record once */
+    for (uint32_t i = ngramIndex.offsets[plan->ngramBucket]; i < ngramIndex.offsets[plan->ngramBucket + 1]; i++)
+    {
+        const char *record = fetchRecord(ngramIndex.postings[i], &lengths);
+        if (recordMatches(record, lengths, schema.fieldCount, fieldOffsets, match, searchKey, keyLength) &&
+            sendRecord(stream, ngramIndex.postings[i], record) < 0)
+            return -1;
+        if ((i & (OUTPUT_TICK_RECORDS - 1)) == 0 && tickResultStream(stream) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/* Add a finished query to the profile. Whatever the other stages don't
+ * account for went into the scan. */
+static void addToProfile(struct ResultStream *stream, uint64_t startTicks)
+{
+    uint64_t totalTicks = profileClock() - startTicks;
+    uint64_t otherTicks = 0;
+
+    for (int stage = STAGE_PARSE; stage < STAGE_COUNT; stage++)
+        otherTicks += stream->ticks[stage];
+    stream->ticks[STAGE_SCAN] = totalTicks > otherTicks ? totalTicks - otherTicks : 0;
+    for (int stage = STAGE_PARSE; stage < STAGE_COUNT; stage++)
+        atomic_fetch_add_explicit(&stageTicks[stage], stream->ticks[stage], memory_order_relaxed);
+    atomic_fetch_add_explicit(&profiledQueries, 1, memory_order_relaxed);
+}
+
+/* Recognise "#n" and "#first-last": record numbers as printed in results,
+ * counting from 1. Returns 1 for a range, -1 for one that cannot be valid
+ * (#0, last before first, or a number too large), and 0 for anything else,
+ * which is a search key. */
+static int parseRecordRange(const char *queryLine, size_t *first, size_t *last)
+{
+    char *end;
+    int overflow;
+
+    if (queryLine[0] != '#' || !isdigit((unsigned char)queryLine[1]))
+        return 0;
+    errno = 0;
+    *first = *last = strtoul(queryLine + 1, &end, 10);
+    overflow = errno == ERANGE;
+    if (*end == '-')
+    {
+        if (!isdigit((unsigned char)end[1]))
+            return 0;
+        *last = strtoul(end + 1, &end, 10);
+        overflow |= errno == ERANGE;
+    }
+    if (strcmp(end, "\n") != 0 && strcmp(end, "\r\n") != 0 && *end != '\0')
+        return 0;
+    return overflow || *first == 0 || *last < *first ? -1 : 1;
+}
+
+/* Send records first to last straight from the store, without a search,
+ * followed by a blank line. Numbers past the end are skipped. */
+static int sendRecordRange(int clientSocket, z_stream *compressor, size_t first, size_t last)
+{
+    struct ResultStream stream;
+    const unsigned char *lengths;
+    uint64_t startTicks = profileClock();
+
+    openResultStream(&stream, clientSocket, compressor);
+
+    if (last > recordCount)
+        last = recordCount;
+    for (size_t index = first - 1; index < last; index++)
+    {
+        if (sendRecord(&stream, index, fetchRecord(index, &lengths)) < 0)
+            break;
+        if ((index & (OUTPUT_TICK_RECORDS - 1)) == 0 && tickResultStream(&stream) < 0)
+            break;
+    }
+
+    int result = finishResults(&stream);
+    addToProfile(&stream, startTicks);
+    return result;
+}
+
+/* Compare the names of records first onwards and send the matching ones */
+static int sendNameMatches(struct ResultStream *stream, const char *name, size_t nameLength, int prefix, size_t first)
+{
+    const unsigned char *lengths;
+
+    for (size_t i = first; i < recordCount; i++)
+    {
+        const char *record = fetchRecord(i, &lengths);
+
+        if ((prefix ? lengths[0] >= nameLength : lengths[0] == nameLength) &&
+            memcmp(recordField(record, 0), name, nameLength) == 0 && sendRecord(stream, i, record) < 0)
+            return -1;
+        if ((i & (OUTPUT_TICK_RECORDS - 1)) == 0 && tickResultStream(stream) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/* Send the records whose name is name, or starts with it when prefix is
+ * set, in file order and followed by a blank line. An exact name is found
+ * through the side file (-e) or the ART (-i art), a prefix through the
+ * ART; otherwise every record's name is compared. */
+static int lookupName(int clientSocket, z_stream *compressor, const char *name, int prefix)
+{
+    struct ResultStream stream;
+    const unsigned char *lengths;
+    size_t nameLength = strlen(name);
+    uint64_t startTicks = profileClock();
+
+    openResultStream(&stream, clientSocket, compressor);
+
+    if (exactIndex.header && !prefix)
+    {
+        size_t count, checked = 0;
+        const uint32_t *matches = mdbMphFind(&exactIndex, name, nameLength, &count);
+        int result = 0;
+
+        /* A name that is not a key lands on some other name's records, so
+         * its first record differs. A list that differs further on does not
+         * describe these records; compare every name instead. */
+        for (; checked < count; checked++)
+        {
+            const char *record = fetchRecord(matches[checked], &lengths);
+            if (lengths[0] != nameLength || memcmp(recordField(record, 0), name, nameLength) != 0)
+                break;
+        }
+        if (checked > 0 && checked < count)
+        {
+            fprintf(stderr, "Exact-name side file lists other names for {%s}, comparing names\n", name);
+            sendNameMatches(&stream, name, nameLength, 0, 0);
+        }
+        else
+        {
+            for (size_t i = 0; i < checked && result == 0; i++)
+                result = sendRecord(&stream, matches[i], fetchRecord(matches[i], &lengths));
+
+            /* Records appended since the side file was built */
+            if (result == 0)
+                sendNameMatches(&stream, name, nameLength, 0, exactIndex.header->recordCount);
+        }
+    }
+    else if (artIndex.root && prefix)
+    {
+        uint32_t *matches;
+        size_t count = artFindPrefix(name, nameLength, &matches);
+
+        qsort(matches, count, sizeof(uint32_t), compareRecordNumbers);
+        for (size_t i = 0; i < count; i++)
+        {
+            if (sendRecord(&stream, matches[i], fetchRecord(matches[i], &lengths)) < 0)
+                break;
+            if ((i & (OUTPUT_TICK_RECORDS - 1)) == 0 && tickResultStream(&stream) < 0)
+                break;
+        }
+        free(matches);
+    }
+    else if (artIndex.root)
+    {
+        const struct ArtLeaf *leaf = artFind(name, nameLength);
+
+        for (uint32_t i = 0; leaf && i < leaf->count; i++)
+            if (sendRecord(&stream, leaf->records[i], fetchRecord(leaf->records[i], &lengths)) < 0)
+                break;
+    }
+    else
+        sendNameMatches(&stream, name, nameLength, prefix, 0);
+
+    int result = finishResults(&stream);
+    addToProfile(&stream, startTicks);
+    return result;
+}
+
+/* Send every record matching searchKey, followed by a blank line */
+static int lookupKey(int clientSocket, z_stream *compressor, const char *searchKey)
+{
+    struct ResultStream stream;
+    size_t keyLength = strlen(searchKey);
+    struct QueryPlan plan;
+    struct timespec startTime;
+
+    clock_gettime(CLOCK_MONOTONIC, &startTime);
+    uint64_t startTicks = profileClock();
+    openResultStream(&stream, clientSocket, compressor);
+
+    /* Run the query along the access path the planner picks */
+    planQuery(searchKey, keyLength, &plan);
+    stream.ticks[STAGE_PARSE] = profileClock() - startTicks;
+    switch (plan.strategy)
+    {
+    case PLAN_PREFIX:
+        sendPrefixMatches(&stream, &plan);
+        break;
+    case PLAN_NGRAM:
+        sendNgramMatches(&stream, &plan, searchKey, keyLength);
+        break;
+    default:
+        scanRecords(&stream, searchKey, keyLength, 0);
+        break;
+    }
+
+    /* Send a blank line to indicate the end of search results */
+    int result = finishResults(&stream);
+
+    addToProfile(&stream, startTicks);
+    if (result < 0)
+        return -1;
+
+    /* Log slow queries with the reasoning behind their plan */
+    double elapsedMillis = millisSince(&startTime);
+    if (slowQueryMillis >= 0 && elapsedMillis >= slowQueryMillis)
+    {
+        char explanation[256];
+        explainPlan(&plan, keyLength, explanation, sizeof(explanation));
+        fprintf(stderr, "Slow query {%s}: %.3f ms, %s\n", searchKey, elapsedMillis, explanation);
+    }
+    return 0;
+}
+
+/* Send every record matching an already case-folded key regardless of
+ * case, followed by a blank line. The indexes hold the records as they
+ * are, so this always scans the folded copy. */
+static int lookupFoldedKey(int clientSocket, z_stream *compressor, const char *foldedKey)
+{
+    struct ResultStream stream;
+    uint64_t startTicks = profileClock();
+
+    openResultStream(&stream, clientSocket, compressor);
+    scanRecords(&stream, foldedKey, strlen(foldedKey), 1);
+
+    int result = finishResults(&stream);
+    addToProfile(&stream, startTicks);
+    return result;
+}
+
+/* A match of a sorted lookup: the first SORT_PREFIX_BYTES bytes of its
+ * sort field, zero padded and big-endian so that comparing the integers
+ * compares the bytes, and its record number */
+struct SortPair {
+    uint64_t prefix;
+    uint32_t record;
+};
+
+/* Shared state of the threads sorting one result. The serving thread
+ * splits the pairs by their top byte; the threads then claim those
+ * buckets and sort each on the remaining prefix bytes. */
+struct SortJob {
+    struct SortPair *pairs;         /* Split by the top byte; sorted when done */
+    struct SortPair *scratch;       /* As many pairs, for the passes */
+    size_t bucketStart[257];
+    atomic_int nextBucket;
+    int field;
+    int breakTies;                  /* Threads may fetch records (not compressed) */
+};
+
+/* The SORT_PREFIX_BYTES bytes of a field from offset on */
+static uint64_t sortPrefix(const char *field, size_t fieldLength, size_t offset)
+{
+    uint64_t prefix = 0;
+
+    for (size_t i = offset; i < offset + SORT_PREFIX_BYTES; i++)
+        prefix = prefix << 8 | (i < fieldLength ? (unsigned char)field[i] : 0);
+    return prefix;
+}
+
+/* Stable LSD radix sort on the low bytes of the prefixes, skipping bytes
+ * that are the same in every pair */
+static void radixSortPairs(struct SortPair *pairs, struct SortPair *scratch, size_t count, int bytes)
+{
+    struct SortPair *from = pairs, *to = scratch;
+
+    for (int shift = 0; shift < bytes * 8; shift += 8)
+    {
+        size_t counts[256] = { 0 };
+
+        for (size_t i = 0; i < count; i++)
+            counts[(from[i].prefix >> shift) & 0xff]++;
+        if (counts[(from[0].prefix >> shift) & 0xff] == count)
+            continue;
+        for (size_t digit = 0, total = 0; digit < 256; digit++)
+        {
+            size_t digitCount = counts[digit];
+            counts[digit] = total;
+            total += digitCount;
+        }
+        for (size_t i = 0; i < count; i++)
+            to[counts[(from[i].prefix >> shift) & 0xff]++] = from[i];
+
+        struct SortPair *swap = from;
+        from = to;
+        to = swap;
+    }
+    if (from != pairs)
+        memcpy(pairs, from, count * sizeof(struct SortPair));
+}
+
+/* Order runs of pairs with equal prefixes by the next SORT_PREFIX_BYTES
+ * bytes of the field, and so on while they tie. A prefix ending in a zero
+ * byte reaches the end of the field, so such a run is all equal fields,
+ * already in record order. */
+static void sortTies(struct SortPair *pairs, size_t count, int field, size_t offset)
+{
+    const unsigned char *lengths;
+
+    for (size_t start = 0, end; start < count; start = end)
+    {
+        for (end = start + 1; end < count && pairs[end].prefix == pairs[start].prefix; end++)
+            ;
+        if (end - start < 2 || (pairs[start].prefix & 0xff) == 0)
+            continue;
+
+        size_t runLength = end - start;
+        struct SortPair *scratch = (struct SortPair *)malloc(runLength * sizeof(struct SortPair));
+        if (!scratch)
+            terminate("Memory allocation failed");
+        for (size_t i = start; i < end; i++)
+        {
+            const char *record = fetchRecord(pairs[i].record, &lengths);
+            pairs[i].prefix = sortPrefix(recordField(record, field), lengths[field], offset + SORT_PREFIX_BYTES);
+        }
+        radixSortPairs(pairs + start, scratch, runLength, SORT_PREFIX_BYTES);
+        free(scratch);
+        sortTies(pairs + start, runLength, field, offset + SORT_PREFIX_BYTES);
+    }
+}
+
+/* Claim buckets until none are left and sort each */
+static void *sortBuckets(void *argument)
+{
+    struct SortJob *job = (struct SortJob *)argument;
+    int bucket;
+
+    while ((bucket = job->nextBucket++) < 256)
+    {
+        size_t first = job->bucketStart[bucket];
+        size_t count = job->bucketStart[bucket + 1] - first;
+
+        if (count < 2)
+            continue;
+        radixSortPairs(job->pairs + first, job->scratch + first, count, SORT_PREFIX_BYTES - 1);
+        if (job->breakTies)
+            sortTies(job->pairs + first, count, job->field, 0);
+    }
+    return NULL;
+}
+
+/* Sort matches by their sort field, then by record number: a radix sort
+ * on the prefixes, continued further into the field only where they tie */
+static void sortPairs(struct SortPair *pairs, size_t count, int field)
+{
+    struct SortJob job;
+
+    memset(&job, 0, sizeof(job));
+    job.pairs = pairs;
+    job.scratch = (struct SortPair *)malloc((count + 1) * sizeof(struct SortPair));
+    job.field = field;
+    job.breakTies = compressedRanges == NULL;   /* Decoded blocks are per thread */
+    if (!job.scratch)
+        terminate("Memory allocation failed");
+
+    /* Split by the top byte, into scratch and back, keeping record order */
+    for (size_t i = 0; i < count; i++)
+        job.bucketStart[(pairs[i].prefix >> 56) + 1]++;
+    for (int bucket = 0; bucket < 256; bucket++)
+        job.bucketStart[bucket + 1] += job.bucketStart[bucket];
+    size_t fill[256];
+    memcpy(fill, job.bucketStart, sizeof(fill));
+    for (size_t i = 0; i < count; i++)
+        job.scratch[fill[pairs[i].prefix >> 56]++] = pairs[i];
+    memcpy(pairs, job.scratch, count * sizeof(struct SortPair));
+
+    /* This thread sorts buckets too; helpers that fail to start are skipped */
+    int threadCount = count < SORT_PARALLEL_MIN ? 1 : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    pthread_t *threads = (pthread_t *)malloc((threadCount > 0 ? threadCount : 1) * sizeof(pthread_t));
+    int started = 0;
+    if (!threads)
+        terminate("Memory allocation failed");
+    for (int i = 1; i < threadCount; i++)
+        if (pthread_create(&threads[started], NULL, sortBuckets, &job) == 0)
+            started++;
+    sortBuckets(&job);
+    for (int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+    free(job.scratch);
+
+    if (!job.breakTies)
+        sortTies(pairs, count, field, 0);
+}
+
+/* The records matching searchKey, each with the prefix of its sort field,
+ * found by the same block scan as scanRecords() */
+static struct SortPair *collectSortPairs(const char *searchKey, size_t keyLength, int field, size_t *pairCount)
+{
+    size_t blockSize = compressedRanges ? COMPRESSED_BLOCK_RECORDS : OUTPUT_TICK_RECORDS;
+    uint32_t hits[OUTPUT_TICK_RECORDS > COMPRESSED_BLOCK_RECORDS ? OUTPUT_TICK_RECORDS : COMPRESSED_BLOCK_RECORDS];
+    size_t capacity = 4096, count = 0;
+    struct SortPair *pairs = (struct SortPair *)malloc(capacity * sizeof(struct SortPair));
+
+    if (!pairs)
+        terminate("Memory allocation failed");
+    for (size_t first = 0; first < recordCount; first += blockSize)
+    {
+        size_t blockCount = recordCount - first < blockSize ? recordCount - first : blockSize;
+        const char *block = records + first * schema.recordSize;
+        const unsigned char *lengths = fieldLengths ? fieldLengths + first * schema.fieldCount : NULL;
+
+        if (compressedRanges)
+        {
+            size_t packedLength;
+            const unsigned char *packed = packedBlock(first / COMPRESSED_BLOCK_RECORDS, &packedLength);
+
+            if (keyLength && !memmem(packed, packedLength, searchKey, keyLength))
+                continue;
+            block = decodeBlock(first / COMPRESSED_BLOCK_RECORDS, &lengths);
+        }
+
+        size_t hitCount = findMatches(block, lengths, blockCount, searchKey, keyLength, hits);
+        if (capacity - count < hitCount)
+        {
+            while (capacity - count < hitCount)
+                capacity *= 2;
+            if ((pairs = (struct SortPair *)realloc(pairs, capacity * sizeof(struct SortPair))) == NULL)
+                terminate("Memory allocation failed");
+        }
+        for (size_t i = 0; i < hitCount; i++)
+        {
+            const char *record = block + hits[i] * schema.recordSize;
+
+            pairs[count].prefix = sortPrefix(recordField(record, field), lengths[hits[i] * schema.fieldCount + field], 0);
+            pairs[count++].record = first + hits[i];
+        }
+    }
+    *pairCount = count;
+    return pairs;
+}
+
+/* Answer "SORT <field> <key>": the records matching the key like a plain
+ * lookup, ordered by the named field, ties in file order, followed by a
+ * blank line */
+static int lookupSorted(int clientSocket, z_stream *compressor, const char *fieldName, const char *searchKey)
+{
+    struct ResultStream stream;
+    const unsigned char *lengths;
+    int field = mdbSchemaField(&schema, fieldName);
+    uint64_t startTicks = profileClock();
+
+    if (field < 0)
+        return sendResponse(clientSocket, compressor, "ERROR unknown sort field\n\n");
+
+    openResultStream(&stream, clientSocket, compressor);
+    size_t count;
+    struct SortPair *pairs = collectSortPairs(searchKey, strlen(searchKey), field, &count);
+    sortPairs(pairs, count, field);
+
+    for (size_t i = 0; i < count; i++)
+        if (sendRecord(&stream, pairs[i].record, fetchRecord(pairs[i].record, &lengths)) < 0)
+            break;
+    free(pairs);
+
+    int result = finishResults(&stream);
+    addToProfile(&stream, startTicks);
+    return result;
+}
+
+/* Distinct keys of an MGET, each with the result lines found for it */
+struct BatchKey {
+    char key[MAX_KEY_LENGTH + 1];
+    size_t keyLength;
+    MdbMatcher match;           /* Kernel for the key's length */
+    size_t lastRecord;          /* Record number + 1 last added, to add each once */
+    char *lines;
+    size_t length, capacity;
+};
+
+/* Open-addressing table from a substring of up to MAX_KEY_LENGTH bytes,
+ * packed with its length into 64 bits, to its BatchKey */
+struct KeyTable {
+    uint64_t *packed;
+    int *keys;                  /* -1 for an empty slot */
+    unsigned bits;
+    unsigned char firstBytes[256];   /* Bytes some key starts with */
+    unsigned lengths;                /* Bit n set if some key has length n */
+};
+
+static uint64_t packKey(const char *bytes, size_t length)
+{
+    uint64_t packed = (uint64_t)length << 56;
+
+    for (size_t i = 0; i < length; i++)
+        packed |= (uint64_t)(unsigned char)bytes[i] << (8 * i);
+    return packed;
+}
+
+static size_t keySlot(const struct KeyTable *table, uint64_t packed)
+{
+    return (packed * 0x9e3779b97f4a7c15ULL) >> (64 - table->bits);
+}
+
+static int findKey(const struct KeyTable *table, uint64_t packed)
+{
+    size_t mask = ((size_t)1 << table->bits) - 1;
+
+    for (size_t slot = keySlot(table, packed); table->keys[slot] >= 0; slot = (slot + 1) & mask)
+        if (table->packed[slot] == packed)
+            return table->keys[slot];
+    return -1;
+}
+
+/* Add a record's result line to a key, once per record. Returns the bytes added. */
+static size_t addBatchLine(struct BatchKey *batchKey, size_t index, const char *record)
+{
+    if (batchKey->lastRecord == index + 1)
+        return 0;
+    batchKey->lastRecord = index + 1;
+
+    if (batchKey->capacity - batchKey->length < MAX_RESULT_LINE)
+    {
+        batchKey->capacity = batchKey->capacity ? batchKey->capacity * 2 : 4096 + MAX_RESULT_LINE;
+        if ((batchKey->lines = (char *)realloc(batchKey->lines, batchKey->capacity)) == NULL)
+            terminate("Memory allocation failed");
+    }
+    size_t lineLength = formatRecord(batchKey->lines + batchKey->length, index, record);
+    batchKey->length += lineLength;
+    return lineLength;
+}
+
+/* Look up every substring of a field that is as long as some key. Returns
+ * the bytes added to the keys' lines. */
+static size_t probeField(const struct KeyTable *table, struct BatchKey *batchKeys, const char *field, size_t fieldLength,
+                       size_t index, const char *record)
+{
+    size_t added = 0;
+
+    for (size_t start = 0; start < fieldLength; start++)
+    {
+        if (!table->firstBytes[(unsigned char)field[start]])
+            continue;
+        for (size_t length = 1; length <= MAX_KEY_LENGTH && start + length <= fieldLength; length++)
+        {
+            if (!(table->lengths & (1u << length)))
+                continue;
+            int key = findKey(table, packKey(field + start, length));
+            if (key >= 0)
+                added += addBatchLine(&batchKeys[key], index, record);
+        }
+    }
+    return added;
+}
+
+/*
+ * Answer "MGET k1 k2 ...": one pass over the records serves every key, and
+ * the results come back as one section per key, in the order given:
+ * "KEY {k}", the key's result lines, and a blank line. Keys are cut to
+ * MAX_KEY_LENGTH like single lookups. With few keys each record is
+ * checked with memmem() per key; with more, each substring of a record
+ * that could be a key is looked up in a hash table of the keys, so the
+ * cost of a record no longer grows with the number of keys. The sections
+ * are held until the pass ends; past MGET_MAX_BUFFERED bytes of them the
+ * pass stops and the answer is an error instead, as it is for more than
+ * MGET_MAX_KEYS keys.
+ */
+static int lookupKeys(int clientSocket, z_stream *compressor, char *keyList)
+{
+    struct BatchKey *batchKeys = (struct BatchKey *)calloc(MGET_MAX_KEYS, sizeof(struct BatchKey));
+    int *sections = (int *)malloc(MGET_MAX_KEYS * sizeof(int));
+    struct KeyTable table;
+    struct ResultStream stream;
+    size_t fieldOffsets[MDB_SCHEMA_MAX_FIELDS];
+    int keyCount = 0, sectionCount = 0;
+    size_t buffered = 0;
+    const char *error = NULL;
+    uint64_t startTicks = profileClock();
+
+    if (!batchKeys || !sections)
+        terminate("Memory allocation failed");
+    copyFieldOffsets(fieldOffsets);
+    memset(&table, 0, sizeof(table));
+    for (table.bits = 1; ((size_t)1 << table.bits) < 2 * MGET_MAX_KEYS; table.bits++)
+        ;
+    size_t slots = (size_t)1 << table.bits;
+    table.packed = (uint64_t *)malloc(slots * sizeof(uint64_t));
+    table.keys = (int *)malloc(slots * sizeof(int));
+    if (!table.packed || !table.keys)
+        terminate("Memory allocation failed");
+    memset(table.keys, -1, slots * sizeof(int));
+
+    /* Distinct keys go into the table; repeated ones share a BatchKey */
+    for (char *token = strtok(keyList, " \t\r\n"); token; token = strtok(NULL, " \t\r\n"))
+    {
+        if (sectionCount == MGET_MAX_KEYS)
+        {
+            error = "ERROR MGET too many keys\n\n";
+            break;
+        }
+
+        size_t length = strlen(token) < MAX_KEY_LENGTH ? strlen(token) : MAX_KEY_LENGTH;
+        uint64_t packed = packKey(token, length);
+        int key = findKey(&table, packed);
+
+        if (key < 0)
+        {
+            key = keyCount++;
+            memcpy(batchKeys[key].key, token, length);
+            batchKeys[key].keyLength = length;
+            batchKeys[key].match = mdbSelectMatcher(length);
+
+            size_t slot = keySlot(&table, packed);
+            while (table.keys[slot] >= 0)
+                slot = (slot + 1) & (slots - 1);
+            table.packed[slot] = packed;
+            table.keys[slot] = key;
+            table.firstBytes[(unsigned char)token[0]] = 1;
+            table.lengths |= 1u << length;
+        }
+        sections[sectionCount++] = key;
+    }
+
+    openResultStream(&stream, clientSocket, compressor);
+    stream.ticks[STAGE_PARSE] = profileClock() - startTicks;
+
+    /* The fused pass, block by block like scanRecords() */
+    size_t blockSize = compressedRanges ? COMPRESSED_BLOCK_RECORDS : OUTPUT_TICK_RECORDS;
+    for (size_t first = 0; first < recordCount && keyCount > 0 && !error && buffered <= MGET_MAX_BUFFERED; first += blockSize)
+    {
+        size_t count = recordCount - first < blockSize ? recordCount - first : blockSize;
+        const char *block = records + first * schema.recordSize;
+        const unsigned char *lengths = fieldLengths ? fieldLengths + first * schema.fieldCount : NULL;
+
+        if (compressedRanges)
+            block = decodeBlock(first / COMPRESSED_BLOCK_RECORDS, &lengths);
+
+        /* The sections are only sent after the pass, so their total is capped */
+        for (size_t i = 0; i < count && buffered <= MGET_MAX_BUFFERED; i++)
+        {
+            const char *record = block + i * schema.recordSize;
+            const unsigned char *recordLengths = lengths + i * schema.fieldCount;
+
+            if (keyCount < MGET_PROBE_MIN_KEYS)
+            {
+                for (int key = 0; key < keyCount; key++)
+                    if (recordMatches(record, recordLengths, schema.fieldCount, fieldOffsets, batchKeys[key].match,
+                                      batchKeys[key].key, batchKeys[key].keyLength))
+                        buffered += addBatchLine(&batchKeys[key], first + i, record);
+                continue;
+            }
+            for (int f = 0; f < schema.fieldCount; f++)
+                buffered += probeField(&table, batchKeys, recordField(record, f), recordLengths[f], first + i, record);
+        }
+    }
+
+    /* One labelled section per key as given, each ending in a blank line */
+    if (buffered > MGET_MAX_BUFFERED)
+        error = "ERROR MGET result too large\n\n";
+    if (error)
+        writeResultStream(&stream, error, strlen(error));
+    for (int section = 0; section < sectionCount && !error; section++)
+    {
+        struct BatchKey *batchKey = &batchKeys[sections[section]];
+        char label[MAX_KEY_LENGTH + 16];
+        int labelLength = snprintf(label, sizeof(label), "KEY {%s}\n", batchKey->key);
+
+        if (writeResultStream(&stream, label, labelLength) < 0)
+            break;
+        for (size_t offset = 0; offset < batchKey->length && !stream.failed; offset += OUTPUT_MAX_BATCH)
+        {
+            size_t part = batchKey->length - offset < OUTPUT_MAX_BATCH ? batchKey->length - offset : OUTPUT_MAX_BATCH;
+            writeResultStream(&stream, batchKey->lines + offset, part);
+        }
+        if (writeResultStream(&stream, "\n", 1) < 0)
+            break;
+    }
+    int result = flushResultStream(&stream, 1);
+    addToProfile(&stream, startTicks);
+
+    for (int key = 0; key < keyCount; key++)
+        free(batchKeys[key].lines);
+    free(batchKeys);
+    free(sections);
+    free(table.packed);
+    free(table.keys);
+    return result;
+}
+
+/* Read the rest of a query line longer than the fgets() buffer. Returns
+ * the whole line in memory the caller frees, or NULL if it is longer than
+ * MGET_MAX_LINE bytes, in which case the rest of it is read and dropped. */
+static char *readWholeLine(FILE *clientInput, const char *start)
+{
+    size_t length = strlen(start);
+    char *line = (char *)malloc(length + 1);
+
+    if (!line)
+        terminate("Memory allocation failed");
+    memcpy(line, start, length + 1);
+
+    while (length > 0 && line[length - 1] != '\n')
+    {
+        char more[4096];
+        if (fgets(more, sizeof(more), clientInput) == NULL)
+            break;
+
+        size_t moreLength = strlen(more);
+        if (length + moreLength > MGET_MAX_LINE)
+        {
+            while (strchr(more, '\n') == NULL && fgets(more, sizeof(more), clientInput) != NULL)
+                ;
+            free(line);
+            return NULL;
+        }
+        if ((line = (char *)realloc(line, length + moreLength + 1)) == NULL)
+            terminate("Memory allocation failed");
+        memcpy(line + length, more, moreLength + 1);
+        length += moreLength;
+    }
+    return line;
+}
+
+/* A WATCH connection. The watcher thread owns it once it is handed over. */
+struct Subscription {
+    int socket;
+    z_stream *compressor;       /* Copy of the connection's deflate stream, or NULL */
+    size_t nextRecord;          /* First record number - 1 not yet checked for it */
+    struct BatchKey match;      /* The key, and its lines from the appends being read */
+};
+
+/* Aho-Corasick automaton over the subscribed keys. Failure links are
+ * folded into next, so every byte of a field takes one transition. */
+struct WatchAutomaton {
+    int (*next)[256];
+    int *fail;
+    int *outputLink;            /* Nearest proper suffix state some key ends at, or -1 */
+    int *firstKey;              /* First subscription whose key ends at a state, or -1 */
+    int *sameKey;               /* Next subscription ending at the same state, or -1 */
+};
+
+/* Subscriptions handed over by the main thread, not yet taken by the watcher */
+static struct {
+    pthread_mutex_t lock;
+    struct Subscription *pending[WATCH_MAX_SUBSCRIPTIONS];
+    int pendingCount;
+    int wakeup[2];              /* Pipe that tells the watcher to take them */
+    int started;
+} watchQueue = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static void freeAutomaton(struct WatchAutomaton *automaton)
+{
+    free(automaton->next);
+    free(automaton->fail);
+    free(automaton->outputLink);
+    free(automaton->firstKey);
+    free(automaton->sameKey);
+    memset(automaton, 0, sizeof(*automaton));
+}
+
+/* Build the automaton for the current subscriptions. An empty key ends at
+ * the root and so matches every record. */
+static void buildAutomaton(struct WatchAutomaton *automaton, struct Subscription *const *subscriptions, int count)
+{
+    size_t maxStates = 1 + (size_t)count * MAX_KEY_LENGTH;
+    int stateCount = 1;
+    int *queue;
+
+    freeAutomaton(automaton);
+    automaton->next = malloc(maxStates * sizeof(*automaton->next));
+    automaton->fail = (int *)malloc(maxStates * sizeof(int));
+    automaton->outputLink = (int *)malloc(maxStates * sizeof(int));
+    automaton->firstKey = (int *)malloc(maxStates * sizeof(int));
+    automaton->sameKey = (int *)malloc((count ? count : 1) * sizeof(int));
+    queue = (int *)malloc(maxStates * sizeof(int));
+    if (!automaton->next || !automaton->fail || !automaton->outputLink || !automaton->firstKey || !automaton->sameKey || !queue)
+        terminate("Memory allocation failed");
+    memset(automaton->next, -1, sizeof(*automaton->next));
+    automaton->firstKey[0] = -1;
+
+    /* The trie of the keys */
+    for (int i = 0; i < count; i++)
+    {
+        const struct BatchKey *key = &subscriptions[i]->match;
+        int state = 0;
+
+        for (size_t j = 0; j < key->keyLength; j++)
+        {
+            int *next = &automaton->next[state][(unsigned char)key->key[j]];
+            if (*next < 0)
+            {
+                memset(automaton->next[stateCount], -1, sizeof(*automaton->next));
+                automaton->firstKey[stateCount] = -1;
+                *next = stateCount++;
+            }
+            state = *next;
+        }
+        automaton->sameKey[i] = automaton->firstKey[state];
+        automaton->firstKey[state] = i;
+    }
+
+    /* Failure and output links, breadth first so a state's failure state
+     * is complete before the state itself */
+    int head = 0, tail = 0;
+    automaton->fail[0] = 0;
+    automaton->outputLink[0] = -1;
+    for (int c = 0; c < 256; c++)
+    {
+        int child = automaton->next[0][c];
+        if (child < 0)
+            automaton->next[0][c] = 0;
+        else
+        {
+            automaton->fail[child] = 0;
+            automaton->outputLink[child] = automaton->firstKey[0] >= 0 ? 0 : -1;
+            queue[tail++] = child;
+        }
+    }
+    while (head < tail)
+    {
+        int state = queue[head++];
+        int fail = automaton->fail[state];
+
+        for (int c = 0; c < 256; c++)
+        {
+            int child = automaton->next[state][c];
+            if (child < 0)
+            {
+                automaton->next[state][c] = automaton->next[fail][c];
+                continue;
+            }
+            int childFail = automaton->next[fail][c];
+            automaton->fail[child] = childFail;
+            automaton->outputLink[child] = automaton->firstKey[childFail] >= 0 ? childFail : automaton->outputLink[childFail];
+            queue[tail++] = child;
+        }
+    }
+    free(queue);
+}
+
+/* Add the record to every subscription whose key ends at the state */
+static void addStateMatches(const struct WatchAutomaton *automaton, struct Subscription *const *subscriptions, int state,
+                            size_t index, const char *record)
+{
+    if (automaton->firstKey[state] < 0)
+        state = automaton->outputLink[state];
+    for (; state >= 0; state = automaton->outputLink[state])
+    {
+        for (int i = automaton->firstKey[state]; i >= 0; i = automaton->sameKey[i])
+            if (index >= subscriptions[i]->nextRecord)
+                addBatchLine(&subscriptions[i]->match, index, record);
+    }
+}
+
+/* Run one field through the automaton; keys do not match across fields */
+static void matchWatchedField(const struct WatchAutomaton *automaton, struct Subscription *const *subscriptions,
+                              const char *field, size_t index, const char *record)
+{
+    int state = 0;
+
+    addStateMatches(automaton, subscriptions, 0, index, record);
+    for (; *field; field++)
+    {
+        state = automaton->next[state][(unsigned char)*field];
+        addStateMatches(automaton, subscriptions, state, index, record);
+    }
+}
+
+static void dropSubscription(struct Subscription **subscriptions, int *count, int i)
+{
+    struct Subscription *subscription = subscriptions[i];
+
+    close(subscription->socket);
+    if (subscription->compressor)
+    {
+        deflateEnd(subscription->compressor);
+        free(subscription->compressor);
+    }
+    free(subscription->match.lines);
+    free(subscription);
+    subscriptions[i] = subscriptions[--*count];
+}
+
+/* Send each subscription the lines found for it, then a blank line.
+ * Returns the number of subscriptions dropped because a send failed. */
+static int pushMatches(struct ResultStream *stream, struct Subscription **subscriptions, int *count, size_t nextRecord)
+{
+    int dropped = 0;
+
+    for (int i = 0; i < *count; i++)
+    {
+        struct Subscription *subscription = subscriptions[i];
+        struct BatchKey *match = &subscription->match;
+        int result = 0;
+
+        if (match->length)
+        {
+            openResultStream(stream, subscription->socket, subscription->compressor);
+            for (size_t sent = 0; sent < match->length && result == 0; sent += sizeof(stream->buffer))
+            {
+                size_t part = match->length - sent < sizeof(stream->buffer) ? match->length - sent : sizeof(stream->buffer);
+                result = writeResultStream(stream, match->lines + sent, part);
+            }
+            if (result == 0 && (writeResultStream(stream, "\n", 1) < 0 || flushResultStream(stream, 1) < 0))
+                result = -1;
+            match->length = 0;
+            match->lastRecord = 0;
+        }
+        if (subscription->nextRecord < nextRecord)
+            subscription->nextRecord = nextRecord;
+
+        if (result < 0)
+        {
+            dropSubscription(subscriptions, count, i--);
+            dropped++;
+        }
+    }
+    return dropped;
+}
+
+/* Read the records appended since the oldest position of any subscription,
+ * in slices, and push each slice's matches. Records a subscription has
+ * already been checked against are skipped for it. A file that shrank was
+ * rewritten rather than appended to; its records are not pushed. */
+static int readAppends(const struct WatchAutomaton *automaton, struct ResultStream *stream,
+                       struct Subscription **subscriptions, int *count)
+{
+    static char *slice;     /* WATCH_SLICE_RECORDS records; only the watcher thread reads appends */
+    struct stat fileStat;
+    size_t first = (size_t)-1, end;
+    int fileDescriptor, dropped = 0;
+
+    if ((fileDescriptor = open(watchedFile, O_RDONLY)) < 0 || fstat(fileDescriptor, &fileStat) < 0)
+    {
+        perror("Failed to open the watched database");
+        if (fileDescriptor >= 0)
+            close(fileDescriptor);
+        return 0;
+    }
+    if (!slice && (slice = (char *)malloc(WATCH_SLICE_RECORDS * schema.recordSize)) == NULL)
+        terminate("Memory allocation failed");
+    end = fileStat.st_size / schema.recordSize;
+
+    for (int i = 0; i < *count; i++)
+    {
+        if (subscriptions[i]->nextRecord > end)
+            subscriptions[i]->nextRecord = end;
+        if (subscriptions[i]->nextRecord < first)
+            first = subscriptions[i]->nextRecord;
+    }
+
+    while (first < end && *count > 0)
+    {
+        size_t sliceCount = end - first < WATCH_SLICE_RECORDS ? end - first : WATCH_SLICE_RECORDS;
+        ssize_t bytes = pread(fileDescriptor, slice, sliceCount * schema.recordSize, (off_t)first * schema.recordSize);
+
+        if (bytes < (ssize_t)schema.recordSize)
+            break;
+        sliceCount = bytes / schema.recordSize;
+        for (size_t i = 0; i < sliceCount; i++)
+        {
+            char *record = slice + i * schema.recordSize;
+
+            /* Appended records were never checked; bound their fields */
+            terminateFields(record);
+            for (int f = 0; f < schema.fieldCount; f++)
+                matchWatchedField(automaton, subscriptions, recordField(record, f), first + i, record);
+        }
+        first += sliceCount;
+        dropped += pushMatches(stream, subscriptions, count, first);
+        if (dropped)
+            break;  /* The automaton refers to dropped subscriptions */
+    }
+    close(fileDescriptor);
+    return dropped;
+}
+
+/* Point the inotify watch at the file now at watchedFile. Returns its
+ * inode, or 0 if it cannot be watched right now. */
+static ino_t rewatchFile(int inotifyDescriptor, int *watch)
+{
+    struct stat fileStat;
+
+    if (*watch >= 0)
+        inotify_rm_watch(inotifyDescriptor, *watch);
+    *watch = inotify_add_watch(inotifyDescriptor, watchedFile, IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF);
+    if (*watch < 0 || stat(watchedFile, &fileStat) < 0)
+        return 0;
+    return fileStat.st_ino;
+}
+
+/*
+ * The watcher thread: waits for the database file to change, for new
+ * subscriptions, and for subscribers to hang up. Appended records are
+ * matched once against the automaton of all subscribed keys instead of
+ * once per subscription. Replacing the file (rename over it) counts as a
+ * rewrite, so the watch moves to the new file without pushing its records.
+ */
+static void *watchDatabase(void *argument)
+{
+    struct Subscription *subscriptions[WATCH_MAX_SUBSCRIPTIONS];
+    struct pollfd waitSet[2 + WATCH_MAX_SUBSCRIPTIONS];
+    struct WatchAutomaton automaton = { 0 };
+    struct ResultStream *stream = (struct ResultStream *)malloc(sizeof(struct ResultStream));
+    int count = 0, watch = -1;
+    int inotifyDescriptor = inotify_init1(IN_CLOEXEC);
+    ino_t watchedInode;
+
+    (void)argument;
+    if (!stream)
+        terminate("Memory allocation failed");
+    if (inotifyDescriptor < 0)
+        terminate("inotify_init1() failed");
+    watchedInode = rewatchFile(inotifyDescriptor, &watch);
+
+    for (;;)
+    {
+        int changed = 0, fileEvent = 0;
+
+        waitSet[0].fd = inotifyDescriptor;
+        waitSet[0].events = POLLIN;
+        waitSet[1].fd = watchQueue.wakeup[0];
+        waitSet[1].events = POLLIN;
+        for (int i = 0; i < count; i++)
+        {
+            waitSet[2 + i].fd = subscriptions[i]->socket;
+            waitSet[2 + i].events = POLLIN;
+        }
+
+        /* Without a watch, retry every second until the file is back */
+        if (poll(waitSet, 2 + count, watch < 0 ? 1000 : -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            terminate("poll() failed");
+        }
+
+        /* Anything a subscriber sends, or its hang-up, ends its watch */
+        for (int i = count - 1; i >= 0; i--)
+        {
+            if (waitSet[2 + i].revents)
+            {
+                dropSubscription(subscriptions, &count, i);
+                changed = 1;
+            }
+        }
+
+        if (waitSet[1].revents & POLLIN)
+        {
+            char drain[64];
+            if (read(watchQueue.wakeup[0], drain, sizeof(drain)) < 0)
+                perror("read() failed");
+
+            pthread_mutex_lock(&watchQueue.lock);
+            while (watchQueue.pendingCount > 0 && count < WATCH_MAX_SUBSCRIPTIONS)
+                subscriptions[count++] = watchQueue.pending[--watchQueue.pendingCount];
+            pthread_mutex_unlock(&watchQueue.lock);
+            changed = 1;
+        }
+
+        if (waitSet[0].revents & POLLIN)
+        {
+            char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+            if (read(inotifyDescriptor, events, sizeof(events)) < 0 && errno != EAGAIN)
+                perror("read() failed");
+            fileEvent = 1;
+        }
+
+        /* A new inode at the path means the file was replaced */
+        struct stat fileStat;
+        if ((fileEvent || watch < 0) && stat(watchedFile, &fileStat) == 0 && fileStat.st_ino != watchedInode)
+        {
+            watchedInode = rewatchFile(inotifyDescriptor, &watch);
+            for (int i = 0; i < count; i++)
+                subscriptions[i]->nextRecord = fileStat.st_size / schema.recordSize;
+            fileEvent = 0;
+        }
+
+        if (changed)
+            buildAutomaton(&automaton, subscriptions, count);
+
+        /* New subscriptions may start before what has been read; catch them up too */
+        while ((fileEvent || changed) && count > 0 && readAppends(&automaton, stream, subscriptions, &count) > 0)
+            buildAutomaton(&automaton, subscriptions, count);
+    }
+    return NULL;
+}
+
+/* Start a thread with the shutdown signals blocked, leaving them to the
+ * main thread, whose accept() they interrupt */
+static void startServiceThread(void *(*serve)(void *), void *argument)
+{
+    pthread_t thread;
+    sigset_t shutdownSignals, previousMask;
+
+    sigemptyset(&shutdownSignals);
+    sigaddset(&shutdownSignals, SIGTERM);
+    sigaddset(&shutdownSignals, SIGINT);
+    sigaddset(&shutdownSignals, SIGALRM);
+    if (pthread_sigmask(SIG_BLOCK, &shutdownSignals, &previousMask) != 0)
+        terminate("pthread_sigmask() failed");
+    if (pthread_create(&thread, NULL, serve, argument) != 0)
+        terminate("pthread_create() failed");
+    pthread_sigmask(SIG_SETMASK, &previousMask, NULL);
+    pthread_detach(thread);
+}
+
+/*
+ * Handle "WATCH <key>": answer the key like a lookup, then hand the
+ * connection to the watcher thread, which pushes the records appended to
+ * the database file from then on that match the key. Each batch of pushed
+ * lines ends with a blank line. The connection stops being read for
+ * queries; anything the client sends, or closing it, ends the watch.
+ * Returns 0 once the connection is handed over.
+ */
+static int watchKey(int clientSocket, z_stream *compressor, const char *key)
+{
+    struct Subscription *subscription;
+    struct timeval sendTimeout = { WATCH_SEND_TIMEOUT, 0 };
+
+    if (lookupKey(clientSocket, compressor, key) < 0)
+        return -1;
+
+    if ((subscription = (struct Subscription *)calloc(1, sizeof(*subscription))) == NULL)
+        terminate("Memory allocation failed");
+    strcpy(subscription->match.key, key);
+    subscription->match.keyLength = strlen(key);
+    subscription->nextRecord = recordCount;    /* The lookup covered the loaded records */
+
+    /* A subscriber that stops reading is dropped rather than stalling the others */
+    if ((subscription->socket = dup(clientSocket)) < 0 ||
+        setsockopt(subscription->socket, SOL_SOCKET, SO_SNDTIMEO, &sendTimeout, sizeof(sendTimeout)) < 0)
+    {
+        perror("Failed to hand over the connection");
+        if (subscription->socket >= 0)
+            close(subscription->socket);
+        free(subscription);
+        return -1;
+    }
+    if (compressor)
+    {
+        if ((subscription->compressor = (z_stream *)malloc(sizeof(z_stream))) == NULL ||
+            deflateCopy(subscription->compressor, compressor) != Z_OK)
+            terminate("deflateCopy() failed");
+    }
+
+    if (!watchQueue.started)
+    {
+        if (pipe2(watchQueue.wakeup, O_CLOEXEC | O_NONBLOCK) < 0)
+            terminate("pipe2() failed");
+        startServiceThread(watchDatabase, NULL);
+        watchQueue.started = 1;
+    }
+
+    pthread_mutex_lock(&watchQueue.lock);
+    int queued = watchQueue.pendingCount < WATCH_MAX_SUBSCRIPTIONS;
+    if (queued)
+        watchQueue.pending[watchQueue.pendingCount++] = subscription;
+    pthread_mutex_unlock(&watchQueue.lock);
+
+    if (!queued)
+    {
+        sendResponse(clientSocket, compressor, "ERROR too many watches\n\n");
+        if (subscription->compressor)
+        {
+            deflateEnd(subscription->compressor);
+            free(subscription->compressor);
+        }
+        close(subscription->socket);
+        free(subscription);
+        return -1;
+    }
+    if (write(watchQueue.wakeup[1], "", 1) < 0 && errno != EAGAIN)
+        perror("write() failed");
+    return 0;
+}
+
+/* One-line summary of readiness, load and database generation */
+static int formatStatus(char *buffer, size_t size)
+{
+    return snprintf(buffer, size, "%s generation=%lu records=%lu clients=%d inflight=%d served=%lu\n",
+                    serverReady ? "READY" : "NOTREADY",
+                    (unsigned long)databaseGeneration, (unsigned long)loadedRecords,
+                    (int)clientsConnected, (int)queriesInFlight, (unsigned long)queriesServed);
+}
+
+/* The profile: time per stage since startup, the allocator's view of the
+ * heap, and what the record store and its indexes take */
+static int formatProfile(char *buffer, size_t size)
+{
+    unsigned long queries = profiledQueries;
+    struct rusage usage;
+    int length;
+
+    getrusage(RUSAGE_SELF, &usage);
+    length = snprintf(buffer, size, "profile queries=%lu ticks_per_us=%.1f cpu_user_ms=%.1f cpu_system_ms=%.1f\n",
+                      queries, ticksPerMicrosecond,
+                      usage.ru_utime.tv_sec * 1e3 + usage.ru_utime.tv_usec / 1e3,
+                      usage.ru_stime.tv_sec * 1e3 + usage.ru_stime.tv_usec / 1e3);
+
+    for (int stage = 0; stage < STAGE_COUNT; stage++)
+    {
+        unsigned long ticks = stageTicks[stage];
+        double millis = ticks / ticksPerMicrosecond / 1e3;
+        length += snprintf(buffer + length, size - length, "stage %-8s ticks=%lu ms=%.3f per_query_us=%.1f\n",
+                           stageNames[stage], ticks, millis, queries ? millis * 1e3 / queries : 0.0);
+    }
+
+    /* Only the published sizes: the store and indexes may be being rebuilt */
+    length += snprintf(buffer + length, size - length,
+                       "memory records=%zu (%s) field_lengths=%zu folded=%zu dump=%zu compressed=%zu prefix_index=%zu ngram_index=%zu art_index=%zu mph=%zu\n",
+                       (size_t)memoryUsage.records, memoryUsage.mapped ? "mapped" : "heap",
+                       (size_t)memoryUsage.fieldLengths, (size_t)memoryUsage.folded, (size_t)memoryUsage.dump,
+                       (size_t)memoryUsage.compressed, (size_t)memoryUsage.prefixIndex, (size_t)memoryUsage.ngramIndex,
+                       (size_t)memoryUsage.artIndex, (size_t)memoryUsage.mph);
+
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+    struct mallinfo2 heap = mallinfo2();
+    length += snprintf(buffer + length, size - length, "malloc arena=%zu in_use=%zu free=%zu mmapped=%zu\n",
+                       heap.arena, heap.uordblks, heap.fordblks, heap.hblkhd);
+#endif
+    return length < (int)size ? length : (int)size - 1;
+}
+
+/* Wait for SIGUSR1, which every other thread blocks, and dump the profile */
+static void *serveProfile(void *argument)
+{
+    sigset_t *profileSignal = (sigset_t *)argument;
+    char profile[2048];
+    int signo;
+
+    for (;;)
+    {
+        if (sigwait(profileSignal, &signo) != 0)
+            continue;
+        formatProfile(profile, sizeof(profile));
+        fputs(profile, stderr);
+    }
+    return NULL;
+}
+
+/* Block SIGUSR1 in this thread and every thread started after it, and hand
+ * it to a thread of its own, so it interrupts no socket call */
+static void startProfileThread(void)
+{
+    static sigset_t profileSignal;
+
+    sigemptyset(&profileSignal);
+    sigaddset(&profileSignal, SIGUSR1);
+    if (pthread_sigmask(SIG_BLOCK, &profileSignal, NULL) != 0)
+        terminate("pthread_sigmask() failed");
+    startServiceThread(serveProfile, &profileSignal);
+}
+
+/* Answer health checks on the admin port without touching the records */
+static void *serveAdmin(void *argument)
+{
+    int adminSocket = *(int *)argument;
+    struct timeval readTimeout = { ADMIN_READ_TIMEOUT, 0 };
+    char request[512];
+    char status[2048];
+    char response[2560];
+    int responseLength;
+
+    for (;;)
+    {
+        int checkSocket = accept(adminSocket, NULL, NULL);
+        if (checkSocket < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            perror("accept() failed on admin socket");
+            return NULL;
+        }
+
+        /* Don't let a silent checker hold the admin thread */
+        setsockopt(checkSocket, SOL_SOCKET, SO_RCVTIMEO, &readTimeout, sizeof(readTimeout));
+        ssize_t requestLength = recv(checkSocket, request, sizeof(request) - 1, 0);
+        request[requestLength > 0 ? requestLength : 0] = '\0';
+
+        /* GET /profile answers with the profile instead of the status */
+        if (strncmp(request, "GET /profile", 12) == 0)
+            formatProfile(status, sizeof(status));
+        else
+            formatStatus(status, sizeof(status));
+
+        /* HTTP checkers get 200 when ready and 503 otherwise; others the bare line */
+        if (strncmp(request, "GET ", 4) == 0 || strncmp(request, "HEAD ", 5) == 0)
+            responseLength = snprintf(response, sizeof(response),
+                                      "HTTP/1.0 %s\r\nContent-Type: text/plain\r\nContent-Length: %zu\r\n\r\n%s",
+                                      serverReady ? "200 OK" : "503 Service Unavailable",
+                                      strlen(status), request[0] == 'H' ? "" : status);
+        else
+            responseLength = snprintf(response, sizeof(response), "%s", status);
+
+        sendFully(checkSocket, response, responseLength);
+        close(checkSocket);
+    }
+}
+
+/* Bind a listening TCP socket on the given port */
+static int openListeningSocket(unsigned short port, int reusePort)
+{
+    struct sockaddr_in serverAddr; /* Server address */
+    int listenSocket;
+
+    /* Create socket for incoming connections */
+    if ((listenSocket = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0)
+        terminate("socket() failed");
+
+    /* Let a new server version bind the same port while this one drains */
+    if (reusePort && setsockopt(listenSocket, SOL_SOCKET, SO_REUSEPORT, &reusePort, sizeof(reusePort)) < 0)
+        terminate("setsockopt() failed");
+
+    /* Prepare server address structure */
+    memset(&serverAddr, 0, sizeof(serverAddr));   // Zero out structure
+    serverAddr.sin_family = AF_INET;                // Internet address family
+    serverAddr.sin_addr.s_addr = htonl(INADDR_ANY); // Any incoming interface
+    serverAddr.sin_port = htons(port);             // Local port
+
+    /* Bind to the local address */
+    if (bind(listenSocket, (struct sockaddr *)&serverAddr, sizeof(serverAddr)) < 0)
+        terminate("bind() failed");
+
+    /* Mark the socket to listen for incoming connections */
+    if (listen(listenSocket, MAX_CONNECTIONS) < 0)
+        terminate("listen() failed");
+
+    return listenSocket;
+}
+
+/* Start the admin thread on an already listening socket */
+static void startAdminThread(int adminSocket)
+{
+    static int threadSocket;
+
+    threadSocket = adminSocket;
+    startServiceThread(serveAdmin, &threadSocket);
+}
+
+/* Send a short response that ends with a blank line, like a lookup */
+static int sendResponse(int clientSocket, z_stream *compressor, const char *response)
+{
+    struct ResultStream stream;
+
+    openResultStream(&stream, clientSocket, compressor);
+    if (writeResultStream(&stream, response, strlen(response)) < 0 || flushResultStream(&stream, 1) < 0)
+        return -1;
+    return 0;
+}
+
+/* Handle "COMPRESS <codec>": from the next response on, everything sent to
+ * the client goes through one deflate stream, sync-flushed at each
+ * terminating blank line. The acknowledgement itself is not compressed. */
+static void negotiateCompression(int clientSocket, const char *codec, z_stream *compressor, int *compressing)
+{
+    if (strcmp(codec, "deflate") != 0)
+    {
+        sendResponse(clientSocket, *compressing ? compressor : NULL, "ERROR unsupported compression\n\n");
+        return;
+    }
+
+    if (*compressing)
+    {
+        sendResponse(clientSocket, compressor, "OK deflate\n\n");
+        return;
+    }
+
+    memset(compressor, 0, sizeof(*compressor));
+    if (deflateInit(compressor, Z_BEST_SPEED) != Z_OK)
+    {
+        sendResponse(clientSocket, NULL, "ERROR compression unavailable\n\n");
+        return;
+    }
+    sendResponse(clientSocket, NULL, "OK deflate\n\n");
+    *compressing = 1;
+}
+
+/* Function to handle client communication and database lookups */
+void processClientRequest(int clientSocket)
+{
+    /* Wrap the client socket with a FILE* for easier reading */
+    FILE *clientInput = fdopen(clientSocket, "r");
+    if (clientInput == NULL) 
+        terminate("Failed to associate file stream with socket");
+
+    char queryLine[1000];
+    char searchKey[MAX_KEY_LENGTH + 1];
+
+    z_stream compressor;      /* Output compression, once negotiated */
+    int compressing = 0;
+
+    clientsConnected++;
+
+    /* Process the client's queries */
+    for (uint64_t readStart = profileClock(); fgets(queryLine, sizeof(queryLine), clientInput) != NULL; readStart = profileClock())
+    {
+        atomic_fetch_add_explicit(&stageTicks[STAGE_READ], profileClock() - readStart, memory_order_relaxed);
+
+        /* PING answers with the status line without scanning the records */
+        if (strcmp(queryLine, "PING\n") == 0 || strcmp(queryLine, "PING\r\n") == 0)
+        {
+            char status[256];
+            int statusLength = formatStatus(status, sizeof(status));
+
+            /* The blank line ends the response as it does for lookups */
+            status[statusLength++] = '\n';
+            status[statusLength] = '\0';
+            sendResponse(clientSocket, compressing ? &compressor : NULL, status);
+            if (shutdownRequested)
+                break;
+            continue;
+        }
+
+        /* COMPRESS <codec> switches the rest of the connection's output */
+        if (strncmp(queryLine, "COMPRESS ", 9) == 0)
+        {
+            queryLine[strcspn(queryLine, "\r\n")] = '\0';
+            negotiateCompression(clientSocket, queryLine + 9, &compressor, &compressing);
+            continue;
+        }
+
+        /* MGET k1 k2 ... answers many keys with one pass over the records */
+        if (strncmp(queryLine, "MGET ", 5) == 0)
+        {
+            char *command = readWholeLine(clientInput, queryLine);
+
+            if (!command)
+            {
+                sendResponse(clientSocket, compressing ? &compressor : NULL, "ERROR MGET line too long\n\n");
+                continue;
+            }
+            queriesInFlight++;
+            lookupKeys(clientSocket, compressing ? &compressor : NULL, command + 5);
+            queriesInFlight--;
+            queriesServed++;
+            free(command);
+            if (shutdownRequested)
+                break;
+            continue;
+        }
+
+        /* SORT <field> <key> returns the matches ordered by a field */
+        if (strncmp(queryLine, "SORT ", 5) == 0)
+        {
+            char *fieldName = queryLine + 5;
+
+            queryLine[strcspn(queryLine, "\r\n")] = '\0';
+            char *key = fieldName + strcspn(fieldName, " ");
+            if (*key)
+                *key++ = '\0';
+            strncpy(searchKey, key, sizeof(searchKey) - 1);
+            searchKey[sizeof(searchKey) - 1] = '\0';
+
+            queriesInFlight++;
+            lookupSorted(clientSocket, compressing ? &compressor : NULL, fieldName, searchKey);
+            queriesInFlight--;
+            queriesServed++;
+            if (shutdownRequested)
+                break;
+            continue;
+        }
+
+        /* WATCH <key> hands the connection to the watcher thread */
+        if (strncmp(queryLine, "WATCH ", 6) == 0)
+        {
+            queryLine[strcspn(queryLine, "\r\n")] = '\0';
+            strncpy(searchKey, queryLine + 6, sizeof(searchKey) - 1);
+            searchKey[sizeof(searchKey) - 1] = '\0';
+
+            queriesInFlight++;
+            int watching = watchKey(clientSocket, compressing ? &compressor : NULL, searchKey) == 0;
+            queriesInFlight--;
+            queriesServed++;
+            if (watching || shutdownRequested)
+                break;
+            continue;
+        }
+
+        /* =name and ^prefix match whole names rather than substrings */
+        if (queryLine[0] == '=' || queryLine[0] == '^')
+        {
+            char name[MDB_SCHEMA_MAX_WIDTH];
+            size_t nameWidth = schema.fields[0].width;
+
+            queryLine[strcspn(queryLine, "\r\n")] = '\0';
+            strncpy(name, queryLine + 1, nameWidth - 1);
+            name[nameWidth - 1] = '\0';
+
+            queriesInFlight++;
+            lookupName(clientSocket, compressing ? &compressor : NULL, name, queryLine[0] == '^');
+            queriesInFlight--;
+            queriesServed++;
+            if (shutdownRequested)
+                break;
+            continue;
+        }
+
+        /* ~key matches regardless of case; the key is folded, then cut to
+         * MAX_KEY_LENGTH bytes without splitting a character */
+        if (queryLine[0] == '~')
+        {
+            char *key = queryLine + 1;
+
+            if (!foldedRecords)
+            {
+                sendResponse(clientSocket, compressing ? &compressor : NULL, "ERROR case-insensitive matching needs -I\n\n");
+                continue;
+            }
+            size_t keyLength = mdbFoldUtf8(key, key, strcspn(key, "\r\n"));
+            key[keyLength] = '\0';
+            if (keyLength > MAX_KEY_LENGTH)
+                key[mdbUtf8Boundary(key, MAX_KEY_LENGTH)] = '\0';
+
+            queriesInFlight++;
+            lookupFoldedKey(clientSocket, compressing ? &compressor : NULL, key);
+            queriesInFlight--;
+            queriesServed++;
+            if (shutdownRequested)
+                break;
+            continue;
+        }
+
+        /* #n and #first-last fetch records by number */
+        size_t first, last;
+        int range = parseRecordRange(queryLine, &first, &last);
+        if (range < 0)
+        {
+            sendResponse(clientSocket, compressing ? &compressor : NULL, "ERROR invalid record range\n\n");
+            continue;
+        }
+        if (range)
+        {
+            queriesInFlight++;
+            sendRecordRange(clientSocket, compressing ? &compressor : NULL, first, last);
+            queriesInFlight--;
+            queriesServed++;
+            if (shutdownRequested)
+                break;
+            continue;
+        }
+
+        /* Extract the search key and remove any newline character */
+        strncpy(searchKey, queryLine, sizeof(searchKey) - 1);
+        searchKey[sizeof(searchKey) - 1] = '\0';
+        searchKey[strcspn(searchKey, "\n")] = '\0';
+
+        /* Search the records and send the matches */
+        queriesInFlight++;
+        lookupKey(clientSocket, compressing ? &compressor : NULL, searchKey);
+        queriesInFlight--;
+        queriesServed++;
+
+        /* The in-flight query is done; take no new ones while shutting down */
+        if (shutdownRequested)
+            break;
+    }
+
+    /* Check if fgets() failed while reading from the client */
+    if (ferror(clientInput) && !(errno == EINTR && shutdownRequested)) 
+        perror("fgets() failed");
+
+    clientsConnected--;
 
-    /* Cleanup: free all dynamically allocated records */
-    traverseList(&recordList, &free);
-    removeAllNodes(&recordList);
+    if (compressing)
+        deflateEnd(&compressor);
 
-    /* Close the database file and socket */
-    fclose(filePointer);
+    /* Close the socket */
     fclose(clientInput);
 }
@@ -0,0 +1,175 @@
+/*
+ * mdb-lookup.c
+ *
+ * Command-line client for mdb-lookup-server, built on mdb-lookup-client.
+ *
+ * Example usage:
+ *   ./mdb-lookup localhost:8080 alice bob      (both queries pipelined)
+ *   ./mdb-lookup -z db1:8080,db2:8080 alice    (fanned out, compressed)
+ *   ./mdb-lookup localhost:8080 < keys.txt     (one key per line)
+ *   ./mdb-lookup -H 20,5 r1:8080,r2:8080 alice (replicas, hedged after 20 ms)
+ *
+ * Results are printed in the server's own format. When several servers
+ * are given, each line is prefixed with the server it came from, unless
+ * they are replicas queried with -H.
+ */
+
+#include "mdb-lookup-client.h"
+
+#include <stdio.h>      /* for printf() and fgets() */
+#include <stdlib.h>     /* for atoi() and exit() */
+#include <string.h>     /* for strchr(), strdup() and strtok() */
+#include <unistd.h>     /* for getopt() */
+
+#define MAX_SERVERS 64
+#define MAX_KEY_LINE 1000
+#define DEFAULT_HEDGE_BUDGET 10  /* Percent of queries that may be hedged */
+
+struct Servers {
+    struct MdbPool *pools[MAX_SERVERS];
+    const char *names[MAX_SERVERS];
+    int count;
+    struct MdbHedge *hedge;     /* -H: the servers are replicas */
+};
+
+/* Print a result line, labelled with its server when fanning out */
+static void printResult(void *context, int source, const struct MdbResult *result)
+{
+    struct Servers *servers = (struct Servers *)context;
+
+    if (!result)
+        return;
+    if (servers->count > 1)
+        printf("[%s] ", servers->names[source]);
+    fwrite(result->line, 1, result->lineLength, stdout);
+}
+
+/* Print pipelined results, with the blank line that ends each one */
+static void printPipelined(void *context, int source, const struct MdbResult *result)
+{
+    (void)context;
+    (void)source;
+
+    if (result)
+        fwrite(result->line, 1, result->lineLength, stdout);
+    else
+        printf("\n");
+}
+
+static void usage(const char *program)
+{
+    fprintf(stderr, "Usage:  %s [-z] [-n connections] [-H delay_ms[,budget_percent]] <host:port>[,<host:port>...] [key...]\n", program);
+    exit(1);
+}
+
+/* Run one key against every server */
+static int lookup(struct Servers *servers, const char *key)
+{
+    int lines;
+
+    if (servers->hedge)
+        lines = mdbHedgedLookup(servers->pools, servers->count, servers->hedge, key, printPipelined, NULL);
+    else if (servers->count == 1)
+        lines = mdbLookup(servers->pools[0], key, printPipelined, servers);
+    else
+    {
+        lines = mdbFanOut(servers->pools, servers->count, key, printResult, servers);
+        printf("\n");
+    }
+    fflush(stdout);
+    return lines;
+}
+
+int main(int argc, char *argv[])
+{
+    struct Servers servers = { .count = 0 };
+    int flags = 0, connections = 1;
+    int option, failed = 0;
+    int hedgeDelay = -1, hedgeBudget = DEFAULT_HEDGE_BUDGET;
+
+    while ((option = getopt(argc, argv, "zn:H:")) != -1)
+    {
+        switch (option)
+        {
+        case 'z':
+            flags |= MDB_POOL_COMPRESS;
+            break;
+        case 'n':
+            connections = atoi(optarg);
+            break;
+        case 'H':
+            hedgeDelay = atoi(optarg);
+            if (strchr(optarg, ','))
+                hedgeBudget = atoi(strchr(optarg, ',') + 1);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind >= argc)
+        usage(argv[0]);
+
+    /* host:port[,host:port...] */
+    for (char *server = strtok(argv[optind++], ","); server; server = strtok(NULL, ","))
+    {
+        char *colon = strrchr(server, ':');
+        if (!colon || servers.count == MAX_SERVERS)
+            usage(argv[0]);
+        servers.names[servers.count] = strdup(server);
+        *colon = '\0';
+        servers.pools[servers.count] = mdbPoolCreate(server, colon + 1, connections, flags);
+        if (!servers.pools[servers.count])
+        {
+            perror("mdbPoolCreate() failed");
+            exit(1);
+        }
+        servers.count++;
+    }
+
+    if (hedgeDelay >= 0 && (servers.hedge = mdbHedgeCreate(hedgeDelay, hedgeBudget / 100.0)) == NULL)
+    {
+        perror("mdbHedgeCreate() failed");
+        exit(1);
+    }
+
+    if (optind < argc && servers.count == 1 && !servers.hedge)
+    {
+        /* Keys on the command line go out together on one connection */
+        failed = mdbPipeline(servers.pools[0], (const char *const *)&argv[optind], argc - optind, printPipelined, NULL) < 0;
+    }
+    else if (optind < argc)
+    {
+        for (int i = optind; i < argc && !failed; i++)
+            failed = lookup(&servers, argv[i]) < 0;
+    }
+    else
+    {
+        char key[MAX_KEY_LINE];
+
+        while (!failed && fgets(key, sizeof(key), stdin))
+        {
+            char *newline = strchr(key, '\n');
+            if (newline)
+                *newline = '\0';
+            failed = lookup(&servers, key) < 0;
+        }
+    }
+    fflush(stdout);
+    if (failed)
+        perror("lookup failed");
+
+    if (servers.hedge)
+    {
+        unsigned long queries, hedged, hedgeWins;
+        mdbHedgeStats(servers.hedge, &queries, &hedged, &hedgeWins);
+        fprintf(stderr, "queries=%lu hedged=%lu hedge_wins=%lu\n", queries, hedged, hedgeWins);
+        mdbHedgeDestroy(servers.hedge);
+    }
+
+    for (int i = 0; i < servers.count; i++)
+    {
+        mdbPoolDestroy(servers.pools[i]);
+        free((char *)servers.names[i]);
+    }
+    return failed;
+}
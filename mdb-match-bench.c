@@ -0,0 +1,180 @@
+/*
+ * mdb-match-bench.c
+ *
+ * Compares the key-length specialized match kernels of mdb-match.h with
+ * the general memmem() they replace, scanning a database file in memory
+ * the way mdb-lookup-server does.
+ *
+ * Example usage:
+ *   ./mdb-match-bench database.mdb 8 20
+ *
+ * For every key length from 1 to <max key length> (default 8), the given
+ * number of keys (default 20) is cut from random records, and each key is
+ * searched in every record with both. The report gives nanoseconds per
+ * record for each and the speedup; the match counts must agree.
+ */
+
+#define _GNU_SOURCE     /* for memmem() */
+
+#include "mdb.h"
+#include "mdb-match.h"
+
+#include <stdio.h>      /* for printf() and fprintf() */
+#include <stdlib.h>     /* for atoi(), exit() and rand() */
+#include <string.h>     /* for memmem() and strlen() */
+#include <time.h>       /* for clock_gettime() */
+
+#define MAX_BENCH_KEY 64
+
+/* Field lengths as the server computes them at load time */
+struct FieldLengths {
+    unsigned char name;
+    unsigned char msg;
+};
+
+static void terminate(const char *message)
+{
+    perror(message);
+    exit(1);
+}
+
+static double secondsSince(const struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static int memmemMatches(const char *field, size_t fieldLength, const char *key, size_t keyLength)
+{
+    return memmem(field, fieldLength, key, keyLength) != NULL;
+}
+
+/* The scan loop of the server, with the kernel inlined into it */
+static inline __attribute__((always_inline)) size_t countWith(MdbMatcher match, const struct MdbRec *records, const struct FieldLengths *lengths,
+                                                              size_t recordCount, const char *key, size_t keyLength)
+{
+    size_t matches = 0;
+
+    for (size_t i = 0; i < recordCount; i++)
+        matches += (lengths[i].name >= keyLength && match(records[i].name, lengths[i].name, key, keyLength)) ||
+                   (lengths[i].msg >= keyLength && match(records[i].msg, lengths[i].msg, key, keyLength));
+    return matches;
+}
+
+static size_t countGeneral(const struct MdbRec *records, const struct FieldLengths *lengths, size_t recordCount, const char *key, size_t keyLength)
+{
+    return countWith(memmemMatches, records, lengths, recordCount, key, keyLength);
+}
+
+static size_t countSpecialized(const struct MdbRec *records, const struct FieldLengths *lengths, size_t recordCount, const char *key, size_t keyLength)
+{
+    switch (keyLength)
+    {
+    case 1:
+        return countWith(mdbMatch1, records, lengths, recordCount, key, keyLength);
+    case 2:
+        return countWith(mdbMatch2, records, lengths, recordCount, key, keyLength);
+    case 3:
+        return countWith(mdbMatch3, records, lengths, recordCount, key, keyLength);
+    case 4:
+        return countWith(mdbMatch4, records, lengths, recordCount, key, keyLength);
+    default:
+        return countWith(mdbMatchLong, records, lengths, recordCount, key, keyLength);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2 || argc > 4)
+    {
+        fprintf(stderr, "Usage:  %s <database_file> [max key length] [keys per length]\n", argv[0]);
+        exit(1);
+    }
+    int maxKeyLength = argc > 2 ? atoi(argv[2]) : 8;
+    int keysPerLength = argc > 3 ? atoi(argv[3]) : 20;
+    if (maxKeyLength < 1 || maxKeyLength > MAX_BENCH_KEY || keysPerLength < 1)
+    {
+        fprintf(stderr, "Key lengths run from 1 to at most %d\n", MAX_BENCH_KEY);
+        exit(1);
+    }
+
+    /* Load the records and terminate their fields as the server does */
+    FILE *databaseFile = fopen(argv[1], "rb");
+    if (!databaseFile)
+        terminate(argv[1]);
+    fseek(databaseFile, 0, SEEK_END);
+    size_t recordCount = ftell(databaseFile) / sizeof(struct MdbRec);
+    rewind(databaseFile);
+    struct MdbRec *records = (struct MdbRec *)malloc((recordCount + 1) * sizeof(struct MdbRec));
+    struct FieldLengths *lengths = (struct FieldLengths *)malloc((recordCount + 1) * sizeof(struct FieldLengths));
+    if (!records || !lengths)
+        terminate("malloc() failed");
+    if (fread(records, sizeof(struct MdbRec), recordCount, databaseFile) != recordCount)
+        terminate("fread() failed");
+    fclose(databaseFile);
+    for (size_t i = 0; i < recordCount; i++)
+    {
+        records[i].name[sizeof(records[i].name) - 1] = '\0';
+        records[i].msg[sizeof(records[i].msg) - 1] = '\0';
+        lengths[i].name = strlen(records[i].name);
+        lengths[i].msg = strlen(records[i].msg);
+    }
+    if (recordCount == 0)
+    {
+        fprintf(stderr, "No records\n");
+        exit(1);
+    }
+
+    printf("%zu records, %d keys per length\n", recordCount, keysPerLength);
+    printf("%-6s %12s %12s %12s %8s\n", "length", "matches", "memmem_ns", "kernel_ns", "speedup");
+    srand(1);
+    for (int keyLength = 1; keyLength <= maxKeyLength; keyLength++)
+    {
+        double generalSeconds = 0, specializedSeconds = 0;
+        size_t totalMatches = 0;
+        int keys = 0;
+
+        for (int attempt = 0; keys < keysPerLength && attempt < keysPerLength * 100; attempt++)
+        {
+            /* A key cut from a random field, so that it matches something */
+            const struct MdbRec *record = &records[rand() % recordCount];
+            const char *field = rand() % 2 ? record->name : record->msg;
+            size_t fieldLength = strlen(field);
+            char key[MAX_BENCH_KEY + 1];
+
+            if (fieldLength < (size_t)keyLength)
+                continue;
+            memcpy(key, field + rand() % (fieldLength - keyLength + 1), keyLength);
+            key[keyLength] = '\0';
+            keys++;
+
+            struct timespec start;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            size_t general = countGeneral(records, lengths, recordCount, key, keyLength);
+            generalSeconds += secondsSince(&start);
+
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            size_t specialized = countSpecialized(records, lengths, recordCount, key, keyLength);
+            specializedSeconds += secondsSince(&start);
+
+            if (general != specialized)
+            {
+                fprintf(stderr, "Key {%s}: memmem() found %zu records, the kernel %zu\n", key, general, specialized);
+                exit(1);
+            }
+            totalMatches += general;
+        }
+        if (keys == 0)
+        {
+            printf("%-6d no field is that long\n", keyLength);
+            continue;
+        }
+
+        double scanned = (double)recordCount * keys;
+        printf("%-6d %12zu %12.2f %12.2f %7.2fx\n", keyLength, totalMatches / keys,
+               generalSeconds * 1e9 / scanned, specializedSeconds * 1e9 / scanned, generalSeconds / specializedSeconds);
+    }
+    return 0;
+}
@@ -0,0 +1,153 @@
+/*
+ * mdb-match.h
+ *
+ * Substring search kernels specialized by key length, for the short keys
+ * and short fixed-size fields of the database. A query picks its kernel
+ * once, by key length, instead of running a general memmem() on every
+ * field:
+ *   - 1 byte: memchr()
+ *   - 2 to 4 bytes: the key packed into an integer, compared against an
+ *     unaligned load at each position of the field
+ *   - longer keys: SSE2 compares the first and last key byte against 16
+ *     positions at once, and only the positions where both agree get a
+ *     full compare; the rest of the field, and all of it without SSE2,
+ *     compares the key's first 4 bytes as an integer
+ *
+ * The kernels are static inline so that a caller which selects one by a
+ * constant key length gets it inlined into its loop.
+ *
+ * Every kernel may read the byte just after the field, which is there as
+ * its terminating NUL; fieldLength must be at least keyLength.
+ */
+
+#ifndef MDB_MATCH_H
+#define MDB_MATCH_H
+
+#include <stdint.h>     /* for uint32_t */
+#include <string.h>     /* for memchr(), memcmp() and memcpy() */
+#ifdef __SSE2__
+#include <emmintrin.h>  /* for _mm_cmpeq_epi8() */
+#endif
+
+/* Nonzero if key occurs in field[0..fieldLength) */
+typedef int (*MdbMatcher)(const char *field, size_t fieldLength, const char *key, size_t keyLength);
+
+/* The empty key is in every field */
+static inline int mdbMatchEmpty(const char *field, size_t fieldLength, const char *key, size_t keyLength)
+{
+    (void)field;
+    (void)fieldLength;
+    (void)key;
+    (void)keyLength;
+    return 1;
+}
+
+static inline int mdbMatch1(const char *field, size_t fieldLength, const char *key, size_t keyLength)
+{
+    (void)keyLength;
+    return memchr(field, key[0], fieldLength) != NULL;
+}
+
+static inline int mdbMatch2(const char *field, size_t fieldLength, const char *key, size_t keyLength)
+{
+    uint16_t packed, window;
+
+    (void)keyLength;
+    memcpy(&packed, key, 2);
+    for (size_t i = 0; i + 2 <= fieldLength; i++)
+    {
+        memcpy(&window, field + i, 2);
+        if (window == packed)
+            return 1;
+    }
+    return 0;
+}
+
+/* Loads 4 bytes and masks off the one after the window; at the last
+ * position that is the field's NUL */
+static inline int mdbMatch3(const char *field, size_t fieldLength, const char *key, size_t keyLength)
+{
+    uint32_t packed = 0, window, mask;
+    const uint32_t probe = 1;
+
+    (void)keyLength;
+    memcpy(&packed, key, 3);
+    mask = *(const unsigned char *)&probe ? 0x00ffffffu : 0xffffff00u;   /* The first 3 bytes in memory */
+    for (size_t i = 0; i + 3 <= fieldLength; i++)
+    {
+        memcpy(&window, field + i, 4);
+        if ((window & mask) == packed)
+            return 1;
+    }
+    return 0;
+}
+
+static inline int mdbMatch4(const char *field, size_t fieldLength, const char *key, size_t keyLength)
+{
+    uint32_t packed, window;
+
+    (void)keyLength;
+    memcpy(&packed, key, 4);
+    for (size_t i = 0; i + 4 <= fieldLength; i++)
+    {
+        memcpy(&window, field + i, 4);
+        if (window == packed)
+            return 1;
+    }
+    return 0;
+}
+
+/* Keys of 5 bytes or more */
+static inline int mdbMatchLong(const char *field, size_t fieldLength, const char *key, size_t keyLength)
+{
+    size_t i = 0;
+    uint32_t packed, window;
+
+#ifdef __SSE2__
+    const __m128i first = _mm_set1_epi8(key[0]);
+    const __m128i last = _mm_set1_epi8(key[keyLength - 1]);
+
+    /* Both loads stay within the field */
+    for (; i + keyLength + 15 <= fieldLength; i += 16)
+    {
+        __m128i firstBytes = _mm_loadu_si128((const __m128i *)(field + i));
+        __m128i lastBytes = _mm_loadu_si128((const __m128i *)(field + i + keyLength - 1));
+        unsigned candidates = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(firstBytes, first), _mm_cmpeq_epi8(lastBytes, last)));
+
+        for (; candidates; candidates &= candidates - 1)
+            if (memcmp(field + i + __builtin_ctz(candidates) + 1, key + 1, keyLength - 2) == 0)
+                return 1;
+    }
+#endif
+
+    memcpy(&packed, key, 4);
+    for (; i + keyLength <= fieldLength; i++)
+    {
+        memcpy(&window, field + i, 4);
+        if (window == packed && memcmp(field + i + 4, key + 4, keyLength - 4) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+/* The kernel for keys of keyLength bytes */
+static inline MdbMatcher mdbSelectMatcher(size_t keyLength)
+{
+    switch (keyLength)
+    {
+    case 0:
+        return mdbMatchEmpty;
+    case 1:
+        return mdbMatch1;
+    case 2:
+        return mdbMatch2;
+    case 3:
+        return mdbMatch3;
+    case 4:
+        return mdbMatch4;
+    default:
+        return mdbMatchLong;
+    }
+}
+
+#endif /* MDB_MATCH_H */
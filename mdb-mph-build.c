@@ -0,0 +1,282 @@
+/*
+ * mdb-mph-build.c
+ *
+ * Builds the minimal perfect hash side file that mdb-lookup-server maps
+ * with -e for exact-name queries ("=name"). See mdb-mph.h for the method
+ * and the layout.
+ *
+ * Example usage:
+ *   ./mdb-mph-build database.mdb database.mdb.mph
+ *   ./mdb-mph-build -f name:32,msg:128 other.mdb other.mdb.mph
+ *
+ * The side file describes the database as it is when built, and records
+ * its size, modification time and a checksum of its first and last
+ * records. The server ignores a side file that no longer matches, so
+ * rebuild it after the file is rewritten; records appended later are
+ * still found by the server, which compares their names directly. -f gives the record
+ * layout as for the server (see mdb-schema.h); the hash is over the first
+ * field.
+ */
+
+#include "mdb-mph.h"
+#include "mdb-schema.h"
+
+#include <stdio.h>      /* for printf() and fprintf() */
+#include <stdlib.h>     /* for malloc(), qsort() and exit() */
+#include <string.h>     /* for memcmp() and memset() */
+#include <unistd.h>     /* for close() and getopt() */
+#include <fcntl.h>      /* for open() */
+#include <sys/mman.h>   /* for mmap() */
+#include <sys/stat.h>   /* for fstat() */
+
+#define MPH_GAMMA 2.0       /* Bits per remaining key in each level */
+#define MAX_SEEDS 16        /* Seeds tried before giving up on a key set */
+
+static const char *records;
+static struct MdbSchema schema;
+
+/* Name of a record: its first field */
+static const char *recordName(uint32_t record)
+{
+    return records + (size_t)record * schema.recordSize + schema.fields[0].offset;
+}
+
+/* Name length as the server sees it: an unterminated name loses its last byte */
+static size_t nameLength(uint32_t record)
+{
+    const char *end = memchr(recordName(record), '\0', schema.fields[0].width);
+    return end ? (size_t)(end - recordName(record)) : schema.fields[0].width - 1;
+}
+
+static void terminate(const char *message)
+{
+    perror(message);
+    exit(1);
+}
+
+/* Order record numbers by name, then by number */
+static int compareByName(const void *left, const void *right)
+{
+    uint32_t a = *(const uint32_t *)left, b = *(const uint32_t *)right;
+    size_t aLength = nameLength(a), bLength = nameLength(b);
+    int order = memcmp(recordName(a), recordName(b), aLength < bLength ? aLength : bLength);
+
+    if (order)
+        return order;
+    if (aLength != bLength)
+        return aLength < bLength ? -1 : 1;
+    return a < b ? -1 : a > b;
+}
+
+/*
+ * Build the levels for the keys, each given by its first record, and the
+ * rank samples. Returns 0, or -1 if some keys still collide at the last
+ * level, in which case the caller tries another seed.
+ */
+static int buildLevels(struct MdbMphHeader *header, uint64_t **bits, uint32_t **ranks, const uint32_t *keyRecords, size_t keyCount)
+{
+    uint32_t *remaining = (uint32_t *)malloc((keyCount + 1) * sizeof(uint32_t));
+    uint64_t *hashes = (uint64_t *)malloc((keyCount + 1) * sizeof(uint64_t));
+    size_t remainingCount = keyCount;
+    uint64_t *levelBits = NULL;
+
+    if (!remaining || !hashes)
+        terminate("malloc() failed");
+    for (size_t i = 0; i < keyCount; i++)
+    {
+        remaining[i] = i;
+        hashes[i] = mdbMphHashKey(recordName(keyRecords[i]), nameLength(keyRecords[i]), header->seed);
+    }
+
+    *bits = NULL;
+    header->bitCount = 0;
+    header->levelCount = 0;
+    while (remainingCount > 0 && header->levelCount < MDB_MPH_MAX_LEVELS)
+    {
+        /* Whole rank samples, so the levels tile the bits without padding */
+        uint64_t size = ((uint64_t)(remainingCount * MPH_GAMMA) + MDB_MPH_RANK_BITS - 1) / MDB_MPH_RANK_BITS * MDB_MPH_RANK_BITS;
+        uint64_t *collided = (uint64_t *)calloc(size / 64, sizeof(uint64_t));
+        uint32_t level = header->levelCount;
+
+        if ((*bits = (uint64_t *)realloc(*bits, (header->bitCount + size) / 8)) == NULL || !collided)
+            terminate("malloc() failed");
+        levelBits = *bits + header->bitCount / 64;
+        memset(levelBits, 0, size / 8);
+
+        /* A bit set twice is a collision; its keys go to the next level */
+        for (size_t i = 0; i < remainingCount; i++)
+        {
+            uint64_t position = mdbMphPosition(hashes[remaining[i]], level, size);
+            if (levelBits[position / 64] & (1ULL << (position % 64)))
+                collided[position / 64] |= 1ULL << (position % 64);
+            levelBits[position / 64] |= 1ULL << (position % 64);
+        }
+        for (uint64_t word = 0; word < size / 64; word++)
+            levelBits[word] &= ~collided[word];
+
+        size_t kept = 0;
+        for (size_t i = 0; i < remainingCount; i++)
+        {
+            uint64_t position = mdbMphPosition(hashes[remaining[i]], level, size);
+            if (collided[position / 64] & (1ULL << (position % 64)))
+                remaining[kept++] = remaining[i];
+        }
+        remainingCount = kept;
+        free(collided);
+
+        header->levelStart[level] = header->bitCount;
+        header->bitCount += size;
+        header->levelStart[level + 1] = header->bitCount;
+        header->levelCount++;
+    }
+    free(remaining);
+    free(hashes);
+    if (remainingCount > 0)
+        return -1;
+
+    /* Count the set bits before each rank sample */
+    size_t rankCount = header->bitCount / MDB_MPH_RANK_BITS + 1;
+    if ((*ranks = (uint32_t *)malloc(rankCount * sizeof(uint32_t))) == NULL)
+        terminate("malloc() failed");
+    uint32_t count = 0;
+    for (size_t sample = 0; sample < rankCount; sample++)
+    {
+        (*ranks)[sample] = count;
+        for (size_t word = sample * (MDB_MPH_RANK_BITS / 64); word < (sample + 1) * (MDB_MPH_RANK_BITS / 64) && word < header->bitCount / 64; word++)
+            count += __builtin_popcountll((*bits)[word]);
+    }
+    return 0;
+}
+
+static void writeAll(FILE *output, const void *data, size_t length)
+{
+    if (length && fwrite(data, 1, length, output) != length)
+        terminate("fwrite() failed");
+}
+
+int main(int argc, char *argv[])
+{
+    uint32_t seed = 0;
+    int option;
+
+    mdbSchemaDefault(&schema);
+    while ((option = getopt(argc, argv, "s:f:")) != -1)
+    {
+        if (option == 's')
+            seed = strtoul(optarg, NULL, 0);
+        else if (option != 'f' || mdbSchemaParse(&schema, optarg) < 0)
+            argc = 0;
+    }
+    if (argc - optind != 2)
+    {
+        fprintf(stderr, "Usage:  %s [-s seed] [-f field:width,...] <database_file> <side_file>\n", argv[0]);
+        exit(1);
+    }
+    const char *databaseFile = argv[optind];
+    const char *sideFile = argv[optind + 1];
+
+    /* Map the database; a trailing partial record is ignored like the server does */
+    int fileDescriptor = open(databaseFile, O_RDONLY);
+    struct stat fileStat;
+    if (fileDescriptor < 0 || fstat(fileDescriptor, &fileStat) < 0)
+        terminate(databaseFile);
+    size_t recordCount = fileStat.st_size / schema.recordSize;
+    if (recordCount > UINT32_MAX)
+    {
+        fprintf(stderr, "Too many records for 32-bit record numbers\n");
+        exit(1);
+    }
+    if (recordCount)
+    {
+        records = mmap(NULL, recordCount * schema.recordSize, PROT_READ, MAP_PRIVATE, fileDescriptor, 0);
+        if (records == MAP_FAILED)
+            terminate("mmap() failed");
+    }
+    uint64_t sampleChecksum;
+    if (mdbMphSampleChecksum(fileDescriptor, schema.recordSize, recordCount, &sampleChecksum) < 0)
+        terminate(databaseFile);
+    close(fileDescriptor);
+
+    /* Record numbers grouped by name, in file order within each name */
+    uint32_t *sorted = (uint32_t *)malloc((recordCount + 1) * sizeof(uint32_t));
+    uint32_t *keyStart = (uint32_t *)malloc((recordCount + 2) * sizeof(uint32_t));
+    uint32_t *keyRecords = (uint32_t *)malloc((recordCount + 1) * sizeof(uint32_t));
+    if (!sorted || !keyStart || !keyRecords)
+        terminate("malloc() failed");
+    for (size_t i = 0; i < recordCount; i++)
+        sorted[i] = i;
+    qsort(sorted, recordCount, sizeof(uint32_t), compareByName);
+
+    size_t keyCount = 0;
+    for (size_t i = 0; i < recordCount; i++)
+    {
+        if (i == 0 || nameLength(sorted[i]) != nameLength(sorted[i - 1]) ||
+            memcmp(recordName(sorted[i]), recordName(sorted[i - 1]), nameLength(sorted[i])) != 0)
+        {
+            keyStart[keyCount] = i;
+            keyRecords[keyCount++] = sorted[i];
+        }
+    }
+    keyStart[keyCount] = recordCount;
+
+    struct MdbMphHeader header;
+    uint64_t *bits = NULL;
+    uint32_t *ranks = NULL;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MDB_MPH_MAGIC, sizeof(MDB_MPH_MAGIC));
+    header.recordCount = recordCount;
+    header.databaseSize = fileStat.st_size;
+    header.databaseMtime = fileStat.st_mtime;
+    header.sampleChecksum = sampleChecksum;
+    header.keyCount = keyCount;
+    for (header.seed = seed; ; header.seed++)
+    {
+        if (buildLevels(&header, &bits, &ranks, keyRecords, keyCount) == 0)
+            break;
+        if (header.seed - seed + 1 >= MAX_SEEDS)
+        {
+            fprintf(stderr, "Keys still collide after %d seeds\n", MAX_SEEDS);
+            exit(1);
+        }
+        free(bits);
+    }
+
+    /* Each key's records at its index */
+    struct MdbMph mph = { .header = &header, .bits = bits, .ranks = ranks };
+    uint32_t *offsets = (uint32_t *)calloc(keyCount + 1, sizeof(uint32_t));
+    uint32_t *indexRecords = (uint32_t *)malloc((recordCount + 1) * sizeof(uint32_t));
+    uint32_t *indexOf = (uint32_t *)malloc((keyCount + 1) * sizeof(uint32_t));
+    if (!offsets || !indexRecords || !indexOf)
+        terminate("malloc() failed");
+    for (size_t key = 0; key < keyCount; key++)
+    {
+        indexOf[key] = mdbMphIndex(&mph, recordName(keyRecords[key]), nameLength(keyRecords[key]));
+        offsets[indexOf[key] + 1] = keyStart[key + 1] - keyStart[key];
+    }
+    for (size_t index = 0; index < keyCount; index++)
+        offsets[index + 1] += offsets[index];
+    for (size_t key = 0; key < keyCount; key++)
+        memcpy(indexRecords + offsets[indexOf[key]], sorted + keyStart[key], (keyStart[key + 1] - keyStart[key]) * sizeof(uint32_t));
+
+    /* Write next to the target and rename, so a server never maps half a file */
+    char temporary[4096];
+    snprintf(temporary, sizeof(temporary), "%s.tmp", sideFile);
+    FILE *output = fopen(temporary, "wb");
+    if (!output)
+        terminate(temporary);
+    writeAll(output, &header, sizeof(header));
+    writeAll(output, bits, header.bitCount / 8);
+    writeAll(output, ranks, (header.bitCount / MDB_MPH_RANK_BITS + 1) * sizeof(uint32_t));
+    writeAll(output, offsets, (keyCount + 1) * sizeof(uint32_t));
+    writeAll(output, indexRecords, recordCount * sizeof(uint32_t));
+    if (fclose(output) != 0)
+        terminate("fclose() failed");
+    if (rename(temporary, sideFile) < 0)
+        terminate("rename() failed");
+
+    printf("%zu records, %zu names, %u levels, %.2f bits per name for the hash (seed %u)\n",
+           recordCount, keyCount, header.levelCount,
+           keyCount ? (double)(header.bitCount + (header.bitCount / MDB_MPH_RANK_BITS + 1) * 32) / keyCount : 0.0,
+           header.seed);
+    return 0;
+}
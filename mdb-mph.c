@@ -0,0 +1,211 @@
+/*
+ * mdb-mph.c
+ *
+ * Minimal perfect hash side files for exact-name lookups; see mdb-mph.h
+ * for the method and the file layout.
+ */
+
+#include "mdb-mph.h"
+
+#include <errno.h>      /* for errno */
+#include <fcntl.h>      /* for open() */
+#include <string.h>     /* for memcmp() */
+#include <sys/mman.h>   /* for mmap() */
+#include <sys/stat.h>   /* for fstat() */
+#include <stdlib.h>     /* for malloc() */
+#include <unistd.h>     /* for close() and pread() */
+
+/* splitmix64 finalizer: spreads every input bit over the output */
+static uint64_t mix(uint64_t x)
+{
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+uint64_t mdbMphHashKey(const char *key, size_t length, uint32_t seed)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL ^ seed;
+
+    for (size_t i = 0; i < length; i++)
+    {
+        hash ^= (unsigned char)key[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return mix(hash);
+}
+
+uint64_t mdbMphPosition(uint64_t keyHash, uint32_t level, uint64_t levelBits)
+{
+    uint64_t hash = mix(keyHash + (level + 1) * 0x9e3779b97f4a7c15ULL);
+    return (uint64_t)(((unsigned __int128)hash * levelBits) >> 64);
+}
+
+/* FNV-1a over length bytes of the file from offset on, continuing hash */
+static int checksumFileBytes(int fileDescriptor, off_t offset, size_t length, uint64_t *hash)
+{
+    unsigned char buffer[65536];
+
+    while (length > 0)
+    {
+        ssize_t bytesRead = pread(fileDescriptor, buffer, length < sizeof(buffer) ? length : sizeof(buffer), offset);
+        if (bytesRead <= 0)
+        {
+            if (bytesRead < 0 && errno == EINTR)
+                continue;
+            return -1;
+        }
+        for (ssize_t i = 0; i < bytesRead; i++)
+        {
+            *hash ^= buffer[i];
+            *hash *= 0x100000001b3ULL;
+        }
+        offset += bytesRead;
+        length -= bytesRead;
+    }
+    return 0;
+}
+
+int mdbMphSampleChecksum(int fileDescriptor, size_t recordSize, uint64_t recordCount, uint64_t *checksum)
+{
+    uint64_t head = recordCount < MDB_MPH_SAMPLE_RECORDS ? recordCount : MDB_MPH_SAMPLE_RECORDS;
+    uint64_t tailStart = recordCount - head > head ? recordCount - head : head;
+
+    *checksum = 0xcbf29ce484222325ULL;
+    if (checksumFileBytes(fileDescriptor, 0, head * recordSize, checksum) < 0 ||
+        checksumFileBytes(fileDescriptor, tailStart * recordSize, (recordCount - tailStart) * recordSize, checksum) < 0)
+        return -1;
+    return 0;
+}
+
+/* Offsets that start at 0, never decrease and end at the record count,
+ * records within the database, and levels that tile the bits */
+static int validLists(const struct MdbMph *mph)
+{
+    const struct MdbMphHeader *header = mph->header;
+
+    if (header->levelStart[0] != 0 || header->levelStart[header->levelCount] != header->bitCount)
+        return 0;
+    for (uint32_t level = 0; level < header->levelCount; level++)
+        if (header->levelStart[level] >= header->levelStart[level + 1] || header->levelStart[level + 1] % MDB_MPH_RANK_BITS != 0)
+            return 0;
+
+    if (mph->offsets[0] != 0 || mph->offsets[header->keyCount] != header->recordCount)
+        return 0;
+    for (uint64_t key = 0; key < header->keyCount; key++)
+        if (mph->offsets[key] > mph->offsets[key + 1])
+            return 0;
+    for (uint64_t i = 0; i < header->recordCount; i++)
+        if (mph->records[i] >= header->recordCount)
+            return 0;
+    return 1;
+}
+
+int mdbMphOpen(struct MdbMph *mph, const char *path)
+{
+    struct stat fileStat;
+    int fileDescriptor;
+    void *mapping;
+
+    memset(mph, 0, sizeof(*mph));
+    if ((fileDescriptor = open(path, O_RDONLY)) < 0)
+        return -1;
+    if (fstat(fileDescriptor, &fileStat) < 0)
+    {
+        close(fileDescriptor);
+        return -1;
+    }
+    if ((size_t)fileStat.st_size < sizeof(struct MdbMphHeader))
+    {
+        close(fileDescriptor);
+        errno = EINVAL;
+        return -1;
+    }
+    mapping = mmap(NULL, fileStat.st_size, PROT_READ, MAP_SHARED, fileDescriptor, 0);
+    close(fileDescriptor);
+    if (mapping == MAP_FAILED)
+        return -1;
+
+    /* Bound every count by the file size first, so the sum cannot overflow */
+    const struct MdbMphHeader *header = (const struct MdbMphHeader *)mapping;
+    uint64_t fileSize = fileStat.st_size;
+    size_t rankCount = header->bitCount / MDB_MPH_RANK_BITS + 1;
+
+    if (memcmp(header->magic, MDB_MPH_MAGIC, sizeof(MDB_MPH_MAGIC)) != 0 || header->levelCount > MDB_MPH_MAX_LEVELS ||
+        header->bitCount % MDB_MPH_RANK_BITS != 0 || header->bitCount / 8 > fileSize ||
+        header->keyCount > fileSize / sizeof(uint32_t) || header->recordCount > fileSize / sizeof(uint32_t) ||
+        header->keyCount > header->recordCount ||
+        fileSize != sizeof(*header) + header->bitCount / 8 + rankCount * sizeof(uint32_t) +
+                    (header->keyCount + 1 + header->recordCount) * sizeof(uint32_t))
+    {
+        munmap(mapping, fileStat.st_size);
+        errno = EINVAL;
+        return -1;
+    }
+
+    mph->header = header;
+    mph->bits = (const uint64_t *)(header + 1);
+    mph->ranks = (const uint32_t *)(mph->bits + header->bitCount / 64);
+    mph->offsets = mph->ranks + rankCount;
+    mph->records = mph->offsets + header->keyCount + 1;
+    mph->mappedLength = fileStat.st_size;
+    if (!validLists(mph))
+    {
+        mdbMphClose(mph);
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
+
+void mdbMphClose(struct MdbMph *mph)
+{
+    if (mph->header)
+        munmap((void *)mph->header, mph->mappedLength);
+    memset(mph, 0, sizeof(*mph));
+}
+
+/* Set bits before bit position: the sample, then whole words, then part of one */
+static uint64_t rank(const struct MdbMph *mph, uint64_t position)
+{
+    uint64_t count = mph->ranks[position / MDB_MPH_RANK_BITS];
+
+    for (uint64_t word = position / MDB_MPH_RANK_BITS * (MDB_MPH_RANK_BITS / 64); word < position / 64; word++)
+        count += __builtin_popcountll(mph->bits[word]);
+    if (position % 64)
+        count += __builtin_popcountll(mph->bits[position / 64] & ((1ULL << (position % 64)) - 1));
+    return count;
+}
+
+int64_t mdbMphIndex(const struct MdbMph *mph, const char *key, size_t length)
+{
+    const struct MdbMphHeader *header = mph->header;
+    uint64_t keyHash = mdbMphHashKey(key, length, header->seed);
+
+    for (uint32_t level = 0; level < header->levelCount; level++)
+    {
+        uint64_t levelBits = header->levelStart[level + 1] - header->levelStart[level];
+        uint64_t position = header->levelStart[level] + mdbMphPosition(keyHash, level, levelBits);
+
+        if (mph->bits[position / 64] & (1ULL << (position % 64)))
+            return rank(mph, position);
+    }
+    return -1;
+}
+
+const uint32_t *mdbMphFind(const struct MdbMph *mph, const char *key, size_t length, size_t *count)
+{
+    int64_t index = mdbMphIndex(mph, key, length);
+
+    /* The rank samples are not checked at open; an index past the keys
+     * can only come from a damaged file */
+    if (index < 0 || (uint64_t)index >= mph->header->keyCount)
+    {
+        *count = 0;
+        return NULL;
+    }
+    *count = mph->offsets[index + 1] - mph->offsets[index];
+    return mph->records + mph->offsets[index];
+}
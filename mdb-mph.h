@@ -0,0 +1,90 @@
+/*
+ * mdb-mph.h
+ *
+ * Minimal perfect hash from the distinct names of a database to the
+ * records carrying each name, built offline by mdb-mph-build and mapped
+ * by mdb-lookup-server (-e) for exact-name queries.
+ *
+ * The hash is BBHash: level l is a bit array of about twice as many bits
+ * as there are keys left, each key sets the bit its level-l hash picks,
+ * and keys that collide move on to the next level. A key's index is the
+ * number of set bits before its own, across all levels, so the n keys get
+ * the indexes 0 to n-1 at about 3.7 bits per key, plus a rank sample every
+ * 512 bits. The index selects a list of record numbers.
+ *
+ * A name that is not a key also maps to some index, so a caller checks
+ * that the records listed there do carry the name.
+ *
+ * The header ties the file to the database it was built from: its size,
+ * modification time, and a checksum of the file bytes of its first and
+ * last MDB_MPH_SAMPLE_RECORDS records. Every level is a whole number of
+ * rank samples long.
+ *
+ * File layout, all in host byte order:
+ *   struct MdbMphHeader
+ *   uint64_t bits[bitCount / 64]           the levels, one after another
+ *   uint32_t ranks[bitCount / 512 + 1]     set bits before each 512 bits
+ *   uint32_t offsets[keyCount + 1]         key i lists records[offsets[i]..offsets[i + 1])
+ *   uint32_t records[recordCount]          record numbers - 1, in file order per key
+ */
+
+#ifndef MDB_MPH_H
+#define MDB_MPH_H
+
+#include <stddef.h>     /* for size_t */
+#include <stdint.h>     /* for uint64_t */
+
+#define MDB_MPH_MAGIC "MDBMPH2"
+#define MDB_MPH_MAX_LEVELS 32
+#define MDB_MPH_RANK_BITS 512
+#define MDB_MPH_SAMPLE_RECORDS 1024
+
+struct MdbMphHeader {
+    char magic[8];
+    uint64_t recordCount;       /* Records in the database it was built from */
+    uint64_t databaseSize;      /* Size of that database file in bytes */
+    int64_t databaseMtime;      /* Its modification time */
+    uint64_t sampleChecksum;    /* mdbMphSampleChecksum() of its records */
+    uint64_t keyCount;          /* Distinct names */
+    uint64_t bitCount;          /* Bits of all levels, a multiple of 512 */
+    uint32_t seed;
+    uint32_t levelCount;
+    uint64_t levelStart[MDB_MPH_MAX_LEVELS + 1];   /* First bit of each level */
+};
+
+/* A mapped side file */
+struct MdbMph {
+    const struct MdbMphHeader *header;  /* NULL when none is open */
+    const uint64_t *bits;
+    const uint32_t *ranks;
+    const uint32_t *offsets;
+    const uint32_t *records;
+    size_t mappedLength;
+};
+
+/* Hash of a name, from which every level's position is derived */
+uint64_t mdbMphHashKey(const char *key, size_t length, uint32_t seed);
+
+/* Position of a key's bit within a level of levelBits bits */
+uint64_t mdbMphPosition(uint64_t keyHash, uint32_t level, uint64_t levelBits);
+
+/* FNV-1a over the file bytes of the first and last MDB_MPH_SAMPLE_RECORDS
+ * of recordCount records, read with pread(). Returns 0 and sets
+ * *checksum, or -1 if the file cannot be read. */
+int mdbMphSampleChecksum(int fileDescriptor, size_t recordSize, uint64_t recordCount, uint64_t *checksum);
+
+/* Map a side file and check its layout: sizes, level bounds, and record
+ * lists that stay within the records. Returns 0, or -1 with errno set
+ * (EINVAL for a file that is not a valid side file). */
+int mdbMphOpen(struct MdbMph *mph, const char *path);
+void mdbMphClose(struct MdbMph *mph);
+
+/* Index of a key, 0 to keyCount - 1, or -1 if the name falls through
+ * every level. A name that is not a key may still get an index. */
+int64_t mdbMphIndex(const struct MdbMph *mph, const char *key, size_t length);
+
+/* Records listed for the name's index; *count is 0 if the name maps to
+ * none. The records still have to be checked for the name. */
+const uint32_t *mdbMphFind(const struct MdbMph *mph, const char *key, size_t length, size_t *count);
+
+#endif /* MDB_MPH_H */
@@ -0,0 +1,81 @@
+/*
+ * mdb-schema.c
+ *
+ * Record layouts of database files; see mdb-schema.h.
+ */
+
+#include "mdb.h"
+#include "mdb-schema.h"
+
+#include <ctype.h>      /* for isalnum() */
+#include <stdio.h>      /* for snprintf() */
+#include <stdlib.h>     /* for strtoul() */
+#include <string.h>     /* for strcmp() and memset() */
+
+_Static_assert(sizeof(((struct MdbRec *)0)->name) <= MDB_SCHEMA_MAX_WIDTH && sizeof(((struct MdbRec *)0)->msg) <= MDB_SCHEMA_MAX_WIDTH,
+               "MdbRec fields must fit a one-byte length");
+
+static void addField(struct MdbSchema *schema, const char *name, size_t nameLength, size_t width)
+{
+    struct MdbField *field = &schema->fields[schema->fieldCount++];
+
+    memset(field->name, 0, sizeof(field->name));
+    memcpy(field->name, name, nameLength);
+    field->offset = schema->recordSize;
+    field->width = width;
+    schema->recordSize += width;
+}
+
+void mdbSchemaDefault(struct MdbSchema *schema)
+{
+    memset(schema, 0, sizeof(*schema));
+    addField(schema, "name", 4, sizeof(((struct MdbRec *)0)->name));
+    addField(schema, "msg", 3, sizeof(((struct MdbRec *)0)->msg));
+}
+
+int mdbSchemaParse(struct MdbSchema *schema, const char *spec)
+{
+    memset(schema, 0, sizeof(*schema));
+    while (*spec)
+    {
+        const char *name = spec;
+        size_t nameLength = 0;
+        char *end;
+
+        while (isalnum((unsigned char)name[nameLength]) || name[nameLength] == '_')
+            nameLength++;
+        if (nameLength == 0 || nameLength >= MDB_SCHEMA_MAX_NAME || name[nameLength] != ':' ||
+            schema->fieldCount == MDB_SCHEMA_MAX_FIELDS || !isdigit((unsigned char)name[nameLength + 1]))
+            return -1;
+
+        unsigned long width = strtoul(name + nameLength + 1, &end, 10);
+        if (width < 1 || width > MDB_SCHEMA_MAX_WIDTH || (*end != ',' && *end != '\0'))
+            return -1;
+        for (int f = 0; f < schema->fieldCount; f++)
+            if (strlen(schema->fields[f].name) == nameLength && memcmp(schema->fields[f].name, name, nameLength) == 0)
+                return -1;
+
+        addField(schema, name, nameLength, width);
+        spec = *end == ',' ? end + 1 : end;
+        if (*end == ',' && *spec == '\0')
+            return -1;  /* A trailing comma */
+    }
+    return schema->fieldCount > 0 ? 0 : -1;
+}
+
+int mdbSchemaField(const struct MdbSchema *schema, const char *name)
+{
+    for (int f = 0; f < schema->fieldCount; f++)
+        if (strcmp(schema->fields[f].name, name) == 0)
+            return f;
+    return -1;
+}
+
+void mdbSchemaDescribe(const struct MdbSchema *schema, char *buffer, size_t size)
+{
+    size_t length = 0;
+
+    buffer[0] = '\0';
+    for (int f = 0; f < schema->fieldCount && length < size; f++)
+        length += snprintf(buffer + length, size - length, "%s%s:%zu", f ? "," : "", schema->fields[f].name, schema->fields[f].width);
+}
@@ -0,0 +1,51 @@
+/*
+ * mdb-schema.h
+ *
+ * Record layout of a database file: a fixed number of fixed-width,
+ * NUL-padded text fields, one record after another with no header. The
+ * default is the layout of struct MdbRec; -f on the command line of the
+ * server and the tools gives another one, e.g.
+ *   -f name:32,city:24,msg:128
+ * The first field is the name that "=name", "^prefix", the ART and the
+ * exact-name side file work on.
+ *
+ * Every field is at most MDB_SCHEMA_MAX_WIDTH bytes, so that its length
+ * fits in one byte once its last byte is reserved for the NUL.
+ */
+
+#ifndef MDB_SCHEMA_H
+#define MDB_SCHEMA_H
+
+#include <stddef.h>     /* for size_t */
+
+#define MDB_SCHEMA_MAX_FIELDS 8
+#define MDB_SCHEMA_MAX_WIDTH 256
+#define MDB_SCHEMA_MAX_NAME 32
+#define MDB_SCHEMA_MAX_RECORD (MDB_SCHEMA_MAX_FIELDS * MDB_SCHEMA_MAX_WIDTH)
+
+struct MdbField {
+    char name[MDB_SCHEMA_MAX_NAME];
+    size_t offset;              /* Bytes before the field in a record */
+    size_t width;               /* Bytes of the field, its NUL included */
+};
+
+struct MdbSchema {
+    int fieldCount;
+    size_t recordSize;          /* Sum of the widths */
+    struct MdbField fields[MDB_SCHEMA_MAX_FIELDS];
+};
+
+/* The layout of struct MdbRec in mdb.h */
+void mdbSchemaDefault(struct MdbSchema *schema);
+
+/* Parse "field:width,..." into schema. Returns 0, or -1 if the spec is
+ * malformed, names a field twice, or exceeds the limits above. */
+int mdbSchemaParse(struct MdbSchema *schema, const char *spec);
+
+/* Index of the field called name, or -1 */
+int mdbSchemaField(const struct MdbSchema *schema, const char *name);
+
+/* Write the schema as a spec mdbSchemaParse() accepts, for logs */
+void mdbSchemaDescribe(const struct MdbSchema *schema, char *buffer, size_t size);
+
+#endif /* MDB_SCHEMA_H */